@@ -0,0 +1,145 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "stats.h"
+
+// Axis-aligned bounding box
+class aabb {
+   public:
+    point3 minimum;
+    point3 maximum;
+
+    // The default box is empty: it contains nothing and expands to anything
+    aabb()
+        : minimum(infinity, infinity, infinity),
+          maximum(-infinity, -infinity, -infinity) {}
+    aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+    point3 min() const { return minimum; }
+    point3 max() const { return maximum; }
+
+    // Slab test, inv_dir is 1 / r.direction() precomputed by the caller.
+    // The far distance is rounded up by the bound of its error, so a ray
+    // through an edge or corner of the box is never culled by rounding:
+    // watertight triangles stay watertight behind a BVH.
+    inline bool hit(const ray& r, const vec3& inv_dir, real t_min,
+                    real t_max) const {
+        RT_STAT(box_tests, 1);
+        // above the 1 + 2 gamma(3) of Physically Based Rendering, 3.9
+        const real far_scale =
+            1 + 6 * std::numeric_limits<real>::epsilon();
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (minimum[a] - r.orig[a]) * inv_dir[a];
+            auto t1 = (maximum[a] - r.orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0.0) std::swap(t0, t1);
+            t1 *= far_scale;
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min) return false;
+        }
+        return true;
+    }
+
+    // Grow the box to contain p
+    void expand(const point3& p) {
+        for (int a = 0; a < 3; a++) {
+            minimum[a] = std::min(minimum[a], p[a]);
+            maximum[a] = std::max(maximum[a], p[a]);
+        }
+    }
+
+    // Grow the box to contain another box
+    void expand(const aabb& box) {
+        for (int a = 0; a < 3; a++) {
+            minimum[a] = std::min(minimum[a], box.minimum[a]);
+            maximum[a] = std::max(maximum[a], box.maximum[a]);
+        }
+    }
+
+    bool empty() const { return maximum.x() < minimum.x(); }
+
+    point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+    // Returns the index of the longest axis
+    int longest_axis() const {
+        auto d = maximum - minimum;
+        if (d.x() > d.y() && d.x() > d.z()) return 0;
+        return d.y() > d.z() ? 1 : 2;
+    }
+
+    double surface_area() const {
+        if (empty()) return 0;
+        auto d = maximum - minimum;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+};
+
+// Returns the smallest box containing both boxes
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+    aabb box = box0;
+    box.expand(box1);
+    return box;
+}
+
+// The box a fraction s of the way from box0 to box1
+inline aabb interpolate(const aabb& box0, const aabb& box1, real s) {
+    return aabb(box0.minimum + s * (box1.minimum - box0.minimum),
+                box0.maximum + s * (box1.maximum - box0.maximum));
+}
+
+// The box of a moving object at a time
+struct timed_box {
+    double time;
+    aabb box;
+};
+
+// The box at time of an object moving linearly between keys, sorted by
+// time, and standing still before the first and after the last
+aabb box_at(const std::vector<timed_box>& keys, double time) {
+    if (time <= keys.front().time) return keys.front().box;
+    if (time >= keys.back().time) return keys.back().box;
+    size_t i = 1;
+    while (keys[i].time <= time) i++;
+    const auto& a = keys[i - 1];
+    const auto& b = keys[i];
+    return interpolate(a.box, b.box, (time - a.time) / (b.time - a.time));
+}
+
+// Boxes at time0 and time1 that, interpolated, bound an object moving
+// like in box_at at any time in between. They start as its boxes at the
+// two times, and are pushed out together wherever a key in between sticks
+// out: between keys the object and the bound are both linear, so bounding
+// it at the keys bounds it throughout.
+void linear_bounds(const std::vector<timed_box>& keys, double time0,
+                   double time1, aabb& box0, aabb& box1) {
+    box0 = box_at(keys, time0);
+    box1 = box_at(keys, time1);
+    if (time1 <= time0) {
+        box0.expand(box1);
+        box1 = box0;
+        return;
+    }
+    for (const auto& key : keys) {
+        if (key.time <= time0 || key.time >= time1) continue;
+        auto b = interpolate(box0, box1, (key.time - time0) / (time1 - time0));
+        for (int a = 0; a < 3; a++) {
+            auto below = b.minimum[a] - key.box.minimum[a];
+            if (below > 0) {
+                box0.minimum[a] -= below;
+                box1.minimum[a] -= below;
+            }
+            auto above = key.box.maximum[a] - b.maximum[a];
+            if (above > 0) {
+                box0.maximum[a] += above;
+                box1.maximum[a] += above;
+            }
+        }
+    }
+}
+
+#endif
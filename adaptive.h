@@ -0,0 +1,86 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <algorithm>
+#include <string>
+
+#include "common.h"
+#include "framebuffer.h"
+#include "image_output.h"
+
+// Running mean and variance of the luminance of a pixel's samples
+// (Welford's algorithm)
+class pixel_estimator {
+   public:
+    pixel_estimator() {}
+    // Restores a saved estimator
+    pixel_estimator(int n, double mean, double squared_deviations)
+        : n(n), avg(mean), m2(squared_deviations) {}
+
+    void add(const color& sample) {
+        auto y = luminance(sample);
+        n++;
+        auto delta = y - avg;
+        avg += delta / n;
+        m2 += delta * (y - avg);
+    }
+
+    int count() const { return n; }
+    double mean() const { return avg; }
+    // Sum of the squared differences from the mean
+    double squared_deviations() const { return m2; }
+
+    // Standard error of the mean luminance, relative to the mean. Dark
+    // pixels are compared to a small floor instead of their mean.
+    double relative_error() const {
+        if (n < 2) return infinity;
+        auto variance = m2 / (n - 1);
+        return sqrt(variance / n) / std::max(avg, 1e-3);
+    }
+
+   private:
+    int n = 0;
+    double avg = 0;
+    double m2 = 0;
+};
+
+// Adaptive sampling stops a pixel once the relative error of its mean is
+// below threshold, after at least min_samples samples
+struct adaptive_settings {
+    double threshold = 0;  // 0 disables adaptive sampling
+    int min_samples = 16;
+
+    bool enabled() const { return threshold > 0; }
+
+    // Whether the pixel can stop sampling
+    bool converged(const pixel_estimator& e) const {
+        return enabled() && e.count() >= min_samples &&
+               e.relative_error() < threshold;
+    }
+};
+
+// Maps t in [0, 1] to a blue - green - red ramp
+color heat_color(double t) {
+    t = clamp(t, 0.0, 1.0);
+    if (t < 0.5) return color(0, 2 * t, 1 - 2 * t);
+    return color(2 * t - 1, 2 - 2 * t, 0);
+}
+
+// Writes the number of samples of every pixel as a heat map, blue for one
+// sample up to red for max_samples
+bool write_sample_map(const std::string& path, const framebuffer& frame,
+                      int max_samples) {
+    int w = frame.width(), h = frame.height();
+    framebuffer map(w, h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            auto t = static_cast<double>(frame.samples(i, j)) / max_samples;
+            // squared, the outputs apply a gamma of 2
+            auto c = heat_color(t);
+            map.set(i, j, color_sum(c * c), 1);
+        }
+    }
+    return write_image(path, format_for_path(path), map);
+}
+
+#endif
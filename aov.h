@@ -0,0 +1,121 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include <string>
+#include <vector>
+
+#include "adaptive.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "image_output.h"
+
+// Auxiliary outputs (AOVs): what the camera ray of a sample hit first.
+// They are noise-free after a few samples and guide the denoiser.
+struct aov_sample {
+    color albedo;  // of the material, the background's if the ray escaped
+    vec3 normal;   // facing the ray, zero if it escaped
+    real depth;    // distance along the ray, zero if it escaped
+    bool hit;      // whether the ray hit anything
+};
+
+// The AOVs of every pixel, averaged over its samples like a framebuffer,
+// and the variance of the samples, which tells the denoiser how far apart
+// the colors of neighbours may be from noise alone. Every AOV is a channel
+// of tiled storage, with the sums in floats.
+class aov_buffer {
+   public:
+    aov_buffer() {}
+    aov_buffer(int w, int h)
+        : w(w),
+          h(h),
+          albedo_sums(w, h, float_rgb{0, 0, 0}),
+          normal_sums(w, h, float_rgb{0, 0, 0}),
+          depth_sums(w, h, 0),
+          counts(w, h, 0),
+          hits(w, h, 0),
+          estimators(w, h) {}
+
+    int width() const { return w; }
+    int height() const { return h; }
+
+    // Adds sample, the color of a path, and the AOVs of its first hit.
+    // Tiles write disjoint pixels, so threads need no locking.
+    void add(int i, int j, const aov_sample& s, const color& sample) {
+        estimators(i, j).add(sample);
+        accumulate(albedo_sums(i, j), s.albedo);
+        accumulate(normal_sums(i, j), s.normal);
+        depth_sums(i, j) += s.depth;
+        counts(i, j)++;
+        hits(i, j) += s.hit;
+    }
+
+    // Whether pixel (i, j) has samples, pixels resumed from a checkpoint
+    // have none
+    bool has(int i, int j) const { return counts(i, j) > 0; }
+
+    color_sum albedo(int i, int j) const {
+        int n = counts(i, j);
+        return n ? average(albedo_sums(i, j), n) : color_sum(1, 1, 1);
+    }
+
+    // The average of the normals, shorter than 1 where they differ
+    color_sum normal(int i, int j) const {
+        int n = counts(i, j);
+        return n ? average(normal_sums(i, j), n) : color_sum(0, 0, 0);
+    }
+
+    // Average distance of the samples that hit, zero if none did
+    double depth(int i, int j) const {
+        int n = hits(i, j);
+        return n ? static_cast<double>(depth_sums(i, j)) / n : 0.0;
+    }
+
+    // Variance of the mean luminance of the samples, zero with fewer than
+    // two
+    double variance(int i, int j) const {
+        const auto& e = estimators(i, j);
+        if (e.count() < 2) return 0;
+        return e.squared_deviations() / (e.count() - 1) / e.count();
+    }
+
+    // Writes the albedo, normal and depth as prefix.albedo.pfm,
+    // prefix.normal.pfm and prefix.depth.pfm, returns false on error
+    bool write(const std::string& prefix) const {
+        framebuffer albedo_frame(w, h), normal_frame(w, h), depth_frame(w, h);
+        for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+                albedo_frame.set(i, j, albedo(i, j), 1);
+                normal_frame.set(i, j, normal(i, j), 1);
+                auto d = depth(i, j);
+                depth_frame.set(i, j, color_sum(d, d, d), 1);
+            }
+        }
+        return write_image(prefix + ".albedo.pfm", image_format::pfm,
+                           albedo_frame) &&
+               write_image(prefix + ".normal.pfm", image_format::pfm,
+                           normal_frame) &&
+               write_image(prefix + ".depth.pfm", image_format::pfm,
+                           depth_frame);
+    }
+
+   private:
+    static void accumulate(float_rgb& sum, const vec3& v) {
+        sum.r += v.x();
+        sum.g += v.y();
+        sum.b += v.z();
+    }
+    static color_sum average(const float_rgb& sum, int n) {
+        return color_sum(sum.r, sum.g, sum.b) / n;
+    }
+
+    int w = 0;
+    int h = 0;
+    tiled_buffer<float_rgb> albedo_sums;
+    tiled_buffer<float_rgb> normal_sums;
+    tiled_buffer<float> depth_sums;
+    tiled_buffer<int> counts;
+    tiled_buffer<int> hits;
+    tiled_buffer<pixel_estimator> estimators;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+// A bump allocator: memory is handed out from large blocks by moving a
+// pointer, and released all at once when the arena is destroyed. Objects
+// created in it are destroyed then too, newest first.
+class arena {
+   public:
+    explicit arena(size_t block_size = 64 << 10) : block_size(block_size) {}
+    ~arena();
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    // size bytes aligned to align, a power of two
+    void* allocate(size_t size, size_t align);
+
+    // Constructs a T in the arena
+    template <typename T, typename... Args>
+    T* create(Args&&... args);
+
+    // Bytes handed out, and bytes of the blocks behind them
+    size_t used() const { return used_bytes; }
+    size_t reserved() const { return reserved_bytes; }
+
+   private:
+    // heads the memory of a block
+    struct block {
+        block* next;
+    };
+    // a destructor to run, for objects that have one
+    struct cleanup {
+        void (*destroy)(void*);
+        void* object;
+    };
+
+    static const size_t max_block_size = 16 << 20;
+
+    block* blocks = nullptr;  // newest first
+    char* top = nullptr;      // free space of the newest block
+    char* end = nullptr;
+    std::vector<cleanup> cleanups;  // in order of creation
+    size_t block_size;
+    size_t used_bytes = 0;
+    size_t reserved_bytes = 0;
+};
+
+arena::~arena() {
+    for (auto c = cleanups.rbegin(); c != cleanups.rend(); ++c)
+        c->destroy(c->object);
+    while (blocks) {
+        auto* next = blocks->next;
+        std::free(blocks);
+        blocks = next;
+    }
+}
+
+void* arena::allocate(size_t size, size_t align) {
+    auto p = (reinterpret_cast<uintptr_t>(top) + align - 1) & ~(align - 1);
+    if (!top || p + size > reinterpret_cast<uintptr_t>(end)) {
+        // blocks grow with the arena, so a big scene takes few of them
+        size_t bytes = std::min(std::max(block_size, reserved_bytes / 2),
+                                max_block_size);
+        bytes = std::max(bytes, size + align) + sizeof(block);
+        auto* b = static_cast<block*>(std::malloc(bytes));
+        if (!b) throw std::bad_alloc();
+        b->next = blocks;
+        blocks = b;
+        reserved_bytes += bytes;
+        top = reinterpret_cast<char*>(b + 1);
+        end = reinterpret_cast<char*>(b) + bytes;
+        p = (reinterpret_cast<uintptr_t>(top) + align - 1) & ~(align - 1);
+    }
+    top = reinterpret_cast<char*>(p + size);
+    used_bytes += size;
+    return reinterpret_cast<void*>(p);
+}
+
+template <typename T, typename... Args>
+T* arena::create(Args&&... args) {
+    T* object = new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+        cleanups.push_back({[](void* p) { static_cast<T*>(p)->~T(); }, object});
+    return object;
+}
+
+// The objects and materials of a scene, in an arena with the lifetime of
+// the scene. make() returns shared_ptrs that own nothing: creating and
+// copying them allocates no control block and counts no references, and
+// they are valid as long as the scene_arena is. Whatever holds them keeps
+// the arena alive, see hittable_list::owner.
+class scene_arena {
+   public:
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        // the aliasing constructor, with nothing to share
+        return shared_ptr<T>(shared_ptr<T>(),
+                             memory.create<T>(std::forward<Args>(args)...));
+    }
+
+    // Keeps other alive as long as the arena
+    void keep(shared_ptr<const void> other) {
+        if (other) memory.create<shared_ptr<const void>>(std::move(other));
+    }
+
+    size_t used() const { return memory.used(); }
+
+   private:
+    arena memory;
+};
+
+#endif
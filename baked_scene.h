@@ -0,0 +1,257 @@
+#ifndef BAKED_SCENE_H
+#define BAKED_SCENE_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "common.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "stats.h"
+
+// A scene compiled for tracing. The spheres of a hittable_list are copied
+// into contiguous arrays in BVH leaf order and refer to their material by
+// a 32-bit index into a table, and the BVH is an array of nodes walked
+// with a stack. A ray costs one virtual call to enter the scene instead
+// of one per node and primitive, and no pointers are chased. The arrays
+// are either built by the scene or adopted from a mapped scene cache. The
+// class is final, so kernels compiled for it call hit directly.
+class baked_scene final : public hittable {
+   public:
+    baked_scene() = default;
+    // data points into the vectors of the scene
+    baked_scene(const baked_scene&) = delete;
+    baked_scene& operator=(const baked_scene&) = delete;
+
+    // One node per cache line. The left child of an inner node follows
+    // it in the array.
+    struct alignas(64) node {
+        aabb box;
+        int first;  // first sphere of a leaf, or the right child
+        int count;  // spheres in the leaf, 0 for an inner node
+        int axis;   // split axis of an inner node
+    };
+
+    // The arrays traced, see scene_cache.h
+    struct arrays {
+        const node* nodes = nullptr;
+        size_t node_count = 0;
+        const real *cx = nullptr, *cy = nullptr, *cz = nullptr;
+        const real* radius = nullptr;
+        size_t sphere_count = 0;
+        const uint32_t* material_id = nullptr;
+    };
+
+    // Bakes the spheres of world, returns false and stays empty if world
+    // contains anything else than spheres
+    bool build(const hittable_list& world);
+
+    // Traces arrays baked before, with the given material table. The
+    // memory behind both is kept alive by owner.
+    void adopt(const arrays& baked, std::vector<const material*> table,
+               shared_ptr<const void> owner);
+
+    bool empty() const { return data.node_count == 0; }
+    size_t sphere_count() const { return data.sphere_count; }
+    size_t material_count() const { return materials.size(); }
+    const arrays& baked() const { return data; }
+    const std::vector<const material*>& material_table() const {
+        return materials;
+    }
+    // The kinds of the materials in the table, see kind_bit
+    unsigned material_kinds() const {
+        unsigned kinds = 0;
+        for (const material* m : materials) kinds |= kind_bit(m->kind);
+        return kinds;
+    }
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const {
+        if (empty()) return false;
+        output_box = data.nodes[0].box;
+        return true;
+    }
+
+   private:
+    static const int max_leaf_size = 4;
+
+    // Builds the node of items[start, end) at depth, returns its index
+    int build_node(std::vector<bvh_build_item>& items, size_t start,
+                   size_t end, int depth,
+                   const std::vector<const sphere*>& source,
+                   std::unordered_map<const material*, uint32_t>& ids);
+
+    // Returns whether sphere k is hit between t_min and t_max, at t. The
+    // arithmetic is the same as sphere::hit.
+    bool hit_sphere(int k, const ray& r, real t_min, real t_max,
+                    real& t) const {
+        RT_STAT(sphere_tests, 1);
+        point3 center(data.cx[k], data.cy[k], data.cz[k]);
+        vec3 oc = r.origin() - center;
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - data.radius[k] * data.radius[k];
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant <= 0) return false;
+        auto root = sqrt(discriminant);
+        t = (-half_b - root) / a;
+        if (t < t_max && t > t_min) return true;
+        t = (-half_b + root) / a;
+        return t < t_max && t > t_min;
+    }
+
+    // Points data at the vectors of a built scene
+    void use_built_arrays();
+
+    arrays data;
+    // materials by id, kept alive by owners or owner
+    std::vector<const material*> materials;
+    // a built scene
+    std::vector<node> nodes;
+    std::vector<real> cx, cy, cz, radius;
+    std::vector<uint32_t> material_id;
+    std::vector<shared_ptr<material>> owners;
+    // an adopted scene, or the owner of the world of a built one
+    shared_ptr<const void> owner;
+};
+
+bool baked_scene::build(const hittable_list& world) {
+    nodes.clear();
+    for (auto* v : {&cx, &cy, &cz, &radius}) v->clear();
+    material_id.clear();
+    materials.clear();
+    owners.clear();
+    owner.reset();
+    data = arrays();
+    std::vector<const sphere*> source;
+    std::vector<bvh_build_item> items;
+    for (const auto& object : world.objects) {
+        auto s = dynamic_cast<const sphere*>(object.get());
+        if (!s) return false;
+        aabb box;
+        s->bounding_box(box);
+        items.push_back({box, box.centroid(), source.size()});
+        source.push_back(s);
+    }
+    if (items.empty()) return false;
+    owner = world.owner;
+    std::unordered_map<const material*, uint32_t> ids;
+    build_node(items, 0, items.size(), 0, source, ids);
+    use_built_arrays();
+    return true;
+}
+
+void baked_scene::use_built_arrays() {
+    data.nodes = nodes.data();
+    data.node_count = nodes.size();
+    data.cx = cx.data();
+    data.cy = cy.data();
+    data.cz = cz.data();
+    data.radius = radius.data();
+    data.sphere_count = radius.size();
+    data.material_id = material_id.data();
+}
+
+void baked_scene::adopt(const arrays& baked,
+                        std::vector<const material*> table,
+                        shared_ptr<const void> owner) {
+    nodes.clear();
+    for (auto* v : {&cx, &cy, &cz, &radius}) v->clear();
+    material_id.clear();
+    owners.clear();
+    data = baked;
+    materials = std::move(table);
+    this->owner = std::move(owner);
+}
+
+int baked_scene::build_node(
+    std::vector<bvh_build_item>& items, size_t start, size_t end, int depth,
+    const std::vector<const sphere*>& source,
+    std::unordered_map<const material*, uint32_t>& ids) {
+    int index = nodes.size();
+    nodes.push_back(node());
+    for (size_t i = start; i < end; i++) nodes[index].box.expand(items[i].box);
+    nodes[index].axis = nodes[index].box.longest_axis();
+
+    if (end - start <= max_leaf_size) {
+        nodes[index].first = radius.size();
+        nodes[index].count = end - start;
+        for (size_t i = start; i < end; i++) {
+            auto s = source[items[i].index];
+            cx.push_back(s->center.x());
+            cy.push_back(s->center.y());
+            cz.push_back(s->center.z());
+            radius.push_back(s->radius);
+            // materials shared by several spheres get a single id
+            auto found = ids.find(s->mat_ptr.get());
+            if (found == ids.end()) {
+                found = ids.emplace(s->mat_ptr.get(), materials.size()).first;
+                materials.push_back(s->mat_ptr.get());
+                owners.push_back(s->mat_ptr);
+            }
+            material_id.push_back(found->second);
+        }
+        return index;
+    }
+
+    auto mid = bvh_partition(items, start, end, depth);
+    // the left child follows
+    build_node(items, start, mid, depth + 1, source, ids);
+    int right = build_node(items, mid, end, depth + 1, source, ids);
+    nodes[index].first = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+bool baked_scene::hit(const ray& r, real t_min, real t_max,
+                      hit_record& rec) const {
+    if (empty()) return false;
+    const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(),
+                       1 / r.direction().z());
+    int closest = -1;
+    real closest_t = t_max;
+    int stack[bvh_stack_size];
+    int top = 0;
+    int index = 0;
+    for (;;) {
+        const node& n = data.nodes[index];
+        if (n.box.hit(r, inv_dir, t_min, closest_t)) {
+            if (n.count == 0) {
+                // visit the nearer child first so the farther one is culled
+                // by the closest hit
+                int near = index + 1, far = n.first;
+                if (inv_dir[n.axis] < 0) std::swap(near, far);
+                stack[top++] = far;
+                index = near;
+                continue;
+            }
+            for (int k = n.first; k < n.first + n.count; k++) {
+                real t;
+                if (hit_sphere(k, r, t_min, closest_t, t)) {
+                    closest = k;
+                    closest_t = t;
+                }
+            }
+        }
+        if (top == 0) break;
+        index = stack[--top];
+    }
+    if (closest < 0) return false;
+
+    point3 center(data.cx[closest], data.cy[closest], data.cz[closest]);
+    rec.t = closest_t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / data.radius[closest];
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = materials[data.material_id[closest]];
+    return true;
+}
+
+#endif
@@ -0,0 +1,953 @@
+// Performance reports, see README.md for how to build and run them.
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "baked_scene.h"
+#include "bvh.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "hittable_list.h"
+#include "image_output.h"
+#include "instance.h"
+#include "integrator.h"
+#include "light.h"
+#include "material.h"
+#include "packet.h"
+#include "scenes.h"
+#include "scheduler.h"
+#include "sphere.h"
+#include "wavefront.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+double elapsed_ms(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(bench_clock::now() -
+                                                     start)
+        .count();
+}
+
+// n spheres scattered in a cube whose side grows with n, so the density
+// (and therefore the expected hit distance) is the same for every size
+hittable_list sphere_field(int n) {
+    hittable_list world;
+    auto arena = make_shared<scene_arena>();
+    world.owner = arena;
+    auto side = std::cbrt(static_cast<double>(n));
+    auto mat = arena->make<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < n; i++) {
+        point3 center = vec3::random(-side / 2, side / 2);
+        world.add(arena->make<sphere>(center, 0.2, mat));
+    }
+    return world;
+}
+
+// Rays from a point in front of the field towards random points inside it
+std::vector<ray> field_rays(int n, int count) {
+    std::vector<ray> rays;
+    auto side = std::cbrt(static_cast<double>(n));
+    point3 origin(0, 0, side);
+    for (int i = 0; i < count; i++) {
+        point3 target = vec3::random(-side / 2, side / 2);
+        rays.push_back(ray(origin, target - origin));
+    }
+    return rays;
+}
+
+// Returns the average time per ray in nanoseconds
+double trace_ns_per_ray(const hittable& world, const std::vector<ray>& rays,
+                        int count) {
+    auto start = bench_clock::now();
+    for (int i = 0; i < count; i++) {
+        hit_record rec;
+        world.hit(rays[i], 0.001, infinity, rec);
+    }
+    return elapsed_ms(start) * 1e6 / count;
+}
+
+// BVH build time and traversal time against the linear scan of
+// hittable_list, on sphere fields of growing size
+void bvh_scaling_report(const std::vector<int>& sizes) {
+    const int ray_count = 200000;
+    const double linear_budget = 2e8;  // sphere tests spent on linear scans
+    std::printf("%10s %12s %14s %16s %10s\n", "spheres", "build ms",
+                "bvh ns/ray", "linear ns/ray", "speedup");
+    for (int n : sizes) {
+        auto world = sphere_field(n);
+        auto rays = field_rays(n, ray_count);
+
+        auto start = bench_clock::now();
+        bvh_node bvh(world);
+        auto build = elapsed_ms(start);
+
+        auto bvh_ns = trace_ns_per_ray(bvh, rays, ray_count);
+        int linear_count = std::max(
+            100, std::min(ray_count, static_cast<int>(linear_budget / n)));
+        auto linear_ns = trace_ns_per_ray(world, rays, linear_count);
+        std::printf("%10d %12.1f %14.1f %16.1f %9.1fx\n", n, build, bvh_ns,
+                    linear_ns, linear_ns / bvh_ns);
+    }
+}
+
+// Instances of one prototype, a BVH over a field of 1000 spheres, at
+// random positions and rotations in a cube that keeps their density. The
+// memory of the instances and their BVH is set against the spheres and
+// nodes a flattened copy would need at least.
+void instance_report(const std::vector<int>& counts) {
+    const int prototype_size = 1000, ray_count = 200000;
+    auto prototype = make_shared<bvh_node>(sphere_field(prototype_size));
+    aabb prototype_box;
+    prototype->bounding_box(prototype_box);
+    auto prototype_extent = prototype_box.maximum - prototype_box.minimum;
+    std::printf("%10s %14s %12s %14s %16s %12s\n", "instances", "spheres",
+                "build ms", "instanced MB", "flattened MB", "ns/ray");
+    for (int n : counts) {
+        auto side = prototype_extent.x() * std::cbrt(static_cast<double>(n));
+        instance_set set;
+        auto start = bench_clock::now();
+        for (int i = 0; i < n; i++) {
+            auto to_world =
+                affine_transform::translate(vec3::random(-side / 2, side / 2)) *
+                affine_transform::rotate(vec3(0, 1, 0), random_double(0, 360));
+            set.add(instance(prototype, to_world));
+        }
+        set.build();
+        auto build = elapsed_ms(start);
+
+        std::vector<ray> rays;
+        point3 origin(0, 0, side);
+        for (int i = 0; i < ray_count; i++)
+            rays.push_back(
+                ray(origin, vec3::random(-side / 2, side / 2) - origin));
+        auto ns = trace_ns_per_ray(set, rays, ray_count);
+        double spheres = static_cast<double>(n) * prototype_size;
+        double flattened = spheres * (sizeof(sphere) + sizeof(bvh_node));
+        std::printf("%10d %14.0f %12.1f %14.1f %16.1f %12.1f\n", n, spheres,
+                    build, set.memory() / 1e6, flattened / 1e6, ns);
+    }
+}
+
+// Primary rays of random_scene() through every pixel of a w * h image
+std::vector<ray> primary_rays(int w, int h) {
+    auto cam = random_scene_camera(static_cast<double>(w) / h);
+    std::vector<ray> rays;
+    for (int j = h - 1; j >= 0; j--)
+        for (int i = 0; i < w; i++)
+            rays.push_back(cam.get_ray((i + random_double()) / (w - 1),
+                                       (j + random_double()) / (h - 1)));
+    return rays;
+}
+
+// Primary ray throughput on random_scene(): one ray at a time through
+// bvh_node, against packets of rays through sphere_packet_bvh with every
+// instruction set this CPU supports. Packet hits are refined in double
+// precision like the renderer does.
+void packet_report() {
+    const int w = 640, h = 360, repeat = 5;
+    auto scene = random_scene();
+    bvh_node world(scene);
+    sphere_packet_bvh packets;
+    packets.build(scene);
+    auto rays = primary_rays(w, h);
+    long total = static_cast<long>(rays.size()) * repeat;
+
+    std::printf("%-14s %10s %10s\n", "kernel", "Mrays/s", "speedup");
+    auto start = bench_clock::now();
+    long hits = 0;
+    for (int k = 0; k < repeat; k++) {
+        for (const auto& r : rays) {
+            hit_record rec;
+            hits += world.hit(r, 0.001, infinity, rec);
+        }
+    }
+    auto scalar_mrays = total / (elapsed_ms(start) * 1e3);
+    std::printf("%-14s %10.2f %9.2fx\n", "bvh_node", scalar_mrays, 1.0);
+
+    for (auto level : {simd_level::scalar, simd_level::sse, simd_level::avx2}) {
+        if (level > best_simd_level()) continue;
+        int width = packet_width(level);
+        long packet_hits = 0;
+        ray_packet p;
+        start = bench_clock::now();
+        for (int k = 0; k < repeat; k++) {
+            for (size_t base = 0; base < rays.size(); base += width) {
+                p.size = std::min<size_t>(width, rays.size() - base);
+                for (int lane = 0; lane < p.size; lane++)
+                    p.set(lane, rays[base + lane], 0.001);
+                packets.intersect(p, level);
+                for (int lane = 0; lane < p.size; lane++) {
+                    hit_record rec;
+                    if (p.hit[lane] >= 0 &&
+                        packets.refine(static_cast<int>(p.hit[lane]),
+                                       rays[base + lane], 0.001, infinity,
+                                       rec))
+                        packet_hits++;
+                }
+            }
+        }
+        auto mrays = total / (elapsed_ms(start) * 1e3);
+        std::printf("%-14s %10.2f %9.2fx\n",
+                    ("packet " + simd_level_name(level)).c_str(), mrays,
+                    mrays / scalar_mrays);
+        if (packet_hits != hits)
+            std::printf("  (%ld hits instead of %ld)\n", packet_hits, hits);
+    }
+}
+
+// Counts the rays traced through a world, on a cache line of its own so
+// counters of different threads do not contend
+class alignas(64) counting_world : public hittable {
+   public:
+    counting_world(const hittable& world) : world(world) {}
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const {
+        rays++;
+        return world.hit(r, t_min, t_max, rec);
+    }
+
+    virtual bool bounding_box(aabb& output_box) const {
+        return world.bounding_box(output_box);
+    }
+
+    mutable long rays = 0;
+
+   private:
+    const hittable& world;
+};
+
+// Full paths through random_scene() with and without Russian roulette,
+// the rays split between `threads` threads that share the scene. A bounce
+// is one ray traced through the BVH.
+void path_report(int threads) {
+    const int w = 320, h = 180, repeat = 4;
+    auto scene = random_scene();
+    bvh_node bvh(scene);
+    auto rays = primary_rays(w, h);
+
+    std::printf("%d threads\n", threads);
+    std::printf("%-14s %12s %12s %14s %10s\n", "roulette", "Mbounces/s",
+                "ns/bounce", "bounces/path", "mean");
+    for (int depth : {50, 8, 5, 3}) {
+        path_limits limits;
+        light_list lights;  // none, the sky is found by scattering
+        limits.roulette_depth = depth;
+        std::vector<counting_world> worlds(threads, counting_world(bvh));
+        std::vector<color> sums(threads, color(0, 0, 0));
+        auto trace = [&](int t) {
+            color sum(0, 0, 0);
+            for (int k = 0; k < repeat; k++) {
+                for (size_t i = t; i < rays.size(); i += threads) {
+                    seed_sample(0, i, k);
+                    sum += ray_color(rays[i], worlds[t], lights, limits);
+                }
+            }
+            sums[t] = sum;
+        };
+        auto start = bench_clock::now();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++) pool.emplace_back(trace, t);
+        for (auto& thread : pool) thread.join();
+        auto ms = elapsed_ms(start);
+
+        long bounces = 0;
+        color sum(0, 0, 0);
+        for (int t = 0; t < threads; t++) {
+            bounces += worlds[t].rays;
+            sum += sums[t];
+        }
+        long paths = static_cast<long>(rays.size()) * repeat;
+        std::string name =
+            depth >= limits.max_depth ? "off" : "from " + std::to_string(depth);
+        std::printf("%-14s %12.2f %12.1f %14.2f %10.4f\n", name.c_str(),
+                    bounces / (ms * 1e3), ms * 1e6 / bounces,
+                    static_cast<double>(bounces) / paths,
+                    luminance(sum / paths));
+    }
+}
+
+// Renders random_scene() on one thread with the megakernel, one path at a
+// time like main.cc, and with the wavefront engine, tracing its batches
+// one ray at a time and in packets. Both engines trace the same paths, the
+// wavefront engine counts their rays.
+void wavefront_report() {
+    const int w = 320, h = 180, spp = 8;
+    auto scene = random_scene();
+    bvh_node world(scene);
+    sphere_packet_bvh packets;
+    packets.build(scene);
+    auto cam = random_scene_camera(static_cast<double>(w) / h);
+    path_limits limits;
+    light_list lights;
+    adaptive_settings adaptive;
+    auto tiles = make_tiles(w, h, 32, tile_order::scanline);
+    std::vector<pixel_estimator> no_estimators;
+
+    auto start = bench_clock::now();
+    for (const auto& t : tiles) {
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                pixel_sampler sampler(sampler_type::sobol, i, j, w, 0);
+                color sum(0, 0, 0);
+                for (int s = 0; s < spp; s++) {
+                    sampler.start_sample(s);
+                    double du, dv, lens_u, lens_v;
+                    sampler.next_2d(du, dv);
+                    sampler.next_2d(lens_u, lens_v);
+                    ray r = cam.get_ray((i + du) / (w - 1),
+                                        (j + dv) / (h - 1), lens_u, lens_v);
+                    sum += ray_color(r, world, lights, limits);
+                }
+            }
+        }
+    }
+    auto megakernel_ms = elapsed_ms(start);
+
+    std::printf("%-20s %10s %10s\n", "engine", "Mrays/s", "speedup");
+    double rays = 0;
+    for (auto level : {simd_level::scalar, simd_level::sse, simd_level::avx2}) {
+        if (level > best_simd_level()) continue;
+        wavefront_engine engine(world, lights, cam, w, h,
+                                sampler_type::sobol, 0, limits, adaptive);
+        if (level != simd_level::scalar) engine.use_packets(packets, level);
+        framebuffer frame(w, h);
+        start = bench_clock::now();
+        for (const auto& t : tiles)
+            engine.render_tile(t, spp, no_estimators, frame);
+        auto ms = elapsed_ms(start);
+        if (level == simd_level::scalar) {
+            rays = engine.rays_traced();
+            std::printf("%-20s %10.2f %9.2fx\n", "megakernel",
+                        rays / (megakernel_ms * 1e3), 1.0);
+        }
+        std::string name = "wavefront";
+        if (level != simd_level::scalar)
+            name += " " + simd_level_name(level);
+        std::printf("%-20s %10.2f %9.2fx\n", name.c_str(),
+                    rays / (ms * 1e3), megakernel_ms / ms);
+    }
+}
+
+// Resident memory of the process in bytes
+double resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    double pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Memory and time of the framebuffer of a w * h frame: adding a sample to
+// every pixel tile by tile, as a pass does, and encoding the tiles into a
+// mapped PFM file (in /dev/shm if there is one, so the disk stays out) and
+// the whole frame as P6 through a stream
+void framebuffer_report(int w, int h, int threads) {
+    tile_scheduler scheduler(threads);
+    auto tiles = make_tiles(w, h, 32, tile_order::hilbert);
+    auto before = resident_bytes();
+    auto start = bench_clock::now();
+    framebuffer frame(w, h);
+    auto allocate = elapsed_ms(start);
+    auto bytes = resident_bytes() - before;
+    double pixels = static_cast<double>(w) * h;
+
+    const int passes = 4;
+    start = bench_clock::now();
+    for (int pass = 0; pass < passes; pass++) {
+        scheduler.run(tiles, [&](const tile& t, int) {
+            for (int j = t.y0; j < t.y1; j++)
+                for (int i = t.x0; i < t.x1; i++)
+                    frame.set(i, j, frame.sum(i, j) + color_sum(0.5, 0.25, 1),
+                              frame.samples(i, j) + 1);
+        }, false);
+    }
+    auto accumulate = elapsed_ms(start) / passes;
+
+    std::string dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    auto path = dir + "/rt_bench_frame.pfm";
+    auto output = make_output(path, image_format::pfm);
+    start = bench_clock::now();
+    bool ok = output->begin(w, h);
+    if (ok) {
+        scheduler.run(tiles, [&](const tile& t, int) {
+            output->write_tile(t, frame);
+        }, false);
+        ok = output->end(frame);
+    }
+    auto tiled = elapsed_ms(start);
+    std::remove(path.c_str());
+    std::ofstream null("/dev/null", std::ios::binary);
+    stream_output stream(null, image_format::p6);
+    start = bench_clock::now();
+    ok = ok && stream.begin(w, h) && stream.end(frame);
+    auto whole = elapsed_ms(start);
+    if (!ok) std::printf("writing the frame failed\n");
+
+    std::printf("%dx%d on %d threads, %.1f MB, %.1f bytes per pixel\n", w, h,
+                scheduler.threads(), bytes / 1e6, bytes / pixels);
+    std::printf("%-28s %10s %12s\n", "", "ms", "ns/pixel");
+    std::printf("%-28s %10.1f %12.2f\n", "allocate", allocate,
+                allocate * 1e6 / pixels);
+    std::printf("%-28s %10.1f %12.2f\n", "add a sample to every pixel",
+                accumulate, accumulate * 1e6 / pixels);
+    std::printf("%-28s %10.1f %12.2f\n", "write PFM tiles", tiled,
+                tiled * 1e6 / pixels);
+    std::printf("%-28s %10.1f %12.2f\n", "write P6 frame", whole,
+                whole * 1e6 / pixels);
+}
+
+// A hardware event counter of the calling thread (perf_event_open). Often
+// unavailable in containers and VMs, then valid() is false.
+class perf_counter {
+   public:
+    perf_counter(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~perf_counter() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool valid() const { return fd >= 0; }
+
+    void start() {
+        if (!valid()) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // Events since start()
+    long long stop() {
+        long long count = 0;
+        if (!valid()) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+        return count;
+    }
+
+   private:
+    int fd = -1;
+};
+
+// Closest hits of rays through world, with the time, instructions and
+// cache misses per ray where the counters are available
+void scene_row(const char* name, const hittable& world,
+               const std::vector<ray>& rays, int repeat) {
+    perf_counter instructions(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf_counter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    instructions.start();
+    misses.start();
+    auto start = bench_clock::now();
+    for (int k = 0; k < repeat; k++) {
+        for (const auto& r : rays) {
+            hit_record rec;
+            world.hit(r, 0.001, infinity, rec);
+        }
+    }
+    auto ms = elapsed_ms(start);
+    auto instruction_count = instructions.stop();
+    auto miss_count = misses.stop();
+    double count = static_cast<double>(rays.size()) * repeat;
+    std::printf("%-24s %10.1f", name, ms * 1e6 / count);
+    if (instructions.valid())
+        std::printf(" %14.0f", instruction_count / count);
+    else
+        std::printf(" %14s", "n/a");
+    if (misses.valid())
+        std::printf(" %14.3f\n", miss_count / count);
+    else
+        std::printf(" %14s\n", "n/a");
+}
+
+// bvh_node with its shared_ptr objects against baked_scene, on the primary
+// rays of random_scene() and on a field of 1M spheres that does not fit
+// in the caches
+void scene_report() {
+    std::printf("%-24s %10s %14s %14s\n", "scene", "ns/ray",
+                "instr/ray", "misses/ray");
+    {
+        auto scene = random_scene();
+        bvh_node objects(scene);
+        baked_scene baked;
+        baked.build(scene);
+        auto rays = primary_rays(640, 360);
+        scene_row("random bvh_node", objects, rays, 4);
+        scene_row("random baked", baked, rays, 4);
+    }
+    {
+        const int n = 1000000;
+        auto scene = sphere_field(n);
+        bvh_node objects(scene);
+        baked_scene baked;
+        baked.build(scene);
+        auto rays = field_rays(n, 200000);
+        scene_row("field 1M bvh_node", objects, rays, 1);
+        scene_row("field 1M baked", baked, rays, 1);
+    }
+}
+
+// One measurement of the suite, `better` is "lower" or "higher"
+struct bench_result {
+    std::string name;
+    std::string unit;
+    double value;
+    std::string better;
+};
+
+// Calls body() `repeat` times and returns the fastest run in ms, so a
+// run slowed down by the rest of the machine does not count
+template <typename F>
+double best_ms(int repeat, F&& body) {
+    double best = infinity;
+    for (int k = 0; k < repeat; k++) {
+        auto start = bench_clock::now();
+        body();
+        best = std::min(best, elapsed_ms(start));
+    }
+    return best;
+}
+
+// Keeps a result alive so the compiler cannot drop the work behind it
+volatile double bench_sink;
+
+// Rays from a shell of radius 5 towards the cube [-1.5, 1.5]^3, about
+// half of them hit a unit sphere at the origin
+std::vector<ray> sphere_rays(int count) {
+    thread_rng() = pcg32();
+    std::vector<ray> rays;
+    for (int i = 0; i < count; i++) {
+        point3 origin = 5 * vec3::random_unit_vector();
+        rays.push_back(ray(origin, vec3::random(-1.5, 1.5) - origin));
+    }
+    return rays;
+}
+
+// Time per call of the building blocks of a path
+void micro_benchmarks(std::vector<bench_result>& results) {
+    const int n = 4096, rounds = 256, repeat = 5;
+    const double calls = static_cast<double>(n) * rounds;
+    auto ns = [&](double ms) { return ms * 1e6 / calls; };
+    auto rays = sphere_rays(n);
+
+    sphere unit(point3(0, 0, 0), 1, make_shared<lambertian>(color(0, 0, 0)));
+    auto ms = best_ms(repeat, [&]() {
+        long hits = 0;
+        for (int k = 0; k < rounds; k++) {
+            for (const auto& r : rays) {
+                hit_record rec;
+                hits += unit.hit(r, 0.001, infinity, rec);
+            }
+        }
+        bench_sink = hits;
+    });
+    results.push_back({"sphere::hit", "ns/call", ns(ms), "lower"});
+
+    // the linear scan tests every sphere, a few rounds are enough
+    auto scene = random_scene(1, 4);
+    auto primary = primary_rays(64, 64);
+    const int list_rounds = rounds / 16;
+    ms = best_ms(repeat, [&]() {
+        long hits = 0;
+        for (int k = 0; k < list_rounds; k++) {
+            for (size_t i = 0; i < n; i++) {
+                hit_record rec;
+                hits += scene.hit(primary[i], 0.001, infinity, rec);
+            }
+        }
+        bench_sink = hits;
+    });
+    results.push_back({"hittable_list::hit " +
+                           std::to_string(scene.objects.size()) + " spheres",
+                       "ns/call", ns(ms) * rounds / list_rounds, "lower"});
+
+    // hits on the unit sphere, shaded by every kind of material
+    std::vector<ray> incoming;
+    std::vector<hit_record> hits;
+    for (const auto& r : rays) {
+        hit_record rec;
+        if (!unit.hit(r, 0.001, infinity, rec)) continue;
+        incoming.push_back(r);
+        hits.push_back(rec);
+    }
+    const std::pair<const char*, shared_ptr<material>> materials[] = {
+        {"lambertian", make_shared<lambertian>(color(0.5, 0.5, 0.5))},
+        {"metal", make_shared<metal>(color(0.7, 0.6, 0.5), 0.3)},
+        {"dielectric", make_shared<dielectric>(1.5)},
+    };
+    const double scatters = static_cast<double>(hits.size()) * rounds;
+    for (const auto& m : materials) {
+        ms = best_ms(repeat, [&]() {
+            double sum = 0;
+            for (int k = 0; k < rounds; k++) {
+                for (size_t i = 0; i < hits.size(); i++) {
+                    color attenuation;
+                    ray scattered;
+                    if (scatter(*m.second, incoming[i], hits[i], attenuation,
+                                scattered))
+                        sum += scattered.direction().x();
+                }
+            }
+            bench_sink = sum;
+        });
+        results.push_back({std::string(m.first) + "::scatter", "ns/call",
+                           ms * 1e6 / scatters, "lower"});
+    }
+
+    auto cam = random_scene_camera(16.0 / 9.0);
+    std::vector<double> samples(4 * n);
+    for (auto& u : samples) u = random_double();
+    ms = best_ms(repeat, [&]() {
+        double sum = 0;
+        for (int k = 0; k < rounds; k++) {
+            for (int i = 0; i < n; i++) {
+                const double* u = &samples[4 * i];
+                sum += cam.get_ray(u[0], u[1], u[2], u[3]).direction().x();
+            }
+        }
+        bench_sink = sum;
+    });
+    results.push_back({"camera::get_ray", "ns/call", ns(ms), "lower"});
+
+    std::vector<color_sum> pixels(n);
+    for (auto& c : pixels) c = color_sum(color::random() * 64);
+    ms = best_ms(repeat, [&]() {
+        std::ostringstream out;
+        for (int k = 0; k < rounds; k++) {
+            out.str("");
+            for (const auto& c : pixels) write_color(out, c, 64);
+        }
+        bench_sink = out.tellp();
+    });
+    results.push_back({"write_color", "ns/call", ns(ms), "lower"});
+}
+
+// Renders scene at w * h and spp with `threads` threads like main.cc
+// does: tiles handed out by the scheduler, one path at a time. Returns
+// the time and the rays traced.
+double render_ms(const hittable& world, const camera& cam, int w, int h,
+                 int spp, int threads, long& rays) {
+    tile_scheduler scheduler(threads);
+    auto tiles = make_tiles(w, h, 32, tile_order::hilbert);
+    std::vector<counting_world> worlds(threads, counting_world(world));
+    path_limits limits;
+    light_list lights;
+    auto ms = best_ms(3, [&]() {
+        for (auto& counted : worlds) counted.rays = 0;
+        scheduler.run(
+            tiles,
+            [&](const tile& t, int thread_id) {
+                color sum(0, 0, 0);
+                for (int j = t.y0; j < t.y1; j++) {
+                    for (int i = t.x0; i < t.x1; i++) {
+                        pixel_sampler sampler(sampler_type::sobol, i, j, w,
+                                              0);
+                        for (int s = 0; s < spp; s++) {
+                            sampler.start_sample(s);
+                            double du, dv, lens_u, lens_v;
+                            sampler.next_2d(du, dv);
+                            sampler.next_2d(lens_u, lens_v);
+                            ray r = cam.get_ray((i + du) / (w - 1),
+                                                (j + dv) / (h - 1), lens_u,
+                                                lens_v);
+                            sum += ray_color(r, worlds[thread_id], lights,
+                                             limits);
+                        }
+                    }
+                }
+                bench_sink = sum.x();
+            },
+            false);
+    });
+    rays = 0;
+    for (const auto& counted : worlds) rays += counted.rays;
+    return ms;
+}
+
+// Rays and samples per second on the canonical scenes, random_scene() with
+// a fixed seed at three sizes, through both accelerators
+void render_benchmarks(const std::vector<int>& thread_counts,
+                       std::vector<bench_result>& results) {
+    const int w = 320, h = 180, spp = 4;
+    const std::pair<const char*, int> sizes[] = {
+        {"small", 4}, {"medium", 11}, {"large", 44}};
+    auto cam = random_scene_camera(static_cast<double>(w) / h);
+    for (const auto& size : sizes) {
+        auto scene = random_scene(1, size.second);
+        bvh_node objects(scene);
+        baked_scene baked;
+        baked.build(scene);
+        const std::pair<const char*, const hittable*> accelerators[] = {
+            {"bvh_node", &objects}, {"baked", &baked}};
+        for (const auto& accelerator : accelerators) {
+            for (int threads : thread_counts) {
+                long rays;
+                auto ms = render_ms(*accelerator.second, cam, w, h, spp,
+                                    threads, rays);
+                auto name = std::string("render ") + size.first + " " +
+                            std::to_string(scene.objects.size()) +
+                            " spheres " + accelerator.first + " " +
+                            std::to_string(threads) + "t";
+                results.push_back(
+                    {name, "Mrays/s", rays / (ms * 1e3), "higher"});
+                results.push_back({name, "Msamples/s",
+                                   static_cast<double>(w) * h * spp /
+                                       (ms * 1e3),
+                                   "higher"});
+            }
+        }
+    }
+}
+
+// Samples of w * h * spp camera rays through world on one thread with the
+// integrator kernel ray_color_kernel<World, Kinds, Lights, false>, best of
+// five runs in ms. The sum of the samples goes to sum.
+template <typename World, unsigned Kinds, bool Lights>
+double kernel_ms(const World& world, const light_list& lights,
+                 const camera& cam, int w, int h, int spp, color& sum) {
+    path_limits limits;
+    return best_ms(5, [&]() {
+        sum = color(0, 0, 0);
+        for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+                pixel_sampler sampler(sampler_type::sobol, i, j, w, 0);
+                for (int s = 0; s < spp; s++) {
+                    sampler.start_sample(s);
+                    double du, dv, lens_u, lens_v;
+                    sampler.next_2d(du, dv);
+                    sampler.next_2d(lens_u, lens_v);
+                    ray r = cam.get_ray((i + du) / (w - 1),
+                                        (j + dv) / (h - 1), lens_u, lens_v);
+                    sum += ray_color_kernel<World, Kinds, Lights, false>(
+                        r, world, lights, limits, nullptr);
+                }
+            }
+        }
+        bench_sink = sum.x();
+    });
+}
+
+// The generic kernel, which calls the scene and the materials through
+// their vtables, against the kernels main.cc selects for a baked
+// random_scene(): without lights, and with a light sphere above it that
+// is sampled. Both kernels must give the same sum.
+void kernel_report() {
+    const int w = 320, h = 180, spp = 4;
+    auto cam = random_scene_camera(static_cast<double>(w) / h);
+    const unsigned with_light =
+        weekend_material_kinds | kind_bit(material_kind::light);
+    std::printf("%-12s %12s %12s %12s %9s\n", "scene", "generic ms",
+                "specialized", "Msamples/s", "speedup");
+    for (bool lit : {false, true}) {
+        auto scene = random_scene();
+        if (lit)
+            scene.add(make_shared<sphere>(
+                point3(0, 20, 0), 5,
+                make_shared<diffuse_light>(color(4, 4, 4))));
+        baked_scene baked;
+        baked.build(scene);
+        light_list lights;
+        lights.add_spheres(baked);
+        lights.finish();
+        color generic_sum, sum;
+        auto generic_ms =
+            kernel_ms<hittable, all_material_kinds, true>(
+                baked, lights, cam, w, h, spp, generic_sum);
+        auto ms = lit ? kernel_ms<baked_scene, with_light, true>(
+                            baked, lights, cam, w, h, spp, sum)
+                      : kernel_ms<baked_scene, weekend_material_kinds, false>(
+                            baked, lights, cam, w, h, spp, sum);
+        std::printf("%-12s %12.1f %12.1f %12.3f %8.2fx%s\n",
+                    lit ? "light" : "no lights", generic_ms, ms,
+                    static_cast<double>(w) * h * spp / (ms * 1e3),
+                    generic_ms / ms,
+                    sum.x() == generic_sum.x() ? "" : " (differs)");
+    }
+}
+
+// Escapes the quotes and backslashes of s for a JSON string
+std::string json_string(const std::string& s) {
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Prints the suite as JSON, one result per line so builds can be compared
+// with `bench compare`
+void print_json(const std::vector<bench_result>& results) {
+    std::printf("{\n  \"build\": {\"precision\": %s, \"aligned_vec3\": %s, "
+                "\"compiler\": %s},\n",
+                sizeof(real) == sizeof(float) ? "\"float\"" : "\"double\"",
+#ifdef RT_ALIGNED_VEC3
+                "true",
+#else
+                "false",
+#endif
+                json_string(__VERSION__).c_str());
+    std::printf("  \"hardware_threads\": %d,\n", default_thread_count());
+    std::printf("  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        std::printf("    {\"name\": %s, \"unit\": %s, \"value\": %.6g, "
+                    "\"better\": %s}%s\n",
+                    json_string(r.name).c_str(), json_string(r.unit).c_str(),
+                    r.value, json_string(r.better).c_str(),
+                    i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+}
+
+// The fixed benchmark suite: microbenchmarks, then renders with every
+// thread count, printed as JSON
+void suite_report(std::vector<int> thread_counts) {
+    if (thread_counts.empty())
+        for (int t = 1; t <= default_thread_count(); t *= 2)
+            thread_counts.push_back(t);
+    std::vector<bench_result> results;
+    micro_benchmarks(results);
+    render_benchmarks(thread_counts, results);
+    print_json(results);
+}
+
+// Reads the value of "key": in a result line printed by print_json
+bool json_field(const std::string& line, const std::string& key,
+                std::string& value) {
+    auto at = line.find("\"" + key + "\": ");
+    if (at == std::string::npos) return false;
+    at += key.size() + 4;
+    if (line[at] != '"') {
+        value = line.substr(at, line.find_first_of(",}", at) - at);
+        return true;
+    }
+    value.clear();
+    for (at++; at < line.size() && line[at] != '"'; at++) {
+        if (line[at] == '\\') at++;
+        value += line[at];
+    }
+    return true;
+}
+
+// Reads the results of a file printed by print_json
+bool read_results(const std::string& path,
+                  std::vector<bench_result>& results) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        bench_result r;
+        std::string value;
+        if (!json_field(line, "name", r.name) ||
+            !json_field(line, "unit", r.unit) ||
+            !json_field(line, "value", value) ||
+            !json_field(line, "better", r.better))
+            continue;
+        r.value = std::atof(value.c_str());
+        results.push_back(r);
+    }
+    return true;
+}
+
+// Compares the results of two suites and flags every result that got
+// worse by more than tolerance percent. Returns the number of them.
+int compare_report(const std::string& base_path, const std::string& new_path,
+                   double tolerance) {
+    std::vector<bench_result> base, current;
+    if (!read_results(base_path, base) || !read_results(new_path, current))
+        return -1;
+    int regressions = 0;
+    std::printf("%-50s %10s %10s %9s\n", "result", "base", "new", "change");
+    for (const auto& r : current) {
+        auto old = std::find_if(base.begin(), base.end(),
+                                [&](const bench_result& b) {
+                                    return b.name == r.name &&
+                                           b.unit == r.unit;
+                                });
+        if (old == base.end() || old->value == 0) continue;
+        // positive when better
+        double change = (r.value / old->value - 1) * 100;
+        if (r.better == "lower") change = -change;
+        bool regressed = change < -tolerance;
+        regressions += regressed;
+        std::printf("%-50s %10.4g %10.4g %+8.1f%%%s\n",
+                    (r.name + " " + r.unit).c_str(), old->value, r.value,
+                    change, regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+// Usage: bench [bvh [sizes...] | packets | paths [threads] | wavefront |
+// scene | kernels | framebuffer [w h [threads]]], runs every report by
+// default.
+// bench json [threads...] prints the benchmark suite as JSON, bench
+// compare BASE NEW [tolerance %] exits with 1 if NEW regressed from BASE by
+// more than tolerance (10 %).
+int main(int argc, char** argv) {
+    std::string report = argc > 1 ? argv[1] : "all";
+    if (report == "json") {
+        std::vector<int> thread_counts;
+        for (int i = 2; i < argc; i++)
+            thread_counts.push_back(std::atoi(argv[i]));
+        suite_report(thread_counts);
+        return 0;
+    }
+    if (report == "compare") {
+        if (argc < 4) {
+            std::cerr << "Usage: bench compare BASE.json NEW.json "
+                         "[tolerance %]\n";
+            return 2;
+        }
+        double tolerance = argc > 4 ? std::atof(argv[4]) : 10;
+        auto regressions = compare_report(argv[2], argv[3], tolerance);
+        if (regressions < 0) return 2;
+        std::printf("%d regressions\n", regressions);
+        return regressions > 0 ? 1 : 0;
+    }
+    if (report == "all" || report == "bvh") {
+        std::vector<int> sizes;
+        for (int i = 2; i < argc; i++) sizes.push_back(std::atoi(argv[i]));
+        if (sizes.empty()) sizes = {1000, 100000, 1000000};
+        bvh_scaling_report(sizes);
+    }
+    if (report == "all" || report == "instances") {
+        std::vector<int> counts;
+        for (int i = 2; i < argc; i++) counts.push_back(std::atoi(argv[i]));
+        if (counts.empty()) counts = {1000, 100000, 1000000};
+        instance_report(counts);
+    }
+    if (report == "all" || report == "packets") packet_report();
+    if (report == "all" || report == "paths")
+        path_report(report == "paths" && argc > 2 ? std::atoi(argv[2]) : 1);
+    if (report == "all" || report == "wavefront") wavefront_report();
+    if (report == "all" || report == "scene") scene_report();
+    if (report == "all" || report == "kernels") kernel_report();
+    if (report == "all" || report == "framebuffer") {
+        int w = argc > 3 ? std::atoi(argv[2]) : 7680;
+        int h = argc > 3 ? std::atoi(argv[3]) : 4320;
+        framebuffer_report(w, h, argc > 4 ? std::atoi(argv[4]) : 0);
+    }
+    return 0;
+}
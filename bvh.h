@@ -0,0 +1,467 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "aabb.h"
+#include "arena.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+// A primitive as seen by the BVH builder: its bounds, its centroid and the
+// index of the primitive in the caller's array
+struct bvh_build_item {
+    aabb box;
+    point3 centroid;
+    size_t index;
+};
+
+const int sah_bin_count = 16;
+
+// Splits items[start, end) in two with the binned surface area heuristic.
+// Returns the index of the first item of the right half, both halves are
+// guaranteed to be non-empty when end - start >= 2.
+size_t sah_partition(std::vector<bvh_build_item>& items, size_t start,
+                     size_t end) {
+    struct bin {
+        aabb box;
+        size_t count = 0;
+    };
+
+    aabb centroid_bounds;
+    for (size_t i = start; i < end; i++)
+        centroid_bounds.expand(items[i].centroid);
+
+    auto best_cost = infinity;
+    int best_axis = -1;
+    int best_split = 0;  // bins [0, best_split] go to the left half
+    for (int axis = 0; axis < 3; axis++) {
+        auto lo = centroid_bounds.minimum[axis];
+        auto extent = centroid_bounds.maximum[axis] - lo;
+        if (extent <= 0) continue;
+        auto scale = sah_bin_count / extent;
+
+        bin bins[sah_bin_count];
+        for (size_t i = start; i < end; i++) {
+            int b = static_cast<int>((items[i].centroid[axis] - lo) * scale);
+            b = std::min(b, sah_bin_count - 1);
+            bins[b].count++;
+            bins[b].box.expand(items[i].box);
+        }
+
+        // sweep from the right to get the cost of every right half
+        double right_area[sah_bin_count];
+        size_t right_count[sah_bin_count];
+        aabb acc_box;
+        size_t acc_count = 0;
+        for (int b = sah_bin_count - 1; b > 0; b--) {
+            acc_box.expand(bins[b].box);
+            acc_count += bins[b].count;
+            right_area[b] = acc_box.surface_area();
+            right_count[b] = acc_count;
+        }
+
+        // then from the left, the split lies between bin b and b + 1
+        acc_box = aabb();
+        acc_count = 0;
+        for (int b = 0; b < sah_bin_count - 1; b++) {
+            acc_box.expand(bins[b].box);
+            acc_count += bins[b].count;
+            if (acc_count == 0 || right_count[b + 1] == 0) continue;
+            auto cost = acc_box.surface_area() * acc_count +
+                        right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    size_t mid = start + (end - start) / 2;
+    if (best_axis < 0) return mid;  // all centroids coincide
+
+    auto lo = centroid_bounds.minimum[best_axis];
+    auto scale = sah_bin_count / (centroid_bounds.maximum[best_axis] - lo);
+    auto split = std::partition(
+        items.begin() + start, items.begin() + end,
+        [=](const bvh_build_item& item) {
+            int b = static_cast<int>((item.centroid[best_axis] - lo) * scale);
+            return std::min(b, sah_bin_count - 1) <= best_split;
+        });
+    mid = split - items.begin();
+    if (mid == start || mid == end) {
+        // degenerate split, cut at the median centroid instead
+        mid = start + (end - start) / 2;
+        std::nth_element(items.begin() + start, items.begin() + mid,
+                         items.begin() + end,
+                         [=](const bvh_build_item& a, const bvh_build_item& b) {
+                             return a.centroid[best_axis] <
+                                    b.centroid[best_axis];
+                         });
+    }
+    return mid;
+}
+
+// The BVHs walked with a stack keep it on the stack of the thread, in an
+// array of bvh_stack_size nodes: one per inner node on the way down to a
+// leaf. The SAH alone may build trees deeper than that when the primitives
+// are spread very unevenly, so from bvh_sah_depth on the builders cut at
+// the median centroid instead. That halves the items at every level, and
+// no tree over fewer than 2^40 of them gets deeper than the stack.
+const int bvh_stack_size = 64;
+const int bvh_sah_depth = 24;
+
+// Splits items[start, end) in two at the median centroid along the axis
+// of their largest extent, returns the index of the first of the right half
+size_t median_partition(std::vector<bvh_build_item>& items, size_t start,
+                        size_t end) {
+    aabb centroid_bounds;
+    for (size_t i = start; i < end; i++)
+        centroid_bounds.expand(items[i].centroid);
+    int axis = centroid_bounds.longest_axis();
+    size_t mid = start + (end - start) / 2;
+    std::nth_element(items.begin() + start, items.begin() + mid,
+                     items.begin() + end,
+                     [=](const bvh_build_item& a, const bvh_build_item& b) {
+                         return a.centroid[axis] < b.centroid[axis];
+                     });
+    return mid;
+}
+
+// Splits the items of a node at depth (0 for the root) in two for a BVH
+// walked with a stack, see bvh_stack_size
+size_t bvh_partition(std::vector<bvh_build_item>& items, size_t start,
+                     size_t end, int depth) {
+    return depth < bvh_sah_depth ? sah_partition(items, start, end)
+                                 : median_partition(items, start, end);
+}
+
+// A BVH as an array of nodes walked with a stack, over primitives that
+// the owner keeps in the leaf order the build returns. Meshes and
+// instance sets use it for their own primitives.
+class flat_bvh {
+   public:
+    // One node per cache line. The left child of an inner node follows
+    // it in the array.
+    struct alignas(64) node {
+        aabb box;
+        int first;  // first primitive of a leaf, or the right child
+        int count;  // primitives in the leaf, 0 for an inner node
+        int axis;   // split axis of an inner node
+    };
+
+    // Builds over items, order receives the indices of the items in leaf
+    // order: leaf primitive k is order[k]
+    void build(std::vector<bvh_build_item>& items, std::vector<size_t>& order,
+               int max_leaf_size);
+
+    bool empty() const { return nodes.empty(); }
+    const aabb& bounds() const { return nodes[0].box; }
+    size_t memory() const { return nodes.size() * sizeof(node); }
+
+    // Calls hit(k, t_max) on the primitives k of the leaves r reaches
+    // between t_min and t_max, nearest first. hit returns whether it
+    // found a closer hit and lowered t_max to it.
+    template <typename F>
+    bool traverse(const ray& r, real t_min, real& t_max, F&& hit) const;
+
+   private:
+    // Builds the node of items[start, end) at depth, returns its index
+    int build_node(std::vector<bvh_build_item>& items, size_t start,
+                   size_t end, int depth, std::vector<size_t>& order,
+                   int max_leaf_size);
+
+    std::vector<node> nodes;
+};
+
+void flat_bvh::build(std::vector<bvh_build_item>& items,
+                     std::vector<size_t>& order, int max_leaf_size) {
+    nodes.clear();
+    order.clear();
+    if (items.empty()) return;
+    order.reserve(items.size());
+    // the most a tree over the items can have, the pages of the unused
+    // part are never touched
+    nodes.reserve(2 * items.size());
+    build_node(items, 0, items.size(), 0, order, max_leaf_size);
+}
+
+int flat_bvh::build_node(std::vector<bvh_build_item>& items, size_t start,
+                         size_t end, int depth, std::vector<size_t>& order,
+                         int max_leaf_size) {
+    int index = nodes.size();
+    nodes.push_back(node());
+    for (size_t i = start; i < end; i++) nodes[index].box.expand(items[i].box);
+    nodes[index].axis = nodes[index].box.longest_axis();
+
+    if (end - start <= static_cast<size_t>(max_leaf_size)) {
+        nodes[index].first = order.size();
+        nodes[index].count = end - start;
+        for (size_t i = start; i < end; i++) order.push_back(items[i].index);
+        return index;
+    }
+
+    auto mid = bvh_partition(items, start, end, depth);
+    // the left child follows
+    build_node(items, start, mid, depth + 1, order, max_leaf_size);
+    int right = build_node(items, mid, end, depth + 1, order, max_leaf_size);
+    nodes[index].first = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+template <typename F>
+bool flat_bvh::traverse(const ray& r, real t_min, real& t_max,
+                        F&& hit) const {
+    if (nodes.empty()) return false;
+    const vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(),
+                       1 / r.direction().z());
+    bool hit_anything = false;
+    int stack[bvh_stack_size];
+    int top = 0;
+    int index = 0;
+    for (;;) {
+        const node& n = nodes[index];
+        if (n.box.hit(r, inv_dir, t_min, t_max)) {
+            if (n.count == 0) {
+                // visit the nearer child first so the farther one is culled
+                // by the closest hit
+                int near = index + 1, far = n.first;
+                if (inv_dir[n.axis] < 0) std::swap(near, far);
+                stack[top++] = far;
+                index = near;
+                continue;
+            }
+            for (int k = n.first; k < n.first + n.count; k++)
+                hit_anything |= hit(k, t_max);
+        }
+        if (top == 0) break;
+        index = stack[--top];
+    }
+    return hit_anything;
+}
+
+// Bounding volume hierarchy, a binary tree of boxes over the objects.
+// If some of them move, the nodes above them bound them linearly in time
+// over the interval of the motion: a ray tests the box at its own time,
+// which for a motion-blurred frame is about as tight as a static one,
+// where a box bounding all times would grow with the motion.
+class bvh_node : public hittable {
+   public:
+    bvh_node() {}
+    bvh_node(const hittable_list& list) : bvh_node(list.objects) {
+        if (inner_nodes) inner_nodes->keep(list.owner);
+    }
+    bvh_node(const std::vector<shared_ptr<hittable>>& objects);
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const;
+
+    virtual bool motion_interval(double& time0, double& time1) const;
+
+    virtual bool motion_bounds(double time0, double time1, aabb& box0,
+                               aabb& box1) const;
+
+   private:
+    // The bounds of a node above moving objects, box0 at time0 moving to
+    // box0 + delta at time1. All nodes of a tree share the times.
+    struct node_motion {
+        aabb box0;
+        vec3 delta_minimum, delta_maximum;
+        double time0, time1;
+
+        aabb box1() const {
+            return aabb(box0.minimum + delta_minimum,
+                        box0.maximum + delta_maximum);
+        }
+
+        // The box a fraction s of the way from time0 to time1
+        aabb at(real s) const {
+            return aabb(box0.minimum + s * delta_minimum,
+                        box0.maximum + s * delta_maximum);
+        }
+
+        // How far time is from time0 to time1, held at the ends
+        real fraction(real time) const {
+            auto s = (time - time0) / (time1 - time0);
+            return std::min(std::max(s, 0.0), 1.0);
+        }
+    };
+
+    // The motion bounds of every object over the interval of all motion,
+    // given to the nodes while building
+    struct motion_build {
+        double time0, time1;
+        std::vector<aabb> box0, box1;
+        std::vector<char> moves;
+    };
+
+    bvh_node(const std::vector<shared_ptr<hittable>>& objects,
+             std::vector<bvh_build_item>& items, size_t start, size_t end,
+             scene_arena& arena, const motion_build* motion);
+
+    // s is the fraction of the ray's time, see node_motion
+    bool hit_node(const ray& r, const vec3& inv_dir, real s, real t_min,
+                  real t_max, hit_record& rec) const;
+
+    // Children are either bvh_nodes (traversed without a virtual call) or
+    // primitives, right is null for a single-primitive node
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right;
+    bool left_is_node = false;
+    bool right_is_node = false;
+    int axis = 0;  // split axis, decides which child is visited first
+    aabb box;      // of all times
+    const node_motion* motion = nullptr;  // in the arena, if objects move
+    // of the root: the inner nodes, in an arena rather than an allocation
+    // each, which also keeps the objects alive if they do not own
+    // themselves
+    shared_ptr<scene_arena> inner_nodes;
+};
+
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& objects) {
+    std::vector<bvh_build_item> items;
+    items.reserve(objects.size());
+    motion_build motion;
+    motion.time0 = infinity;
+    motion.time1 = -infinity;
+    for (size_t i = 0; i < objects.size(); i++) {
+        aabb object_box;
+        if (!objects[i]->bounding_box(object_box)) {
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+            continue;
+        }
+        items.push_back({object_box, object_box.centroid(), i});
+        double time0, time1;
+        if (objects[i]->motion_interval(time0, time1)) {
+            motion.time0 = std::min(motion.time0, time0);
+            motion.time1 = std::max(motion.time1, time1);
+        }
+    }
+    if (items.empty()) return;
+    bool moving = motion.time0 < motion.time1;
+    if (moving) {
+        motion.box0.resize(objects.size());
+        motion.box1.resize(objects.size());
+        motion.moves.resize(objects.size());
+        double time0, time1;
+        for (const auto& item : items) {
+            auto k = item.index;
+            objects[k]->motion_bounds(motion.time0, motion.time1,
+                                      motion.box0[k], motion.box1[k]);
+            motion.moves[k] = objects[k]->motion_interval(time0, time1);
+        }
+    }
+    auto arena = make_shared<scene_arena>();
+    *this = bvh_node(objects, items, 0, items.size(), *arena,
+                     moving ? &motion : nullptr);
+    inner_nodes = arena;
+}
+
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& objects,
+                   std::vector<bvh_build_item>& items, size_t start,
+                   size_t end, scene_arena& arena,
+                   const motion_build* motion) {
+    for (size_t i = start; i < end; i++) box.expand(items[i].box);
+    if (motion) {
+        bool moves = false;
+        aabb box0, box1;
+        for (size_t i = start; i < end; i++) {
+            auto k = items[i].index;
+            moves = moves || motion->moves[k];
+            box0.expand(motion->box0[k]);
+            box1.expand(motion->box1[k]);
+        }
+        if (moves)
+            this->motion = arena
+                               .make<node_motion>(node_motion{
+                                   box0, box1.minimum - box0.minimum,
+                                   box1.maximum - box0.maximum,
+                                   motion->time0, motion->time1})
+                               .get();
+    }
+
+    auto span = end - start;
+    if (span == 1) {
+        left = objects[items[start].index];
+        return;
+    }
+    if (span == 2) {
+        left = objects[items[start].index];
+        right = objects[items[start + 1].index];
+    } else {
+        auto mid = sah_partition(items, start, end);
+        left = arena.make<bvh_node>(
+            bvh_node(objects, items, start, mid, arena, motion));
+        right = arena.make<bvh_node>(
+            bvh_node(objects, items, mid, end, arena, motion));
+        left_is_node = right_is_node = true;
+    }
+    axis = box.longest_axis();
+}
+
+bool bvh_node::hit(const ray& r, real t_min, real t_max,
+                   hit_record& rec) const {
+    if (!left) return false;
+    auto d = r.direction();
+    vec3 inv_dir(1 / d.x(), 1 / d.y(), 1 / d.z());
+    real s = motion ? motion->fraction(r.time()) : 0;
+    return hit_node(r, inv_dir, s, t_min, t_max, rec);
+}
+
+bool bvh_node::hit_node(const ray& r, const vec3& inv_dir, real s,
+                        real t_min, real t_max, hit_record& rec) const {
+    if (motion ? !motion->at(s).hit(r, inv_dir, t_min, t_max)
+               : !box.hit(r, inv_dir, t_min, t_max))
+        return false;
+
+    // visit the nearer child first so the farther one is culled by rec.t
+    const hittable* first = left.get();
+    const hittable* second = right.get();
+    bool first_is_node = left_is_node;
+    bool second_is_node = right_is_node;
+    if (second && inv_dir[axis] < 0) {
+        std::swap(first, second);
+        std::swap(first_is_node, second_is_node);
+    }
+
+    bool hit_anything =
+        first_is_node ? static_cast<const bvh_node*>(first)->hit_node(
+                            r, inv_dir, s, t_min, t_max, rec)
+                      : first->hit(r, t_min, t_max, rec);
+    if (!second) return hit_anything;
+    auto closest_so_far = hit_anything ? rec.t : t_max;
+    bool hit_second =
+        second_is_node ? static_cast<const bvh_node*>(second)->hit_node(
+                             r, inv_dir, s, t_min, closest_so_far, rec)
+                       : second->hit(r, t_min, closest_so_far, rec);
+    return hit_anything || hit_second;
+}
+
+bool bvh_node::bounding_box(aabb& output_box) const {
+    output_box = box;
+    return left != nullptr;
+}
+
+bool bvh_node::motion_interval(double& time0, double& time1) const {
+    if (!motion) return false;
+    time0 = motion->time0;
+    time1 = motion->time1;
+    return true;
+}
+
+bool bvh_node::motion_bounds(double time0, double time1, aabb& box0,
+                             aabb& box1) const {
+    if (!motion) return hittable::motion_bounds(time0, time1, box0, box1);
+    linear_bounds({{motion->time0, motion->box0},
+                   {motion->time1, motion->box1()}},
+                  time0, time1, box0, box1);
+    return true;
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <cstring>
+#include <vector>
+
 #include "common.h"
 
 class camera {
@@ -43,17 +46,145 @@ class camera {
         vec3 rd = lens_radius * random_in_unit_disk();
         vec3 offset = u * rd.x() + v * rd.y();
 
-        return ray(origin + offset, lower_left_corner + s * horizontal +
-                                        t * vertical - origin - offset);
+        return ray(origin + offset,
+                   lower_left_corner + s * horizontal + t * vertical -
+                       origin - offset,
+                   time0);
+    }
+
+    // Same as get_ray(s, t), with the point of the lens given by a sample
+    // (lens_u, lens_v) in [0,1)^2. With the shutter open, time_u in [0,1)
+    // picks the time of the ray, and of the camera if it moves.
+    ray get_ray(double s, double t, double lens_u, double lens_v,
+                double time_u = 0) const {
+        vec3 rd = lens_radius * sample_unit_disk(lens_u, lens_v);
+        if (!has_shutter()) {
+            vec3 offset = u * rd.x() + v * rd.y();
+            return ray(origin + offset,
+                       lower_left_corner + s * horizontal + t * vertical -
+                           origin - offset,
+                       time0);
+        }
+        real f = time_u;
+        auto at = [f](const vec3& a, const vec3& d) { return a + f * d; };
+        vec3 offset = at(u, du) * rd.x() + at(v, dv) * rd.y();
+        point3 o = at(origin, d_origin);
+        return ray(o + offset,
+                   at(lower_left_corner, d_lower_left_corner) +
+                       s * at(horizontal, d_horizontal) +
+                       t * at(vertical, d_vertical) - o - offset,
+                   time0 + f * (time1 - time0));
+    }
+
+    // Opens the shutter from time0 to time1, while the camera moves from
+    // where it is to where end is. Rays are traced at a time in between,
+    // all at time0 if the times are equal.
+    void open_shutter(double time0, double time1, const camera& end) {
+        this->time0 = time0;
+        this->time1 = time1;
+        d_origin = end.origin - origin;
+        d_lower_left_corner = end.lower_left_corner - lower_left_corner;
+        d_horizontal = end.horizontal - horizontal;
+        d_vertical = end.vertical - vertical;
+        du = end.u - u;
+        dv = end.v - v;
     }
 
+    // Whether rays spread over time, and take a time sample
+    bool has_shutter() const { return time1 > time0; }
+
    private:
     point3 origin;
     point3 lower_left_corner;
     vec3 horizontal;
     vec3 vertical;
     vec3 u, v, w;
-    double lens_radius;
+    real lens_radius;
+    // the shutter, and how far the camera moves while it is open
+    real time0 = 0, time1 = 0;
+    vec3 d_origin, d_lower_left_corner, d_horizontal, d_vertical, du, dv;
+};
+
+// Where a camera is and how it looks, the parameters of a scene file
+struct camera_settings {
+    point3 lookfrom;
+    point3 lookat;
+    vec3 vup;
+    double vfov;  // vertical field of view in degrees
+    double aperture;
+    double focus_dist;
+
+    camera make(double aspect_ratio) const {
+        return camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture,
+                      focus_dist);
+    }
+};
+
+// The parameters of a camera in an array: lookfrom, lookat, vup, vfov,
+// aperture and focus_dist, as scene caches store them
+void pack_view(const camera_settings& v, double view[12]) {
+    const double values[12] = {v.lookfrom.x(), v.lookfrom.y(), v.lookfrom.z(),
+                               v.lookat.x(),   v.lookat.y(),   v.lookat.z(),
+                               v.vup.x(),      v.vup.y(),      v.vup.z(),
+                               v.vfov,         v.aperture,     v.focus_dist};
+    std::memcpy(view, values, sizeof(values));
+}
+
+camera_settings unpack_view(const double v[12]) {
+    return camera_settings{point3(v[0], v[1], v[2]),
+                           point3(v[3], v[4], v[5]),
+                           vec3(v[6], v[7], v[8]),
+                           v[9],
+                           v[10],
+                           v[11]};
+}
+
+// The settings of the camera at a frame of an animation
+struct camera_keyframe {
+    int frame;
+    camera_settings view;
 };
 
+// The camera at frame along a path through keys, which are sorted by
+// frame: a Catmull-Rom spline through every parameter, with the tangents
+// scaled to the frames between the keys so uneven spacing does not jerk.
+// The path stops at the first and last key.
+camera_settings camera_at(const std::vector<camera_keyframe>& keys,
+                          double frame) {
+    auto params = [](const camera_settings& v, double p[12]) {
+        const double values[12] = {
+            v.lookfrom.x(), v.lookfrom.y(), v.lookfrom.z(), v.lookat.x(),
+            v.lookat.y(),   v.lookat.z(),   v.vup.x(),      v.vup.y(),
+            v.vup.z(),      v.vfov,         v.aperture,     v.focus_dist};
+        for (int k = 0; k < 12; k++) p[k] = values[k];
+    };
+    if (frame <= keys.front().frame) return keys.front().view;
+    if (frame >= keys.back().frame) return keys.back().view;
+    size_t i = 1;
+    while (keys[i].frame <= frame) i++;
+    // keys b and c around the frame, a and d beyond them
+    const auto& a = keys[i > 1 ? i - 2 : i - 1];
+    const auto& b = keys[i - 1];
+    const auto& c = keys[i];
+    const auto& d = keys[i + 1 < keys.size() ? i + 1 : i];
+    double pa[12], pb[12], pc[12], pd[12], p[12];
+    params(a.view, pa);
+    params(b.view, pb);
+    params(c.view, pc);
+    params(d.view, pd);
+    double span = c.frame - b.frame;
+    double t = (frame - b.frame) / span;
+    // cubic Hermite basis
+    double h00 = (1 + 2 * t) * (1 - t) * (1 - t), h10 = t * (1 - t) * (1 - t);
+    double h01 = t * t * (3 - 2 * t), h11 = t * t * (t - 1);
+    for (int k = 0; k < 12; k++) {
+        double mb = (pc[k] - pa[k]) / (c.frame - a.frame) * span;
+        double mc = (pd[k] - pb[k]) / (d.frame - b.frame) * span;
+        p[k] = h00 * pb[k] + h10 * mb + h01 * pc[k] + h11 * mc;
+    }
+    return camera_settings{point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]),
+                           vec3(p[6], p[7], p[8]),   p[9],
+                           p[10],                    p[11]};
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,227 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "adaptive.h"
+#include "framebuffer.h"
+#include "integrator.h"
+#include "sampler.h"
+
+// A checkpoint holds the accumulated samples of a render so it can be
+// resumed. It is the header below followed by the sums of every pixel (3
+// doubles), the sample counts (int32) and, with adaptive sampling, the
+// mean and squared deviations of every pixel's estimator (2 doubles). Pixels
+// are row by row from the bottom, numbers in native byte order and every
+// section is 8-byte aligned so the file can be mapped and read in place.
+struct checkpoint_header {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint64_t seed;
+    uint32_t sampler;
+    uint32_t estimates;  // whether the estimator section is present
+    uint32_t max_depth;
+    uint32_t roulette_depth;
+    uint32_t light_sampling;  // whether diffuse hits sampled the lights
+    uint32_t reserved;
+    uint64_t scene;  // see fingerprint_scene_file
+    uint64_t view;   // see fingerprint_frame_view
+};
+static_assert(sizeof(checkpoint_header) == 64, "checkpoint header padding");
+
+const char checkpoint_magic[8] = "RTCKPT3";
+
+// The samples of a checkpoint can only be added to a render of the same
+// image of the same scene and view, with the same random numbers and the
+// same estimator
+checkpoint_header make_checkpoint_header(int w, int h, uint64_t seed,
+                                         sampler_type sampler,
+                                         const path_limits& limits,
+                                         bool light_sampling, bool estimates,
+                                         uint64_t scene, uint64_t view) {
+    checkpoint_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.width = w;
+    header.height = h;
+    header.seed = seed;
+    header.sampler = static_cast<uint32_t>(sampler);
+    header.estimates = estimates;
+    header.max_depth = limits.max_depth;
+    header.roulette_depth = limits.roulette_depth;
+    header.light_sampling = light_sampling;
+    header.scene = scene;
+    header.view = view;
+    return header;
+}
+
+size_t checkpoint_counts_offset(const checkpoint_header& header) {
+    size_t pixels = static_cast<size_t>(header.width) * header.height;
+    return sizeof(checkpoint_header) + pixels * 3 * sizeof(double);
+}
+
+size_t checkpoint_estimates_offset(const checkpoint_header& header) {
+    size_t pixels = static_cast<size_t>(header.width) * header.height;
+    size_t end = checkpoint_counts_offset(header) + pixels * sizeof(int32_t);
+    return (end + 7) & ~static_cast<size_t>(7);
+}
+
+size_t checkpoint_size(const checkpoint_header& header) {
+    size_t pixels = static_cast<size_t>(header.width) * header.height;
+    return checkpoint_estimates_offset(header) +
+           (header.estimates ? pixels * 2 * sizeof(double) : 0);
+}
+
+bool file_exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// Writes the frame, and the estimators unless there are none, to path.
+// The file is written next to path and renamed over it, so a render killed
+// while saving keeps its previous checkpoint.
+bool save_checkpoint(const std::string& path, const checkpoint_header& header,
+                     const framebuffer& frame,
+                     const std::vector<pixel_estimator>& estimators) {
+    std::string temp = path + ".tmp";
+    std::ofstream out(temp, std::ios::binary);
+    if (!out) {
+        std::cerr << "Cannot open " << temp << "\n";
+        return false;
+    }
+    int w = frame.width(), h = frame.height();
+    auto write = [&](const void* data, size_t size) {
+        out.write(static_cast<const char*>(data), size);
+    };
+    write(&header, sizeof(header));
+    // a row at a time, to keep the copy small
+    std::vector<double> row(3 * w);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++)
+            for (int c = 0; c < 3; c++) row[3 * i + c] = frame.sum(i, j)[c];
+        write(row.data(), 3 * w * sizeof(double));
+    }
+    std::vector<int32_t> counts(w);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) counts[i] = frame.samples(i, j);
+        write(counts.data(), w * sizeof(int32_t));
+    }
+    const char padding[8] = {};
+    write(padding, checkpoint_estimates_offset(header) -
+                       checkpoint_counts_offset(header) -
+                       static_cast<size_t>(w) * h * sizeof(int32_t));
+    if (header.estimates) {
+        for (int j = 0; j < h; j++) {
+            for (int i = 0; i < w; i++) {
+                const auto& e = estimators[j * w + i];
+                row[2 * i] = e.mean();
+                row[2 * i + 1] = e.squared_deviations();
+            }
+            write(row.data(), 2 * w * sizeof(double));
+        }
+    }
+    out.close();
+    if (!out) {
+        std::cerr << "Cannot write " << temp << "\n";
+        return false;
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Cannot rename " << temp << " to " << path << ": "
+                  << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Maps the checkpoint at path and copies its samples into frame and, if
+// it has them, its estimators into estimators. Returns false if the file
+// cannot be read or belongs to a render with a different header.
+bool load_checkpoint(const std::string& path, const checkpoint_header& header,
+                     framebuffer& frame,
+                     std::vector<pixel_estimator>& estimators) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open " << path << ": " << strerror(errno)
+                  << "\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) != checkpoint_size(header)) {
+        std::cerr << path << " is not a checkpoint of this render\n";
+        close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "Cannot map " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    const char* data = static_cast<const char*>(p);
+    auto saved = reinterpret_cast<const checkpoint_header*>(data);
+    if (std::memcmp(saved->magic, header.magic, sizeof(header.magic)) == 0 &&
+        (saved->scene != header.scene || saved->view != header.view)) {
+        std::cerr << path << " is a checkpoint of another scene or view\n";
+        munmap(p, st.st_size);
+        return false;
+    }
+    if (std::memcmp(data, &header, sizeof(header)) != 0) {
+        std::cerr << path << " is not a checkpoint of this render\n";
+        munmap(p, st.st_size);
+        return false;
+    }
+
+    int w = frame.width(), h = frame.height();
+    auto sums = reinterpret_cast<const double*>(data + sizeof(header));
+    auto counts = reinterpret_cast<const int32_t*>(
+        data + checkpoint_counts_offset(header));
+    auto estimates = reinterpret_cast<const double*>(
+        data + checkpoint_estimates_offset(header));
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            size_t k = static_cast<size_t>(j) * w + i;
+            frame.set(i, j,
+                      color_sum(sums[3 * k], sums[3 * k + 1], sums[3 * k + 2]),
+                      counts[k]);
+            if (header.estimates)
+                estimators[k] = pixel_estimator(counts[k], estimates[2 * k],
+                                                estimates[2 * k + 1]);
+        }
+    }
+    munmap(p, st.st_size);
+    return true;
+}
+
+// Set by SIGINT or SIGTERM: the render stops taking tiles, saves its
+// checkpoint and exits
+volatile std::sig_atomic_t stop_signal = 0;
+
+void handle_stop(int sig) {
+    stop_signal = 1;
+    // a second signal kills the process right away
+    std::signal(sig, SIG_DFL);
+}
+
+void install_stop_handlers() {
+    std::signal(SIGINT, handle_stop);
+    std::signal(SIGTERM, handle_stop);
+}
+
+bool stop_requested() { return stop_signal != 0; }
+
+#endif
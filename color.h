@@ -5,22 +5,31 @@
 
 #include "vec3.h"
 
-void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
+// Translates the sum of samples_per_pixel samples to [0,255] components
+inline void to_rgb8(const color_sum& pixel_color, int samples_per_pixel,
+                    unsigned char rgb[3]) {
     // divide the total light by the numebr of samples
     // and gamma correction with gamma = 2, color**(1/2)
-    auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
+    auto scale = samples_per_pixel > 0 ? 1.0 / samples_per_pixel : 0.0;
+    for (int c = 0; c < 3; c++) {
+        auto v = sqrt(scale * pixel_color[c]);
+        rgb[c] = static_cast<unsigned char>(255.999 * clamp(v, 0.0, 0.999));
+    }
+}
+
+// Relative luminance of a linear RGB color
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+void write_color(std::ostream &out, const color_sum &pixel_color,
+                 int samples_per_pixel) {
+    unsigned char rgb[3];
+    to_rgb8(pixel_color, samples_per_pixel, rgb);
 
     // Write the translated [0,255] value of each color component.
-    out << static_cast<int>(255.999 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(255.999 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(255.999 * clamp(b, 0.0, 0.999)) << '\n';
+    out << static_cast<int>(rgb[0]) << ' ' << static_cast<int>(rgb[1]) << ' '
+        << static_cast<int>(rgb[2]) << '\n';
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -5,7 +5,8 @@
 #include <cstdlib>
 #include <limits>
 #include <memory>
-#include <random>
+
+#include "sampler.h"
 
 // Using
 
@@ -13,6 +14,14 @@ using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 
+// Scalar type of the geometry and shading math, float when built with
+// -DRT_SINGLE_PRECISION
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -22,17 +31,8 @@ const double pi = 3.1415926535897932385;
 
 inline double degrees_to_radians(double degrees) { return degrees * pi / 180; }
 
-// Thread safe random number generator
-int intRand(const int& min, const int& max) {
-    static thread_local std::mt19937 generator;
-    std::uniform_int_distribution<int> distribution(min, max);
-    return distribution(generator);
-}
-
-// Returns a random real in [0,1).
-inline double random_double() {
-    return intRand(0, RAND_MAX) / (RAND_MAX + 1.0);
-}
+// Returns a random real in [0,1), from the calling thread's own generator
+inline double random_double() { return thread_rng().next_double(); }
 
 inline double random_double(double min, double max) {
     // Returns a random real in [min,max).
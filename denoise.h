@@ -0,0 +1,152 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "aov.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "scheduler.h"
+
+// Strength of the edge-stopping functions of the denoiser: the larger a
+// sigma, the more a difference in that buffer is smoothed over
+struct denoise_settings {
+    int iterations = 4;         // filter radius 2^(iterations + 1) - 2
+    double sigma_color = 2;     // in standard deviations of the noise
+    double sigma_normal = 0.5;
+    double sigma_depth = 0.05;  // relative difference per pixel
+    double sigma_albedo = 0.2;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al.), with the color
+// weights of SVGF (Schied et al.): a 5x5 B3-spline kernel applied
+// `iterations` times with holes of 2^i pixels between its taps, so the
+// radius doubles every iteration at the same cost. A tap is weighted down
+// where its normal, depth or albedo differs from the pixel's, or its
+// luminance by more than the noise of the two explains. The variance of
+// the noise is filtered along with the color, so the color weights
+// tighten as the image gets smoother.
+//
+// The filter works on the color divided by the albedo, the lighting alone,
+// and multiplies the albedo back in, so textures are not blurred. Pixels
+// without AOVs (resumed from a checkpoint) are left as they are. Every
+// pixel of the result holds one sample.
+framebuffer denoise(const framebuffer& image, const aov_buffer& aovs,
+                    tile_scheduler& scheduler,
+                    const denoise_settings& settings = denoise_settings()) {
+    const int w = image.width(), h = image.height();
+    auto luminance = [](const color_sum& c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    };
+    // the albedo a color is divided by, kept away from zero
+    auto albedo = [&](int i, int j) {
+        auto a = aovs.albedo(i, j);
+        for (int c = 0; c < 3; c++) a[c] = std::max(a[c], 0.01);
+        return a;
+    };
+    // the averages of the AOVs, read 25 times per pixel and iteration
+    struct guide {
+        color_sum normal, albedo;
+        double depth;
+        bool valid;
+    };
+    std::vector<guide> guides(w * h);
+    std::vector<color_sum> current(w * h), next(w * h);
+    std::vector<double> variance(w * h), next_variance(w * h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            auto k = j * w + i;
+            guides[k] = {aovs.normal(i, j), aovs.albedo(i, j),
+                         aovs.depth(i, j), aovs.has(i, j)};
+            if (!guides[k].valid) continue;
+            auto a = albedo(i, j);
+            current[k] = image.sum(i, j) / image.samples(i, j) *
+                         color_sum(1 / a.x(), 1 / a.y(), 1 / a.z());
+            auto y = luminance(a);
+            variance[k] = aovs.variance(i, j) / (y * y);
+        }
+    }
+
+    auto tiles = make_tiles(w, h, 32, tile_order::hilbert);
+    const double kernel[3] = {3.0 / 8, 1.0 / 4, 1.0 / 16};
+    const double normal_scale =
+        1 / (settings.sigma_normal * settings.sigma_normal);
+    const double albedo_scale =
+        1 / (settings.sigma_albedo * settings.sigma_albedo);
+    for (int iteration = 0; iteration < settings.iterations; iteration++) {
+        const int step = 1 << iteration;
+        // depth differences are scaled by the distance of the tap
+        double depth_scale[5][5];
+        for (int y = -2; y <= 2; y++)
+            for (int x = -2; x <= 2; x++)
+                depth_scale[y + 2][x + 2] =
+                    x || y ? 1 / (settings.sigma_depth * step *
+                                  std::sqrt(x * x + y * y))
+                           : 0;
+        scheduler.run(tiles, [&](const tile& t, int) {
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    auto p = j * w + i;
+                    const guide& gp = guides[p];
+                    if (!gp.valid) continue;
+                    const auto yp = luminance(current[p]);
+                    const auto color_scale =
+                        1 / (settings.sigma_color * std::sqrt(variance[p]) +
+                             1e-4);
+                    color_sum sum(0, 0, 0);
+                    double weights = 0, variances = 0;
+                    for (int y = -2; y <= 2; y++) {
+                        int jq = j + y * step;
+                        if (jq < 0 || jq >= h) continue;
+                        for (int x = -2; x <= 2; x++) {
+                            int iq = i + x * step;
+                            if (iq < 0 || iq >= w) continue;
+                            auto q = jq * w + iq;
+                            const guide& gq = guides[q];
+                            if (!gq.valid) continue;
+                            double e = std::fabs(yp - luminance(current[q])) *
+                                       color_scale;
+                            e += (gp.normal - gq.normal).length_squared() *
+                                 normal_scale;
+                            e += (gp.albedo - gq.albedo).length_squared() *
+                                 albedo_scale;
+                            // relative, and over the distance, so slanted
+                            // surfaces are not cut apart
+                            auto far = std::max(gp.depth, gq.depth);
+                            if (far > 0)
+                                e += std::fabs(gp.depth - gq.depth) / far *
+                                     depth_scale[y + 2][x + 2];
+                            auto weight = kernel[std::abs(x)] *
+                                          kernel[std::abs(y)] * std::exp(-e);
+                            sum += weight * current[q];
+                            weights += weight;
+                            variances += weight * weight * variance[q];
+                        }
+                    }
+                    // the pixel itself always has weight
+                    next[p] = sum / weights;
+                    next_variance[p] = variances / (weights * weights);
+                }
+            }
+        }, false);
+        current.swap(next);
+        variance.swap(next_variance);
+    }
+
+    framebuffer result(w, h);
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            if (!guides[j * w + i].valid) {
+                auto n = image.samples(i, j);
+                if (n > 0) result.set(i, j, image.sum(i, j) / n, 1);
+                continue;
+            }
+            result.set(i, j, current[j * w + i] * albedo(i, j), 1);
+        }
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,652 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "net.h"
+#include "scheduler.h"
+
+// Rendering a frame on worker processes, on this machine or others. A
+// coordinator listens on a socket and splits the frame into work units, a
+// tile and a range of sample indices. Workers load the same scene, connect
+// and pull units, render them with their own threads and send back the
+// sums of the unit's samples in floats, which the coordinator adds to its
+// framebuffer. Since every sample is seeded from its pixel and index, the
+// image does not depend on which worker rendered what. When the
+// connection of a worker closes, or a unit it holds is not back by its
+// deadline, the units it held go back to the front of the queue for the
+// others.
+//
+// Messages are a message_header followed by its payload, in native byte
+// order: workers must run the same build on the same architecture, which
+// the hello checks.
+
+const uint32_t distributed_magic = 0x57445452;  // "RTDW"
+const uint32_t distributed_version = 1;
+
+// A worker is dropped when a unit it holds is not back within
+// unit_deadline_factor times the median time of the recent units, and at
+// least min_unit_deadline seconds, so a worker that was stopped or cut off
+// does not hold its units forever. There is no deadline before a first
+// unit came back.
+const double unit_deadline_factor = 8;
+const double min_unit_deadline = 10;
+const size_t unit_times_kept = 101;
+
+enum class message_type : uint32_t {
+    hello = 1,  // worker: hello_message
+    job,        // coordinator: job_message, a frame to render
+    request,    // worker: request_message, wants units
+    assign,     // coordinator: request_message, then the units
+    result,     // worker: result_message, then the float sums
+    done,       // coordinator: request_message, the job has no more units
+    bye,        // coordinator: no more jobs, nothing follows
+};
+
+struct message_header {
+    uint32_t type;
+    uint32_t size;  // bytes of the payload
+};
+
+struct hello_message {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t real_size;  // sizeof(real) of the worker's build
+    uint32_t reserved;
+    uint64_t fingerprint;  // of the scene, see fingerprint_scene_file
+};
+
+// The image settings of the coordinator, which override the worker's
+struct job_message {
+    uint32_t id;
+    int32_t width;
+    int32_t height;
+    int32_t frame;
+    uint64_t seed;
+    int32_t sampler;
+    int32_t max_depth;
+    int32_t roulette_depth;
+    int32_t light_sampling;
+};
+
+struct request_message {
+    uint32_t job;
+    uint32_t count;  // of units wanted or assigned
+};
+
+// Samples [sample_begin, sample_end) of every pixel of a tile
+struct work_unit {
+    uint32_t id;
+    int32_t x0, y0, x1, y1;
+    int32_t sample_begin;
+    int32_t sample_end;
+    uint32_t reserved;
+
+    tile area() const { return tile{x0, y0, x1, y1}; }
+};
+
+struct result_message {
+    uint32_t job;
+    uint32_t reserved;
+    work_unit unit;
+    // followed by 3 floats per pixel of the tile, row by row from y0
+};
+
+// Refuses payloads larger than a 4K tile could need
+const uint32_t max_message_size = 64 << 20;
+
+// Writes one message, the payload in up to two parts
+bool send_message(int fd, message_type type, const void* payload,
+                  size_t size, const void* extra = nullptr,
+                  size_t extra_size = 0) {
+    std::vector<char> message(sizeof(message_header) + size + extra_size);
+    message_header header{static_cast<uint32_t>(type),
+                          static_cast<uint32_t>(size + extra_size)};
+    std::memcpy(message.data(), &header, sizeof(header));
+    if (size) std::memcpy(&message[sizeof(header)], payload, size);
+    if (extra_size)
+        std::memcpy(&message[sizeof(header) + size], extra, extra_size);
+    return send_all(fd, message.data(), message.size());
+}
+
+// Splits the frame into units: every tile in passes of `pass` samples up
+// to spp, all tiles of a pass before the next, so the image fills in
+// evenly
+std::vector<work_unit> make_work_units(const std::vector<tile>& tiles,
+                                       int spp, int pass) {
+    std::vector<work_unit> units;
+    for (int s = 0; s < spp; s += pass)
+        for (const auto& t : tiles)
+            units.push_back({static_cast<uint32_t>(units.size()), t.x0, t.y0,
+                             t.x1, t.y1, s, std::min(spp, s + pass), 0});
+    return units;
+}
+
+// Listens for workers and hands them the units of one job after another
+class render_coordinator {
+   public:
+    render_coordinator() {}
+    ~render_coordinator();
+    render_coordinator(const render_coordinator&) = delete;
+    render_coordinator& operator=(const render_coordinator&) = delete;
+
+    // Listens on address for workers of the scene with this fingerprint,
+    // returns false on error
+    bool listen(const std::string& address, uint64_t fingerprint);
+
+    // Renders the units of job on the workers, waiting for them if there
+    // are none, and adds their samples to result. The id of job is set
+    // here. merged(t) is called after the samples of tile t were added.
+    // Returns false if a stop was requested before all units were done.
+    template <typename F>
+    bool render(const job_message& job, const std::vector<work_unit>& units,
+                framebuffer& result, F&& merged);
+
+    // Tells the workers there are no more jobs and closes the connections
+    void finish();
+
+   private:
+    using clock = std::chrono::steady_clock;
+    struct assignment {
+        uint32_t unit;
+        clock::time_point sent;
+    };
+    struct connection {
+        int fd;
+        int number;               // in order of connection, for messages
+        bool greeted = false;     // whether its hello was accepted
+        uint32_t wanted = 0;      // units requested and not yet assigned
+        std::vector<char> input;  // bytes of an incomplete message
+        std::vector<assignment> outstanding;  // units assigned to it
+    };
+
+    void accept_worker();
+    // Reads what arrived, returns false if the connection is lost or
+    // broke the protocol
+    bool receive(connection& c);
+    bool handle(connection& c, const message_header& header,
+                const char* payload);
+    bool send_job(connection& c);
+    bool assign(connection& c);
+    // Closes a connection and queues its outstanding units again
+    void drop(size_t k);
+    // Seconds a unit may be out, zero before a unit came back
+    double unit_deadline() const;
+    // Drops the workers that hold a unit past the deadline
+    void drop_overdue();
+
+    std::string address;
+    int listener = -1;
+    uint64_t fingerprint = 0;
+    int connected = 0;  // connections accepted so far
+    uint32_t jobs = 0;
+    std::vector<connection> workers;
+
+    // the job being rendered
+    bool active = false;
+    job_message job;
+    const std::vector<work_unit>* units = nullptr;
+    std::deque<uint32_t> pending;
+    std::vector<bool> finished;
+    size_t remaining = 0;
+    framebuffer* result = nullptr;
+    std::vector<uint32_t> merged_units;  // since the last callback
+    // seconds from sending to receiving the recent units, of all jobs
+    std::deque<double> unit_times;
+};
+
+render_coordinator::~render_coordinator() { finish(); }
+
+bool render_coordinator::listen(const std::string& address,
+                                uint64_t fingerprint) {
+    this->address = address;
+    this->fingerprint = fingerprint;
+    listener = listen_socket(address);
+    return listener >= 0;
+}
+
+template <typename F>
+bool render_coordinator::render(const job_message& job,
+                                const std::vector<work_unit>& units,
+                                framebuffer& result, F&& merged) {
+    this->job = job;
+    this->job.id = ++jobs;
+    this->units = &units;
+    this->result = &result;
+    pending.assign(units.size(), 0);
+    for (size_t k = 0; k < units.size(); k++) pending[k] = k;
+    finished.assign(units.size(), false);
+    remaining = units.size();
+    active = true;
+    for (size_t k = workers.size(); k-- > 0;)
+        if (workers[k].greeted && !send_job(workers[k])) drop(k);
+
+    bool waiting = false;
+    while (remaining > 0 && !stop_requested()) {
+        for (size_t k = workers.size(); k-- > 0;)
+            if (!assign(workers[k])) drop(k);
+        std::vector<pollfd> fds(1 + workers.size());
+        fds[0] = {listener, POLLIN, 0};
+        for (size_t k = 0; k < workers.size(); k++)
+            fds[k + 1] = {workers[k].fd, POLLIN, 0};
+        if (workers.empty() != waiting) {
+            waiting = workers.empty();
+            if (waiting)
+                std::cerr << "\r>> No workers, waiting on " << address
+                          << std::endl;
+        }
+        if (poll(fds.data(), fds.size(), 500) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Cannot wait for workers: " << std::strerror(errno)
+                      << "\n";
+            break;
+        }
+        // from the back, so dropping a worker keeps the others' indices
+        for (size_t k = workers.size(); k-- > 0;)
+            if (fds[k + 1].revents && !receive(workers[k])) drop(k);
+        if (fds[0].revents & POLLIN) accept_worker();
+        drop_overdue();
+        for (uint32_t id : merged_units) merged((*this->units)[id].area());
+        if (!merged_units.empty())
+            std::cerr << "\r>> " << units.size() - remaining << " of "
+                      << units.size() << " units on " << workers.size()
+                      << (workers.size() == 1 ? " worker  " : " workers ")
+                      << std::flush;
+        merged_units.clear();
+    }
+    active = false;
+    // workers waiting for units learn the job is over
+    for (size_t k = workers.size(); k-- > 0;) {
+        auto& c = workers[k];
+        request_message done{this->job.id, 0};
+        if (c.wanted &&
+            !send_message(c.fd, message_type::done, &done, sizeof(done)))
+            drop(k);
+        else
+            c.wanted = 0;
+    }
+    std::cerr << std::endl;
+    return remaining == 0;
+}
+
+void render_coordinator::finish() {
+    // a socket closed with unread requests in it may be reset before the
+    // worker reads the goodbye, so wait for the workers to close first
+    for (auto& c : workers) {
+        send_message(c.fd, message_type::bye, nullptr, 0);
+        shutdown(c.fd, SHUT_WR);
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (!workers.empty() &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(2)) {
+        std::vector<pollfd> fds;
+        for (const auto& c : workers) fds.push_back({c.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) break;
+        for (size_t k = workers.size(); k-- > 0;) {
+            char buffer[1 << 12];
+            if (fds[k].revents &&
+                recv(workers[k].fd, buffer, sizeof(buffer), MSG_DONTWAIT) <=
+                    0) {
+                close(workers[k].fd);
+                workers.erase(workers.begin() + k);
+            }
+        }
+    }
+    for (auto& c : workers) close(c.fd);
+    workers.clear();
+    if (listener >= 0) {
+        close(listener);
+        if (is_unix_address(address)) unlink(address.c_str() + 5);
+    }
+    listener = -1;
+}
+
+void render_coordinator::accept_worker() {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) return;
+    connection c;
+    c.fd = fd;
+    c.number = ++connected;
+    enable_keepalive(fd);
+    workers.push_back(std::move(c));
+}
+
+bool render_coordinator::receive(connection& c) {
+    char buffer[1 << 16];
+    for (;;) {
+        ssize_t n = recv(c.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return false;
+        c.input.insert(c.input.end(), buffer, buffer + n);
+    }
+    size_t used = 0;
+    while (c.input.size() - used >= sizeof(message_header)) {
+        message_header header;
+        std::memcpy(&header, &c.input[used], sizeof(header));
+        if (header.size > max_message_size) return false;
+        if (c.input.size() - used - sizeof(header) < header.size) break;
+        if (!handle(c, header, &c.input[used + sizeof(header)]))
+            return false;
+        used += sizeof(header) + header.size;
+    }
+    c.input.erase(c.input.begin(), c.input.begin() + used);
+    return true;
+}
+
+bool render_coordinator::handle(connection& c, const message_header& header,
+                                const char* payload) {
+    auto type = static_cast<message_type>(header.type);
+    if (!c.greeted) {
+        hello_message hello;
+        if (type != message_type::hello || header.size != sizeof(hello))
+            return false;
+        std::memcpy(&hello, payload, sizeof(hello));
+        if (hello.magic != distributed_magic ||
+            hello.version != distributed_version ||
+            hello.real_size != sizeof(real)) {
+            std::cerr << "\r>> Worker " << c.number
+                      << " runs another build, rejected" << std::endl;
+            return false;
+        }
+        if (hello.fingerprint != fingerprint) {
+            std::cerr << "\r>> Worker " << c.number
+                      << " loaded another scene, rejected" << std::endl;
+            return false;
+        }
+        c.greeted = true;
+        std::cerr << "\r>> Worker " << c.number << " connected" << std::endl;
+        return !active || send_job(c);
+    }
+
+    if (type == message_type::request) {
+        request_message request;
+        if (header.size != sizeof(request)) return false;
+        std::memcpy(&request, payload, sizeof(request));
+        if (active && request.job == job.id) {
+            c.wanted = request.count;
+            return true;
+        }
+        request_message done{request.job, 0};
+        return send_message(c.fd, message_type::done, &done, sizeof(done));
+    }
+
+    if (type == message_type::result) {
+        result_message message;
+        if (header.size < sizeof(message)) return false;
+        std::memcpy(&message, payload, sizeof(message));
+        // a result of an earlier job, of a stop, or of no unit of ours
+        if (!active || message.job != job.id) return true;
+        auto held = std::find_if(
+            c.outstanding.begin(), c.outstanding.end(),
+            [&](const assignment& a) { return a.unit == message.unit.id; });
+        if (held == c.outstanding.end()) return false;
+        const auto& unit = (*units)[message.unit.id];
+        const tile t = unit.area();
+        if (header.size != sizeof(message) + t.pixel_count() * 3 *
+                                                 sizeof(float))
+            return false;
+        std::chrono::duration<double> took = clock::now() - held->sent;
+        unit_times.push_back(took.count());
+        if (unit_times.size() > unit_times_kept) unit_times.pop_front();
+        c.outstanding.erase(held);
+        const char* sums = payload + sizeof(message);
+        const int samples = unit.sample_end - unit.sample_begin;
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                float rgb[3];
+                std::memcpy(rgb, sums, sizeof(rgb));
+                sums += sizeof(rgb);
+                result->set(i, j,
+                            result->sum(i, j) +
+                                color_sum(rgb[0], rgb[1], rgb[2]),
+                            result->samples(i, j) + samples);
+            }
+        }
+        finished[unit.id] = true;
+        remaining--;
+        merged_units.push_back(unit.id);
+        return true;
+    }
+    return false;
+}
+
+bool render_coordinator::send_job(connection& c) {
+    c.wanted = 0;
+    return send_message(c.fd, message_type::job, &job, sizeof(job));
+}
+
+bool render_coordinator::assign(connection& c) {
+    if (!active || c.wanted == 0 || pending.empty()) return true;
+    std::vector<work_unit> batch;
+    auto now = clock::now();
+    while (c.wanted > 0 && !pending.empty()) {
+        uint32_t id = pending.front();
+        pending.pop_front();
+        batch.push_back((*units)[id]);
+        c.outstanding.push_back({id, now});
+        c.wanted--;
+    }
+    c.wanted = 0;
+    request_message header{job.id, static_cast<uint32_t>(batch.size())};
+    return send_message(c.fd, message_type::assign, &header, sizeof(header),
+                        batch.data(), batch.size() * sizeof(work_unit));
+}
+
+void render_coordinator::drop(size_t k) {
+    auto& c = workers[k];
+    // connections rejected before their hello say why in handle
+    if (!c.greeted) {
+        close(c.fd);
+        workers.erase(workers.begin() + k);
+        return;
+    }
+    std::cerr << "\r>> Lost worker " << c.number;
+    if (active && !c.outstanding.empty()) {
+        std::cerr << ", handing out its " << c.outstanding.size()
+                  << (c.outstanding.size() == 1 ? " unit" : " units")
+                  << " again";
+        for (auto a = c.outstanding.rbegin(); a != c.outstanding.rend();
+             ++a)
+            if (!finished[a->unit]) pending.push_front(a->unit);
+    }
+    std::cerr << std::endl;
+    close(c.fd);
+    workers.erase(workers.begin() + k);
+}
+
+double render_coordinator::unit_deadline() const {
+    if (unit_times.empty()) return 0;
+    std::vector<double> times(unit_times.begin(), unit_times.end());
+    auto median = times.begin() + times.size() / 2;
+    std::nth_element(times.begin(), median, times.end());
+    return std::max(min_unit_deadline, unit_deadline_factor * *median);
+}
+
+void render_coordinator::drop_overdue() {
+    if (!active) return;
+    double deadline = unit_deadline();
+    if (deadline <= 0) return;
+    auto now = clock::now();
+    for (size_t k = workers.size(); k-- > 0;) {
+        // the units of a batch are sent together, the first is the oldest
+        const auto& held = workers[k].outstanding;
+        if (held.empty() ||
+            std::chrono::duration<double>(now - held.front().sent).count() <=
+                deadline)
+            continue;
+        std::cerr << "\r>> Worker " << workers[k].number
+                  << " missed the deadline of " << deadline << " s"
+                  << std::endl;
+        drop(k);
+    }
+}
+
+// The coordinator as seen from a worker. Messages are read blocking, the
+// worker has nothing else to do while it waits.
+class render_worker {
+   public:
+    render_worker() {}
+    ~render_worker() {
+        if (fd >= 0) close(fd);
+    }
+    render_worker(const render_worker&) = delete;
+    render_worker& operator=(const render_worker&) = delete;
+
+    // Connects to the coordinator at address and says hello, returns false
+    // on error
+    bool connect(const std::string& address, uint64_t fingerprint);
+
+    // Waits for the next job, returns false when there are no more or the
+    // coordinator is gone, see lost
+    bool next_job(job_message& job);
+
+    // Asks for up to count units of the current job, returns false when
+    // it has no more
+    bool next_units(int count, std::vector<work_unit>& units);
+
+    // Sends the samples of unit, the sums of frame over its tile
+    bool send_result(const work_unit& unit, const framebuffer& frame);
+
+    // Whether the connection closed or broke before the coordinator said
+    // goodbye
+    bool lost() const { return failed; }
+
+   private:
+    // Reads the next message, false if the connection is lost
+    bool receive(message_header& header, std::vector<char>& payload);
+
+    int fd = -1;
+    bool failed = false;
+    bool closed = false;  // the coordinator said goodbye
+    job_message job;
+    bool job_pending = false;  // a job arrived while waiting for units
+    std::vector<float> sums;
+};
+
+bool render_worker::connect(const std::string& address,
+                            uint64_t fingerprint) {
+    fd = connect_socket(address);
+    if (fd < 0) return false;
+    hello_message hello{distributed_magic, distributed_version,
+                        static_cast<uint32_t>(sizeof(real)), 0, fingerprint};
+    return send_message(fd, message_type::hello, &hello, sizeof(hello));
+}
+
+bool render_worker::receive(message_header& header,
+                            std::vector<char>& payload) {
+    if (!receive_all(fd, &header, sizeof(header)) ||
+        header.size > max_message_size) {
+        failed = true;
+        return false;
+    }
+    payload.resize(header.size);
+    if (!receive_all(fd, payload.data(), header.size)) {
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool render_worker::next_job(job_message& next) {
+    if (closed || failed) return false;
+    if (job_pending) {
+        job_pending = false;
+        next = job;
+        return true;
+    }
+    message_header header;
+    std::vector<char> payload;
+    while (receive(header, payload)) {
+        auto type = static_cast<message_type>(header.type);
+        if (type == message_type::bye) {
+            closed = true;
+            return false;
+        }
+        if (type == message_type::job && header.size == sizeof(job)) {
+            std::memcpy(&job, payload.data(), sizeof(job));
+            next = job;
+            return true;
+        }
+        // the answers to requests of the last job are ignored
+        if (type != message_type::done) break;
+    }
+    failed = true;
+    return false;
+}
+
+bool render_worker::next_units(int count, std::vector<work_unit>& units) {
+    units.clear();
+    request_message request{job.id, static_cast<uint32_t>(count)};
+    if (!send_message(fd, message_type::request, &request,
+                      sizeof(request))) {
+        failed = true;
+        return false;
+    }
+    message_header header;
+    std::vector<char> payload;
+    while (receive(header, payload)) {
+        auto type = static_cast<message_type>(header.type);
+        request_message reply;
+        if (type == message_type::job && header.size == sizeof(job)) {
+            // the job was finished by others
+            std::memcpy(&job, payload.data(), sizeof(job));
+            job_pending = true;
+            return false;
+        }
+        if (type == message_type::bye) {
+            closed = true;
+            return false;
+        }
+        if (header.size < sizeof(reply)) break;
+        std::memcpy(&reply, payload.data(), sizeof(reply));
+        if (reply.job != job.id) continue;  // of an earlier job
+        if (type == message_type::done) return false;
+        if (type != message_type::assign ||
+            header.size != sizeof(reply) + reply.count * sizeof(work_unit))
+            break;
+        units.resize(reply.count);
+        std::memcpy(units.data(), payload.data() + sizeof(reply),
+                    reply.count * sizeof(work_unit));
+        return true;
+    }
+    failed = true;
+    return false;
+}
+
+bool render_worker::send_result(const work_unit& unit,
+                                const framebuffer& frame) {
+    const tile t = unit.area();
+    sums.clear();
+    for (int j = t.y0; j < t.y1; j++) {
+        for (int i = t.x0; i < t.x1; i++) {
+            const auto& s = frame.sum(i, j);
+            sums.push_back(s.x());
+            sums.push_back(s.y());
+            sums.push_back(s.z());
+        }
+    }
+    result_message message{job.id, 0, unit};
+    if (!send_message(fd, message_type::result, &message, sizeof(message),
+                      sums.data(), sums.size() * sizeof(float))) {
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+
+// One value per pixel of an image, stored tile by tile: tiles of
+// tile_size * tile_size pixels in rows from the bottom, and the pixels of
+// a tile in rows from the bottom too. A render tile of the default size is
+// one contiguous block, and every block starts on a cache line of its own,
+// so threads rendering neighbouring tiles never write the same line. The
+// tiles at the right and top borders are padded to the full size.
+template <typename T>
+class tiled_buffer {
+   public:
+    static const int tile_size = 32;
+
+    tiled_buffer() {}
+    tiled_buffer(int w, int h, const T& value = T())
+        : w(w),
+          h(h),
+          tiles_x((w + tile_size - 1) / tile_size),
+          blocks(static_cast<size_t>(tiles_x) *
+                 ((h + tile_size - 1) / tile_size)) {
+        for (auto& b : blocks)
+            std::fill(b.pixels, b.pixels + block_size, value);
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+
+    T& operator()(int i, int j) {
+        return blocks[block_of(i, j)].pixels[offset(i, j)];
+    }
+    const T& operator()(int i, int j) const {
+        return blocks[block_of(i, j)].pixels[offset(i, j)];
+    }
+
+    // The pixels from (i, j) to the right border of its tile, which are
+    // contiguous: there are run(i) of them
+    T* row(int i, int j) { return &(*this)(i, j); }
+    const T* row(int i, int j) const { return &(*this)(i, j); }
+    int run(int i) const { return std::min(w, (i | mask) + 1) - i; }
+
+    // Calls f with the value of every pixel, in the order they are stored
+    template <typename F>
+    void for_each(F&& f) const {
+        for (int y = 0; y < h; y += tile_size) {
+            for (int x = 0; x < w; x += tile_size) {
+                const T* p = blocks[block_of(x, y)].pixels;
+                for (int j = 0; j < std::min(tile_size, h - y); j++)
+                    for (int i = 0; i < run(x); i++) f(p[j << shift | i]);
+            }
+        }
+    }
+
+   private:
+    static const int shift = 5;  // log2 of tile_size
+    static const int mask = tile_size - 1;
+    static const int block_size = tile_size * tile_size;
+    static_assert(1 << shift == tile_size, "tile_size is not 2^shift");
+
+    struct alignas(64) block {
+        T pixels[block_size];
+    };
+
+    size_t block_of(int i, int j) const {
+        return static_cast<size_t>(j >> shift) * tiles_x + (i >> shift);
+    }
+    static int offset(int i, int j) {
+        return (j & mask) << shift | (i & mask);
+    }
+
+    int w = 0;
+    int h = 0;
+    int tiles_x = 0;
+    std::vector<block> blocks;
+};
+
+// A color in single precision, as the framebuffer stores its sums
+struct float_rgb {
+    float r, g, b;
+};
+
+// The accumulated samples of an image: for every pixel the sum of its
+// samples and how many were taken, in two channels of tiled storage.
+// Renderers add up the samples of a pass in double precision and store the
+// sum once per pass, so keeping it in floats halves the memory and the
+// traffic of the image at no visible cost. Pixel (i, j) counts from the
+// bottom left, like the camera's (u, v) coordinates.
+class framebuffer {
+   public:
+    framebuffer() {}
+    framebuffer(int w, int h)
+        : sums(w, h, float_rgb{0, 0, 0}), counts(w, h, 0) {}
+
+    int width() const { return sums.width(); }
+    int height() const { return sums.height(); }
+
+    color_sum sum(int i, int j) const {
+        const float_rgb& s = sums(i, j);
+        return color_sum(s.r, s.g, s.b);
+    }
+    int samples(int i, int j) const { return counts(i, j); }
+
+    void set(int i, int j, const color_sum& sum, int samples) {
+        sums(i, j) = float_rgb{static_cast<float>(sum.x()),
+                               static_cast<float>(sum.y()),
+                               static_cast<float>(sum.z())};
+        counts(i, j) = samples;
+    }
+
+    // The pixels of a row from pixel i to the right border of its tile,
+    // read in place by the outputs
+    struct row_view {
+        const float_rgb* sums;
+        const int* samples;
+        int size;
+    };
+    row_view row(int i, int j) const {
+        return {sums.row(i, j), counts.row(i, j), sums.run(i)};
+    }
+
+    // Total number of samples in the image
+    long total_samples() const {
+        long total = 0;
+        counts.for_each([&](int c) { total += c; });
+        return total;
+    }
+
+    double average_samples() const {
+        double pixels = static_cast<double>(width()) * height();
+        return pixels > 0 ? total_samples() / pixels : 0.0;
+    }
+
+    // Fewest samples of any pixel
+    int min_samples() const {
+        if (width() == 0 || height() == 0) return 0;
+        int fewest = counts(0, 0);
+        counts.for_each([&](int c) { fewest = std::min(fewest, c); });
+        return fewest;
+    }
+
+   private:
+    tiled_buffer<float_rgb> sums;
+    tiled_buffer<int> counts;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "aabb.h"
 #include "ray.h"
 
 class material;
@@ -8,8 +9,8 @@ class material;
 struct hit_record {
     point3 p;                      // hit point
     vec3 normal;                   // normal vector
-    shared_ptr<material> mat_ptr;  // pointer to material class
-    double t;                      // t value of the ray
+    const material* mat_ptr;       // owned by the hit object
+    real t;                        // t value of the ray
     bool front_face;               // whether hit in the front face
 
     // set boolean variable front_face, set normal to point outward
@@ -22,8 +23,26 @@ struct hit_record {
 class hittable {
    public:
     // t_min to t_max gives the range of a hit that 'counts'
-    virtual bool hit(const ray& r, double t_min, double t_max,
+    virtual bool hit(const ray& r, real t_min, real t_max,
                      hit_record& rec) const = 0;
+
+    // Computes a box that bounds the object, returns false if it has none.
+    // The box of a moving object bounds it at all times.
+    virtual bool bounding_box(aabb& output_box) const = 0;
+
+    // The times between which the object moves, returns false if it does
+    // not
+    virtual bool motion_interval(double&, double&) const { return false; }
+
+    // Boxes at time0 and time1 such that, interpolated linearly, they bound
+    // the object at any time in between, and beyond them the box of the
+    // nearer time does. Returns false if the object has no bounds.
+    virtual bool motion_bounds(double, double, aabb& box0,
+                               aabb& box1) const {
+        if (!bounding_box(box0)) return false;
+        box1 = box0;
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
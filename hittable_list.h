@@ -14,17 +14,24 @@ class hittable_list : public hittable {
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        owner.reset();
+    }
     void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-    virtual bool hit(const ray& r, double t_min, double t_max,
+    virtual bool hit(const ray& r, real t_min, real t_max,
                      hit_record& rec) const;
 
-   private:
+    virtual bool bounding_box(aabb& output_box) const;
+
     std::vector<shared_ptr<hittable>> objects;
+    // keeps the objects alive when they do not own themselves, such as
+    // those of a scene_arena
+    shared_ptr<const void> owner;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max,
+bool hittable_list::hit(const ray& r, real t_min, real t_max,
                         hit_record& rec) const {
     hit_record temp_rec;
     bool hit_anything = false;
@@ -39,4 +46,16 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max,
     return hit_anything;
 }
 
+bool hittable_list::bounding_box(aabb& output_box) const {
+    if (objects.empty()) return false;
+    aabb box;
+    aabb temp_box;
+    for (const auto& object : objects) {
+        if (!object->bounding_box(temp_box)) return false;
+        box.expand(temp_box);
+    }
+    output_box = box;
+    return true;
+}
+
 #endif
\ No newline at end of file
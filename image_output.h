@@ -0,0 +1,402 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "framebuffer.h"
+#include "scheduler.h"
+
+// P3: ASCII PPM, P6: binary PPM, PFM: linear 32-bit float RGB for
+// compositing
+enum class image_format { p3, p6, pfm };
+
+// Parses "p3", "p6" or "pfm", returns false on anything else
+bool parse_image_format(const std::string& name, image_format& format) {
+    if (name == "p3")
+        format = image_format::p3;
+    else if (name == "p6")
+        format = image_format::p6;
+    else if (name == "pfm")
+        format = image_format::pfm;
+    else
+        return false;
+    return true;
+}
+
+// Picks the format from the extension of path, P6 for anything but .pfm
+image_format format_for_path(const std::string& path) {
+    auto dot = path.rfind('.');
+    if (dot != std::string::npos && path.substr(dot) == ".pfm")
+        return image_format::pfm;
+    return image_format::p6;
+}
+
+std::string image_header(image_format format, int w, int h) {
+    std::string size = std::to_string(w) + " " + std::to_string(h) + "\n";
+    switch (format) {
+        case image_format::p3:
+            return "P3\n" + size + "255\n";
+        case image_format::p6:
+            return "P6\n" + size + "255\n";
+        case image_format::pfm:
+            // a negative scale means little-endian floats
+            return "PF\n" + size + "-1.0\n";
+    }
+    return "";
+}
+
+// Bytes per pixel of the binary formats
+int pixel_size(image_format format) {
+    return format == image_format::pfm ? 3 * sizeof(float) : 3;
+}
+
+// Byte offset of pixel (i, j) from the end of the header. PPM stores the
+// top row first while PFM stores the bottom row first, like the renderer.
+size_t pixel_offset(image_format format, int w, int h, int i, int j) {
+    int row = format == image_format::pfm ? j : h - 1 - j;
+    return (static_cast<size_t>(row) * w + i) * pixel_size(format);
+}
+
+// Encodes the sum of samples_per_pixel samples in a binary format at dst
+inline void encode_pixel(image_format format, const color_sum& pixel_color,
+                         int samples_per_pixel, unsigned char* dst) {
+    if (format == image_format::pfm) {
+        float rgb[3];
+        auto scale = samples_per_pixel > 0 ? 1.0 / samples_per_pixel : 0.0;
+        for (int c = 0; c < 3; c++)
+            rgb[c] = static_cast<float>(pixel_color[c] * scale);
+        std::memcpy(dst, rgb, sizeof(rgb));
+    } else {
+        to_rgb8(pixel_color, samples_per_pixel, dst);
+    }
+}
+
+// The sum of the k-th pixel of a row of a framebuffer
+inline color_sum pixel_sum(const framebuffer::row_view& pixels, int k) {
+    const float_rgb& s = pixels.sums[k];
+    return color_sum(s.r, s.g, s.b);
+}
+
+// Destination of the rendered image
+class image_output {
+   public:
+    virtual ~image_output() {}
+
+    // Prepares an image of w * h pixels, returns false on error
+    virtual bool begin(int w, int h) = 0;
+
+    // Called from the worker threads as soon as a tile is finished, tiles
+    // never overlap so implementations need no locking
+    virtual void write_tile(const tile&, const framebuffer&) {}
+
+    // Called once the whole frame is rendered, returns false on error
+    virtual bool end(const framebuffer& frame) = 0;
+};
+
+// Writes the whole image to a stream once rendering is done, used when the
+// destination cannot be mapped (e.g. stdout)
+class stream_output : public image_output {
+   public:
+    stream_output(std::ostream& out, image_format format)
+        : out(out), format(format) {}
+    stream_output(const std::string& path, image_format format)
+        : file(path, std::ios::binary), out(file), format(format) {
+        if (!file) std::cerr << "Cannot open " << path << "\n";
+    }
+
+    virtual bool begin(int w, int h) {
+        width = w;
+        height = h;
+        out << image_header(format, w, h);
+        return bool(out);
+    }
+
+    virtual bool end(const framebuffer& frame) {
+        if (format == image_format::p3) {
+            for (int j = height - 1; j >= 0; j--) {
+                for (int i = 0; i < width;) {
+                    auto pixels = frame.row(i, j);
+                    for (int k = 0; k < pixels.size; k++, i++)
+                        write_color(out, pixel_sum(pixels, k),
+                                    pixels.samples[k]);
+                }
+            }
+            return bool(out.flush());
+        }
+        // encode a band of tile rows at a time, reading the framebuffer
+        // tile by tile as it is stored, and hand it to the stream in one
+        // write
+        const int band = tiled_buffer<int>::tile_size;
+        const size_t row_size = static_cast<size_t>(width) * pixel_size(format);
+        std::vector<unsigned char> rows(band * row_size);
+        const bool bottom_up = format == image_format::pfm;
+        const int bands = (height + band - 1) / band;
+        for (int b = 0; b < bands; b++) {
+            int y0 = (bottom_up ? b : bands - 1 - b) * band;
+            int y1 = std::min(height, y0 + band);
+            for (int x = 0; x < width; x += band) {
+                for (int j = y0; j < y1; j++) {
+                    int r = bottom_up ? j - y0 : y1 - 1 - j;
+                    unsigned char* dst =
+                        &rows[r * row_size + x * pixel_size(format)];
+                    auto pixels = frame.row(x, j);
+                    for (int k = 0; k < pixels.size; k++) {
+                        encode_pixel(format, pixel_sum(pixels, k),
+                                     pixels.samples[k], dst);
+                        dst += pixel_size(format);
+                    }
+                }
+            }
+            out.write(reinterpret_cast<const char*>(rows.data()),
+                      (y1 - y0) * row_size);
+        }
+        return bool(out.flush());
+    }
+
+   private:
+    std::ofstream file;  // only used when writing to a path
+    std::ostream& out;
+    image_format format;
+    int width = 0;
+    int height = 0;
+};
+
+// Writes finished tiles straight into a memory-mapped file, so encoding and
+// disk I/O overlap with rendering instead of following it. Only binary
+// formats have a fixed pixel size and can be written this way.
+class mapped_output : public image_output {
+   public:
+    mapped_output(const std::string& path, image_format format)
+        : path(path), format(format) {}
+
+    virtual ~mapped_output() { unmap(); }
+
+    virtual bool begin(int w, int h) {
+        width = w;
+        height = h;
+        auto header = image_header(format, w, h);
+        header_size = header.size();
+        size = header_size + static_cast<size_t>(w) * h * pixel_size(format);
+
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Cannot open " << path << ": " << strerror(errno)
+                      << "\n";
+            return false;
+        }
+        // the blocks are allocated up front: writing through the mapping
+        // to a hole of a sparse file raises SIGBUS when the disk is full
+        int error = posix_fallocate(fd, 0, size);
+        if (error == EOPNOTSUPP)
+            error = ftruncate(fd, size) != 0 ? errno : 0;
+        if (error != 0) {
+            std::cerr << "Cannot allocate " << size << " bytes for " << path
+                      << ": " << strerror(error) << "\n";
+            return false;
+        }
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                       0);
+        if (p == MAP_FAILED) {
+            std::cerr << "Cannot map " << path << ": " << strerror(errno)
+                      << "\n";
+            return false;
+        }
+        data = static_cast<unsigned char*>(p);
+        std::memcpy(data, header.data(), header_size);
+        return true;
+    }
+
+    virtual void write_tile(const tile& t, const framebuffer& frame) {
+        for (int j = t.y0; j < t.y1; j++) {
+            unsigned char* dst = data + header_size +
+                                 pixel_offset(format, width, height, t.x0, j);
+            for (int i = t.x0; i < t.x1;) {
+                auto pixels = frame.row(i, j);
+                int n = std::min(pixels.size, t.x1 - i);
+                for (int k = 0; k < n; k++) {
+                    encode_pixel(format, pixel_sum(pixels, k),
+                                 pixels.samples[k], dst);
+                    dst += pixel_size(format);
+                }
+                i += n;
+            }
+        }
+    }
+
+    // Every tile is already in the page cache, the kernel writes it back
+    virtual bool end(const framebuffer&) {
+        unmap();
+        return true;
+    }
+
+   private:
+    void unmap() {
+        if (data) munmap(data, size);
+        if (fd >= 0) close(fd);
+        data = nullptr;
+        fd = -1;
+    }
+
+    std::string path;
+    image_format format;
+    int width = 0;
+    int height = 0;
+    int fd = -1;
+    unsigned char* data = nullptr;
+    size_t header_size = 0;
+    size_t size = 0;
+};
+
+// Creates the output for path, "-" or an empty path mean stdout
+std::unique_ptr<image_output> make_output(const std::string& path,
+                                          image_format format) {
+    if (path.empty() || path == "-")
+        return std::unique_ptr<image_output>(
+            new stream_output(std::cout, format));
+    // text pixels have no fixed size and cannot be written in place
+    if (format == image_format::p3)
+        return std::unique_ptr<image_output>(new stream_output(path, format));
+    return std::unique_ptr<image_output>(new mapped_output(path, format));
+}
+
+// Writes a finished frame to path in one go, returns false on error
+bool write_image(const std::string& path, image_format format,
+                 const framebuffer& frame) {
+    auto output = make_output(path, format);
+    int w = frame.width(), h = frame.height();
+    if (!output->begin(w, h)) return false;
+    output->write_tile(tile{0, 0, w, h}, frame);
+    return output->end(frame);
+}
+
+// Writes a frame through a temporary file renamed over path, so viewers
+// never see a partly written preview
+bool write_preview(const std::string& path, const framebuffer& frame) {
+    auto temp = path + ".tmp";
+    if (!write_image(temp, format_for_path(path), frame)) return false;
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Cannot rename " << temp << " to " << path << ": "
+                  << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// The path of a frame of an animation: the run of #s in path replaced by
+// the frame number padded with zeros to its length, or _NNNN put before
+// the extension if path has none
+std::string frame_path(const std::string& path, int frame) {
+    auto first = path.find('#');
+    auto number = [&](size_t digits) {
+        auto n = std::to_string(frame);
+        return std::string(n.size() < digits ? digits - n.size() : 0, '0') +
+               n;
+    };
+    if (first == std::string::npos) {
+        auto dot = path.rfind('.');
+        auto slash = path.rfind('/');
+        if (dot == std::string::npos ||
+            (slash != std::string::npos && dot < slash))
+            dot = path.size();
+        return path.substr(0, dot) + "_" + number(4) + path.substr(dot);
+    }
+    auto last = path.find_first_not_of('#', first);
+    if (last == std::string::npos) last = path.size();
+    return path.substr(0, first) + number(last - first) + path.substr(last);
+}
+
+// Ends the outputs of finished frames on a thread of its own, so that
+// encoding and writing a frame overlaps with rendering the next. A frame
+// submitted while the last one is still being written waits for it, so
+// there are never more than two frames in memory.
+class frame_writer {
+   public:
+    frame_writer() : thread(&frame_writer::work, this) {}
+    ~frame_writer() { finish(); }
+    frame_writer(const frame_writer&) = delete;
+    frame_writer& operator=(const frame_writer&) = delete;
+
+    // Ends output with frame. Unless written is set, the output has not
+    // seen the tiles of the frame and is given all of it first. Returns
+    // false if writing an earlier frame failed.
+    bool submit(std::unique_ptr<image_output> output, framebuffer&& frame,
+                bool written);
+
+    // Waits for the frames submitted, returns false if any failed
+    bool finish();
+
+   private:
+    void work();
+
+    std::mutex lock;  // guards the fields below
+    std::condition_variable changed;
+    std::unique_ptr<image_output> output;  // of the frame waiting, if any
+    framebuffer frame;
+    bool written = false;
+    bool writing = false;
+    bool failed = false;
+    bool stopping = false;
+    std::thread thread;  // last, started once the fields above exist
+};
+
+bool frame_writer::submit(std::unique_ptr<image_output> next,
+                          framebuffer&& next_frame, bool next_written) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&]() { return !output && !writing; });
+    output = std::move(next);
+    frame = std::move(next_frame);
+    written = next_written;
+    changed.notify_all();
+    return !failed;
+}
+
+bool frame_writer::finish() {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (stopping) return !failed;
+        changed.wait(guard, [&]() { return !output && !writing; });
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+    return !failed;
+}
+
+void frame_writer::work() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [&]() { return output || stopping; });
+        if (!output) return;
+        auto out = std::move(output);
+        auto f = std::move(frame);
+        bool whole = !written;
+        writing = true;
+        guard.unlock();
+        if (whole) out->write_tile(tile{0, 0, f.width(), f.height()}, f);
+        bool ok = out->end(f);
+        out.reset();  // closes the file
+        guard.lock();
+        writing = false;
+        failed = failed || !ok;
+        changed.notify_all();
+    }
+}
+
+#endif
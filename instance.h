@@ -0,0 +1,135 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <vector>
+
+#include "bvh.h"
+#include "hittable.h"
+#include "transform.h"
+
+// A shared object (a sphere, a mesh or a whole BVH) placed by a transform,
+// and optionally given another material. Rays are moved into the space of
+// the prototype, so however many instances there are, its geometry and
+// acceleration structure exist once.
+class instance : public hittable {
+   public:
+    shared_ptr<hittable> prototype;
+    affine_transform to_world;
+    affine_transform to_object;
+    shared_ptr<material> mat_ptr;  // none keeps the prototype's materials
+
+    instance() {}
+    // to_world must be invertible, see valid()
+    instance(shared_ptr<hittable> prototype, const affine_transform& to_world,
+             shared_ptr<material> m = nullptr)
+        : prototype(prototype), to_world(to_world), mat_ptr(m) {
+        if (!to_world.inverse(to_object)) this->prototype = nullptr;
+    }
+
+    bool valid() const { return prototype != nullptr; }
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const {
+        aabb box;
+        if (!valid() || !prototype->bounding_box(box)) return false;
+        output_box = to_world.box(box);
+        return true;
+    }
+};
+
+bool instance::hit(const ray& r, real t_min, real t_max,
+                   hit_record& rec) const {
+    // the direction is not normalized, so t is the same in both spaces
+    ray local(to_object.point(r.origin()), to_object.vector(r.direction()),
+              r.time());
+    if (!prototype->hit(local, t_min, t_max, rec)) return false;
+    rec.p = to_world.point(rec.p);
+    // already facing the ray, and the transform keeps that
+    rec.normal = unit_vector(to_object.normal(rec.normal));
+    if (mat_ptr) rec.mat_ptr = mat_ptr.get();
+    return true;
+}
+
+// The top level of a two-level acceleration structure: instances kept by
+// value in one array under a flat_bvh, each pointing to a prototype with
+// a BVH of its own, the bottom level. Add the instances, then call
+// build() before tracing.
+class instance_set : public hittable {
+   public:
+    // Adds inst, returns false if its transform is singular or its
+    // prototype has no bounding box
+    bool add(const instance& inst) {
+        aabb box;
+        if (!inst.bounding_box(box)) return false;
+        instances.push_back(inst);
+        return true;
+    }
+
+    // Builds the BVH, reordering the instances into its leaves. Returns
+    // false if there are none.
+    bool build();
+
+    size_t size() const { return instances.size(); }
+    // Bytes of the instances and the BVH, not of the prototypes
+    size_t memory() const {
+        return instances.capacity() * sizeof(instance) + bvh.memory();
+    }
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const {
+        if (bvh.empty()) return false;
+        output_box = bvh.bounds();
+        return true;
+    }
+
+   private:
+    std::vector<instance> instances;
+    flat_bvh bvh;
+};
+
+bool instance_set::build() {
+    std::vector<size_t> order;
+    {
+        std::vector<bvh_build_item> items;
+        items.reserve(instances.size());
+        for (size_t k = 0; k < instances.size(); k++) {
+            aabb box;
+            instances[k].bounding_box(box);
+            items.push_back({box, box.centroid(), k});
+        }
+        bvh.build(items, order, 2);
+    }
+    // in place, cycle by cycle, as the instances are most of the memory
+    std::vector<bool> placed(order.size());
+    for (size_t start = 0; start < order.size(); start++) {
+        if (placed[start]) continue;
+        instance first = std::move(instances[start]);
+        size_t k = start;
+        for (; order[k] != start; k = order[k]) {
+            instances[k] = std::move(instances[order[k]]);
+            placed[k] = true;
+        }
+        instances[k] = std::move(first);
+        placed[k] = true;
+    }
+    return !bvh.empty();
+}
+
+bool instance_set::hit(const ray& r, real t_min, real t_max,
+                       hit_record& rec) const {
+    hit_record temp_rec;
+    return bvh.traverse(r, t_min, t_max, [&](int k, real& limit) {
+        // not virtual, the instances are all of this class
+        if (!instances[k].instance::hit(r, t_min, limit, temp_rec))
+            return false;
+        limit = temp_rec.t;
+        rec = temp_rec;
+        return true;
+    });
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <algorithm>
+
+#include "aov.h"
+#include "common.h"
+#include "hittable.h"
+#include "light.h"
+#include "material.h"
+#include "stats.h"
+
+// Bounds on the length of a path
+struct path_limits {
+    int max_depth = 50;  // rays in a path before it is cut off
+    // rays in a path before Russian roulette may end it, max_depth or more
+    // turns it off
+    int roulette_depth = 5;
+};
+
+// Background color of a ray that escaped the world, a blue-scale gradient
+color background(const ray& r) {
+    vec3 unit_direction = unit_vector(r.direction());
+    auto t = 0.5 * (unit_direction.y() + 1.0);  // map y to [0, 1]
+    // blend blue and white linearly in background
+    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+}
+
+// Background of a ray that escaped, the environment map of lights if
+// there is one
+color background(const ray& r, const light_list& lights) {
+    auto map = lights.environment_light();
+    return map ? map->radiance(unit_vector(r.direction())) : background(r);
+}
+
+// Weight of a sample drawn with density pdf against the other strategy,
+// which draws it with density other (the power heuristic)
+inline real power_heuristic(real pdf, real other) {
+    return pdf * pdf / (pdf * pdf + other * other);
+}
+
+// Finds the closest hit of r in the world, counted in the statistics.
+// World is hittable or, to call its hit directly, a final class of it.
+template <typename World>
+inline bool trace(const World& world, const ray& r, hit_record& rec) {
+    RT_STAT(rays, 1);
+    RT_TIMER(timer_trace);
+    return world.hit(r, 0.001, infinity, rec);
+}
+
+// Finds the closest hit of shadow ray r, counted in the statistics
+template <typename World>
+inline bool trace_shadow(const World& world, const ray& r, hit_record& rec) {
+    RT_STAT(shadow_rays, 1);
+    RT_TIMER(timer_trace);
+    return world.hit(r, 0.001, infinity, rec);
+}
+
+// Draws a light for the diffuse surface hit at rec (next-event
+// estimation): shadow is the ray towards it, and factor what the light
+// arriving along it times the albedo is multiplied by, the BSDF over pi
+// times the cosine over the density of the direction, weighted against
+// scattering towards it. Returns false if there is no ray to trace.
+bool sample_light(const light_list& lights, const ray& r_in,
+                  const hit_record& rec, const lambertian& m, ray& shadow,
+                  real& factor) {
+    vec3 direction;
+    real light_pdf;
+    if (!lights.sample(rec.p, direction, light_pdf)) return false;
+    // the density of the scatter is the cosine over pi too
+    auto cosine = m.cosine_over_pi(rec, direction);
+    if (cosine <= 0) return false;
+    shadow = ray(rec.p, direction, r_in.time());
+    factor = cosine * power_heuristic(light_pdf, cosine) / light_pdf;
+    return true;
+}
+
+// Light arriving along shadow ray r, which hit rec or escaped if rec is
+// null. The sky gradient is not a light, it is only found by scattering.
+color shadow_light(const ray& r, const hit_record* rec,
+                   const light_list& lights) {
+    if (rec) return emitted(*rec->mat_ptr, *rec);
+    auto map = lights.environment_light();
+    return map ? map->radiance(r.direction()) : color(0, 0, 0);
+}
+
+// Light reaching the diffuse surface hit at rec straight from a light,
+// times the BSDF and the cosine, see sample_light
+template <typename World>
+color direct_light(const World& world, const light_list& lights,
+                   const ray& r_in, const hit_record& rec,
+                   const lambertian& m) {
+    ray shadow;
+    real factor;
+    if (!sample_light(lights, r_in, rec, m, shadow, factor))
+        return color(0, 0, 0);
+    hit_record hit;
+    bool found = trace_shadow(world, shadow, hit);
+    return m.albedo * shadow_light(shadow, found ? &hit : nullptr, lights) *
+           factor;
+}
+
+// The AOVs of camera ray r, which hit rec or escaped if rec is null
+aov_sample first_hit_aovs(const ray& r, const hit_record* rec,
+                          const light_list& lights) {
+    if (!rec) return {background(r, lights), vec3(0, 0, 0), 0, false};
+    return {surface_albedo(*rec->mat_ptr), rec->normal,
+            rec->t * r.direction().length(), true};
+}
+
+// Moves the albedo and normal of s from a specular surface on to what is
+// seen in it: what ray r, scattered there, hit at rec or escaped to if rec
+// is null. The albedo of the mirror tints the new one, and the depth stays
+// the mirror's. Returns whether the new surface is specular too. Without
+// this a mirror has the flat AOVs of its own surface, and the denoiser
+// blurs away its reflection.
+bool follow_specular_aovs(aov_sample& s, const ray& r, const hit_record* rec,
+                          const light_list& lights) {
+    if (!rec) {
+        s.albedo = s.albedo * background(r, lights);
+        s.normal = vec3(0, 0, 0);
+        return false;
+    }
+    s.albedo = s.albedo * surface_albedo(*rec->mat_ptr);
+    s.normal = rec->normal;
+    return is_specular(*rec->mat_ptr);
+}
+
+// Color of the ray r that hit the world at rec: follows the path it starts
+// one bounce at a time, multiplying the attenuations into the throughput,
+// until it escapes to the background, is absorbed or is cut off. Past
+// roulette_depth a path survives each bounce with a probability that
+// follows its throughput, and survivors are weighted up to stay unbiased.
+// The AOVs of the first hit, if given, follow the path past specular
+// surfaces, see follow_specular_aovs.
+//
+// With lights, every diffuse bounce also samples one (direct_light). The
+// light a scattered ray then finds on a light or in the environment map is
+// weighted against that sample by multiple importance sampling; after
+// specular bounces, which cannot sample lights, it counts in full.
+//
+// The kernel is compiled for a World type, the material kinds the world
+// may hold (Kinds, see scatter), whether lights are sampled, and whether
+// AOVs are taken: a kernel without Lights requires lights.empty(), and one
+// without AOVs ignores first. hit_color is the kernel for any scene.
+template <typename World, unsigned Kinds, bool Lights, bool AOVs>
+color hit_color_kernel(const ray& r, const hit_record& rec,
+                       const World& world, const light_list& lights,
+                       const path_limits& limits, aov_sample* first) {
+    if constexpr (!AOVs) first = nullptr;
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray current = r;
+    hit_record hit = rec;
+    bool following = first && is_specular(*rec.mat_ptr);
+    // density of the scatter that led to hit if it was weighted against a
+    // light sample, else zero
+    real scatter_pdf = 0;
+    auto weight = [&]() -> real {
+        if (scatter_pdf <= 0) return 1;
+        return power_heuristic(
+            scatter_pdf,
+            lights.pdf(current.origin(), unit_vector(current.direction())));
+    };
+    for (int depth = 1;; depth++) {
+        if constexpr ((Kinds & kind_bit(material_kind::light)) != 0)
+            if (hit.mat_ptr->kind == material_kind::light)
+                radiance +=
+                    throughput * emitted(*hit.mat_ptr, hit) * weight();
+        ray scattered;
+        color attenuation;
+        if (!scatter<Kinds>(*hit.mat_ptr, current, hit, attenuation,
+                            scattered)) {
+            RT_STAT(absorbed, 1);
+            return radiance;
+        }
+        if (depth >= limits.max_depth) {
+            RT_STAT(max_depth, 1);
+            return radiance;
+        }
+        scatter_pdf = 0;
+        if constexpr (Lights &&
+                      (Kinds & kind_bit(material_kind::lambertian)) != 0) {
+            if (hit.mat_ptr->kind == material_kind::lambertian &&
+                !lights.empty()) {
+                const auto& m = static_cast<const lambertian&>(*hit.mat_ptr);
+                radiance += throughput * direct_light(world, lights, current,
+                                                      hit, m);
+                scatter_pdf =
+                    m.cosine_over_pi(hit, unit_vector(scattered.direction()));
+            }
+        }
+        throughput = throughput * attenuation;
+        if (depth >= limits.roulette_depth) {
+            auto survival = std::min<real>(
+                0.95, std::max({throughput.x(), throughput.y(),
+                                throughput.z()}));
+            if (random_double() >= survival) {
+                RT_STAT(roulette, 1);
+                return radiance;
+            }
+            throughput /= survival;
+        }
+        current = scattered;
+        bool hit_world = trace(world, current, hit);
+        if (following)
+            following = follow_specular_aovs(
+                *first, current, hit_world ? &hit : nullptr, lights);
+        if (!hit_world) {
+            RT_STAT(escaped, 1);
+            // the sky gradient is not sampled as a light
+            if (!lights.environment_light()) scatter_pdf = 0;
+            return radiance +
+                   throughput * background(current, lights) * weight();
+        }
+    }
+}
+
+color hit_color(const ray& r, const hit_record& rec, const hittable& world,
+                const light_list& lights, const path_limits& limits,
+                aov_sample* first = nullptr) {
+    return hit_color_kernel<hittable, all_material_kinds, true, true>(
+        r, rec, world, lights, limits, first);
+}
+
+// Assign the given ray a color in the world.
+// If the ray hits nothing, it's in blue-scale background color.
+// The AOVs of its first hit go to first if given. The kernel is compiled
+// like hit_color_kernel, and ray_color is the one for any scene.
+template <typename World, unsigned Kinds, bool Lights, bool AOVs>
+color ray_color_kernel(const ray& r, const World& world,
+                       const light_list& lights, const path_limits& limits,
+                       aov_sample* first) {
+    RT_TIMER(timer_integrate);
+    if constexpr (!AOVs) first = nullptr;
+    hit_record rec;
+    if (limits.max_depth <= 0) {
+        if (first) *first = first_hit_aovs(r, nullptr, lights);
+        return color(0, 0, 0);
+    }
+    if (trace(world, r, rec)) {
+        if (first) *first = first_hit_aovs(r, &rec, lights);
+        return hit_color_kernel<World, Kinds, Lights, AOVs>(
+            r, rec, world, lights, limits, first);
+    }
+    if (first) *first = first_hit_aovs(r, nullptr, lights);
+    RT_STAT(escaped, 1);
+    return background(r, lights);
+}
+
+color ray_color(const ray& r, const hittable& world, const light_list& lights,
+                const path_limits& limits, aov_sample* first = nullptr) {
+    return ray_color_kernel<hittable, all_material_kinds, true, true>(
+        r, world, lights, limits, first);
+}
+
+#endif
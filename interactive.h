@@ -0,0 +1,289 @@
+#ifndef INTERACTIVE_H
+#define INTERACTIVE_H
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "image_output.h"
+#include "net.h"
+#include "scene_file.h"
+
+// The interactive mode renders one view of the scene until an edit changes
+// it. Edits are commands, one per line, read from stdin or from the
+// connections to a socket, one connection at a time:
+//
+//   camera FROM_X FROM_Y FROM_Z AT_X AT_Y AT_Z UP_X UP_Y UP_Z VFOV APERTURE
+//          FOCUS_DIST                    (on one line, like in scene files)
+//   lookfrom X Y Z
+//   lookat X Y Z
+//   vup X Y Z
+//   vfov DEGREES
+//   aperture APERTURE
+//   focus DIST
+//   spp SAMPLES
+//   quit
+//
+// Every command but quit is an edit. Invalid commands are reported and
+// ignored.
+
+using edit_clock = std::chrono::steady_clock;
+
+// What the interactive mode renders
+struct interactive_view {
+    camera_settings camera;
+    int samples_per_pixel;
+};
+
+// Reads the edits on a thread of its own and keeps the latest view. Every
+// edit bumps the generation, which renders poll to give up on a view that
+// changed.
+class edit_channel {
+   public:
+    explicit edit_channel(const interactive_view& view) : view(view) {}
+    ~edit_channel() { close(); }
+    edit_channel(const edit_channel&) = delete;
+    edit_channel& operator=(const edit_channel&) = delete;
+
+    // Starts reading the edits of source: "-" for stdin, else an address
+    // to listen on (see net.h). Returns false if it cannot listen.
+    bool open(const std::string& source);
+
+    // Stops reading
+    void close();
+
+    // Number of edits so far
+    uint64_t generation() const { return edits.load(); }
+    // Whether quit was read
+    bool quitting() const { return quit.load(); }
+    // Whether stdin ended, so no edits can follow
+    bool ended() const { return end_of_input.load(); }
+
+    // The latest view, its generation and when it arrived
+    interactive_view current(uint64_t& generation,
+                             edit_clock::time_point& arrived) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation = edits.load();
+        arrived = this->arrived;
+        return view;
+    }
+
+    // Waits for an edit after generation seen, quit or the end of stdin,
+    // at most `seconds`
+    void wait(uint64_t seen, double seconds) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_for(lock, std::chrono::duration<double>(seconds), [&]() {
+            return edits.load() != seen || quit.load() ||
+                   end_of_input.load();
+        });
+    }
+
+   private:
+    void read_loop();
+    // Applies the commands read from fd until it closes or the channel
+    // stops
+    void read_lines(int fd);
+    // Applies command number `line` of the source
+    void apply(const std::string& command, int line);
+    void notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        changed.notify_all();
+    }
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    interactive_view view;
+    edit_clock::time_point arrived = edit_clock::now();
+    std::atomic<uint64_t> edits{0};
+    std::atomic<bool> quit{false};
+    std::atomic<bool> end_of_input{false};
+    std::atomic<bool> stopping{false};
+    std::string source;
+    int listener = -1;  // -1 reads stdin
+    std::thread reader;
+};
+
+bool edit_channel::open(const std::string& source) {
+    this->source = source;
+    if (source != "-") {
+        listener = listen_socket(source);
+        if (listener < 0) return false;
+        std::cerr << ">> Waiting for edits on " << source << std::endl;
+    }
+    reader = std::thread(&edit_channel::read_loop, this);
+    return true;
+}
+
+void edit_channel::close() {
+    stopping = true;
+    if (reader.joinable()) reader.join();
+    if (listener >= 0) {
+        ::close(listener);
+        listener = -1;
+    }
+}
+
+void edit_channel::read_loop() {
+    if (listener < 0) {
+        read_lines(STDIN_FILENO);
+        end_of_input = true;
+        notify();
+        return;
+    }
+    while (!stopping && !quit) {
+        pollfd p{listener, POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) continue;
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        std::cerr << ">> Edits connected" << std::endl;
+        read_lines(fd);
+        ::close(fd);
+        std::cerr << ">> Edits disconnected" << std::endl;
+    }
+}
+
+void edit_channel::read_lines(int fd) {
+    std::string pending;
+    int line = 0;
+    char buffer[4096];
+    while (!stopping && !quit) {
+        // polled so that close() is never stuck behind a read
+        pollfd p{fd, POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) continue;
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.append(buffer, n);
+        size_t start = 0;
+        for (size_t eol; (eol = pending.find('\n', start)) !=
+                         std::string::npos;
+             start = eol + 1)
+            apply(pending.substr(start, eol - start), ++line);
+        pending.erase(0, start);
+    }
+    if (!pending.empty() && !stopping && !quit) apply(pending, ++line);
+}
+
+void edit_channel::apply(const std::string& command, int line) {
+    scene_parser parser(source == "-" ? "stdin" : source, command, line);
+    std::string name;
+    if (!parser.next_line() || !parser.word(name)) return;
+    // only this thread changes the view
+    interactive_view v = view;
+    auto& c = v.camera;
+    bool valid;
+    if (name == "quit") {
+        quit = true;
+        notify();
+        return;
+    } else if (name == "camera") {
+        valid = parser.vector(c.lookfrom) && parser.vector(c.lookat) &&
+                parser.vector(c.vup) && parser.number(c.vfov) &&
+                parser.number(c.aperture) && parser.number(c.focus_dist);
+    } else if (name == "lookfrom") {
+        valid = parser.vector(c.lookfrom);
+    } else if (name == "lookat") {
+        valid = parser.vector(c.lookat);
+    } else if (name == "vup") {
+        valid = parser.vector(c.vup);
+    } else if (name == "vfov") {
+        valid = parser.number(c.vfov);
+    } else if (name == "aperture") {
+        valid = parser.number(c.aperture);
+    } else if (name == "focus") {
+        valid = parser.number(c.focus_dist);
+    } else if (name == "spp") {
+        valid = parser.integer(v.samples_per_pixel);
+    } else {
+        valid = parser.error("unknown command " + name);
+    }
+    if (!valid || !parser.done()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        view = v;
+        arrived = edit_clock::now();
+        edits++;
+    }
+    changed.notify_all();
+}
+
+// The power of two the size of a w * h image is divided by for the first
+// pass of an edit, one sample per pixel on `threads` threads at
+// ns_per_path per sample, so that it renders within budget_ms
+int preview_scale(int w, int h, int threads, double ns_per_path,
+                  double budget_ms) {
+    int scale = 1;
+    auto ms = [&]() {
+        double pixels = static_cast<double>(w / scale) * (h / scale);
+        return pixels * ns_per_path / threads / 1e6;
+    };
+    while (scale < 64 && std::min(w, h) / scale > 1 && ms() > budget_ms)
+        scale *= 2;
+    return scale;
+}
+
+// The w * h frame showing low, a smaller rendering of the same view, with
+// every pixel of low repeated over the pixels it covers
+framebuffer upscale(const framebuffer& low, int w, int h) {
+    framebuffer frame(w, h);
+    for (int j = 0; j < h; j++) {
+        int low_j = static_cast<int>(static_cast<long>(j) * low.height() / h);
+        for (int i = 0; i < w; i++) {
+            int low_i =
+                static_cast<int>(static_cast<long>(i) * low.width() / w);
+            frame.set(i, j, low.sum(low_i, low_j),
+                      low.samples(low_i, low_j));
+        }
+    }
+    return frame;
+}
+
+// Sends a frame to the viewer: appended to stdout as one more image of a
+// stream, which e.g. `ffplay -f image2pipe -i -` shows, or written over
+// the image file at path, see write_preview. Returns false on error.
+bool send_frame(const std::string& path, image_format format,
+                const framebuffer& frame) {
+    if (path != "-") return write_preview(path, frame);
+    stream_output out(std::cout, format);
+    bool written = out.begin(frame.width(), frame.height()) && out.end(frame);
+    std::cout.flush();
+    return written && bool(std::cout);
+}
+
+// Latency of the edits, from their arrival to the first tile rendered for
+// them and to their first frame sent
+struct edit_latency {
+    std::vector<double> first_pixel_ms;
+    std::vector<double> first_frame_ms;
+
+    void print() const {
+        if (first_frame_ms.empty()) return;
+        auto summary = [](std::vector<double> ms) {
+            std::sort(ms.begin(), ms.end());
+            char text[64];
+            std::snprintf(text, sizeof(text), "median %.1f ms, max %.1f ms",
+                          ms[ms.size() / 2], ms.back());
+            return std::string(text);
+        };
+        std::cerr << ">> Latency of " << first_frame_ms.size()
+                  << " edits: first pixel " << summary(first_pixel_ms)
+                  << ", first frame " << summary(first_frame_ms)
+                  << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "baked_scene.h"
+#include "common.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "reference.h"
+#include "sphere.h"
+
+// Picks the interval of a CDF (of count + 1 ascending values from 0 to 1)
+// that u falls in, and stretches u over it back to [0, 1)
+inline int sample_cdf(const double* cdf, int count, double& u) {
+    int k = std::upper_bound(cdf + 1, cdf + count + 1, u) - (cdf + 1);
+    k = std::min(k, count - 1);
+    auto width = cdf[k + 1] - cdf[k];
+    u = width > 0 ? std::min((u - cdf[k]) / width, 1.0) : 0.0;
+    return k;
+}
+
+// Turns count weights into a CDF of count + 1 values, returns their sum
+inline double build_cdf(const double* weights, int count, double* cdf) {
+    cdf[0] = 0;
+    for (int k = 0; k < count; k++) cdf[k + 1] = cdf[k] + weights[k];
+    double total = cdf[count];
+    if (total > 0)
+        for (int k = 1; k <= count; k++) cdf[k] /= total;
+    return total;
+}
+
+// Light from all directions, a latitude-longitude image: row 0 looks up
+// (+y), and columns go around y from +x towards +z. Directions are drawn
+// by the luminance of the pixels times their solid angle, from a CDF over
+// the rows and one over the pixels of every row built when it loads.
+class environment_map {
+   public:
+    // Reads a PFM image and scales it, returns false on error
+    bool load(const std::string& path, double scale = 1);
+
+    // Whether the map gives off no light, and cannot be sampled
+    bool dark() const { return total == 0; }
+
+    // Radiance arriving from unit direction d
+    color radiance(const vec3& d) const {
+        int i, j;
+        pixel_of(d, i, j);
+        const float* p = &rgb[(static_cast<size_t>(j) * w + i) * 3];
+        return color(p[0], p[1], p[2]);
+    }
+
+    // Draws a unit direction from u1 and u2 in [0, 1), returns false if
+    // the map is black. pdf is per solid angle.
+    bool sample(double u1, double u2, vec3& d, real& pdf) const;
+
+    // Density per solid angle with which sample draws unit direction d
+    real pdf(const vec3& d) const {
+        if (total == 0) return 0;
+        int i, j;
+        pixel_of(d, i, j);
+        auto sin_theta = std::sqrt(std::max<real>(0, 1 - d.y() * d.y()));
+        if (sin_theta <= 0) return 0;
+        return weights[static_cast<size_t>(j) * w + i] / total * w * h /
+               (2 * pi * pi * sin_theta);
+    }
+
+   private:
+    void pixel_of(const vec3& d, int& i, int& j) const {
+        auto theta = std::acos(clamp(d.y(), -1, 1));
+        auto phi = std::atan2(d.z(), d.x());
+        if (phi < 0) phi += 2 * pi;
+        i = std::min(static_cast<int>(phi / (2 * pi) * w), w - 1);
+        j = std::min(static_cast<int>(theta / pi * h), h - 1);
+    }
+
+    int w = 0, h = 0;
+    std::vector<float> rgb;         // rows from the top
+    std::vector<double> weights;    // luminance times solid angle
+    std::vector<double> row_cdf;    // h + 1 values
+    std::vector<double> pixel_cdf;  // w + 1 values per row
+    double total = 0;               // of the weights
+};
+
+bool environment_map::load(const std::string& path, double scale) {
+    std::vector<float> image;
+    if (!read_pfm(path, w, h, image)) {
+        w = h = 0;
+        return false;
+    }
+    // PFM rows start at the bottom
+    rgb.resize(image.size());
+    for (int j = 0; j < h; j++)
+        for (int k = 0; k < w * 3; k++)
+            rgb[static_cast<size_t>(j) * w * 3 + k] =
+                image[static_cast<size_t>(h - 1 - j) * w * 3 + k] * scale;
+
+    weights.resize(static_cast<size_t>(w) * h);
+    pixel_cdf.resize(static_cast<size_t>(w + 1) * h);
+    row_cdf.resize(h + 1);
+    std::vector<double> rows(h);
+    for (int j = 0; j < h; j++) {
+        auto sin_theta = std::sin((j + 0.5) / h * pi);
+        for (int i = 0; i < w; i++) {
+            const float* p = &rgb[(static_cast<size_t>(j) * w + i) * 3];
+            weights[static_cast<size_t>(j) * w + i] =
+                std::max(0.0, luminance(color(p[0], p[1], p[2]))) *
+                sin_theta;
+        }
+        rows[j] = build_cdf(&weights[static_cast<size_t>(j) * w], w,
+                            &pixel_cdf[static_cast<size_t>(j) * (w + 1)]);
+    }
+    total = build_cdf(rows.data(), h, row_cdf.data());
+    return true;
+}
+
+bool environment_map::sample(double u1, double u2, vec3& d,
+                             real& pdf) const {
+    if (total == 0) return false;
+    int j = sample_cdf(row_cdf.data(), h, u1);
+    int i = sample_cdf(&pixel_cdf[static_cast<size_t>(j) * (w + 1)], w, u2);
+    // uniform in angles within the pixel
+    auto theta = (j + u1) / h * pi;
+    auto phi = (i + u2) / w * 2 * pi;
+    auto sin_theta = std::sin(theta);
+    d = vec3(sin_theta * std::cos(phi), std::cos(theta),
+             sin_theta * std::sin(phi));
+    if (sin_theta <= 0) return false;
+    pdf = weights[static_cast<size_t>(j) * w + i] / total * w * h /
+          (2 * pi * pi * sin_theta);
+    return pdf > 0;
+}
+
+// The lights of a scene that are sampled explicitly: spheres of a light
+// material, and the environment map if there is one. A light is picked
+// with a probability that follows its power, the environment taking half
+// when there are spheres too, and a sphere is sampled uniformly over the
+// cone it fills as seen from the point lit. The density of a direction
+// sums over all lights, so what the ray towards it meets first counts,
+// whichever light was picked.
+class light_list {
+   public:
+    void add_sphere(const point3& center, real radius, const color& emit) {
+        spheres.push_back({center, radius, emit});
+    }
+
+    // Adds the spheres of world with a light material
+    void add_spheres(const hittable_list& world);
+    // Adds the spheres of a baked scene with a light material
+    void add_spheres(const baked_scene& baked);
+
+    void set_environment(shared_ptr<const environment_map> map) {
+        environment = std::move(map);
+    }
+
+    // Computes the probabilities of the lights, once they are all added.
+    // Without sampling the list only holds the environment map, to be
+    // found by scattering.
+    void finish(bool sampling = true);
+
+    // Whether there are no lights to sample
+    bool empty() const {
+        return !sampling ||
+               (spheres.empty() && environment_probability == 0);
+    }
+    size_t size() const {
+        return spheres.size() + (environment_probability > 0 ? 1 : 0);
+    }
+
+    // The environment map, null if there is none
+    const environment_map* environment_light() const {
+        return environment.get();
+    }
+
+    // Draws a unit direction from p towards a light with the calling
+    // thread's generator. Returns false if the light picked cannot be
+    // seen from p, else the density of the direction, see pdf.
+    bool sample(const point3& p, vec3& direction, real& density) const;
+
+    // Density per solid angle with which sample draws unit direction from
+    // p
+    real pdf(const point3& p, const vec3& direction) const;
+
+   private:
+    struct sphere_light {
+        point3 center;
+        real radius;
+        color emit;
+    };
+
+    // One minus the cosine of the half-angle of the cone of sphere s seen
+    // from p, zero if p is inside it. to is the vector from p to its center.
+    static real cone_width(const sphere_light& s, const vec3& to) {
+        auto d2 = to.length_squared(), r2 = s.radius * s.radius;
+        if (d2 <= r2) return 0;
+        // 1 - sqrt(1 - x) without the cancellation for small cones
+        auto x = r2 / d2;
+        return x / (1 + std::sqrt(1 - x));
+    }
+
+    std::vector<sphere_light> spheres;
+    std::vector<double> probabilities;  // of picking every sphere
+    std::vector<double> cdf;
+    shared_ptr<const environment_map> environment;
+    double environment_probability = 0;
+    bool sampling = true;
+};
+
+void light_list::add_spheres(const hittable_list& world) {
+    for (const auto& object : world.objects) {
+        auto s = dynamic_cast<const sphere*>(object.get());
+        if (s && s->mat_ptr->kind == material_kind::light)
+            add_sphere(s->center, s->radius,
+                       static_cast<const diffuse_light&>(*s->mat_ptr).emit);
+    }
+}
+
+void light_list::add_spheres(const baked_scene& baked) {
+    const auto& a = baked.baked();
+    const auto& materials = baked.material_table();
+    for (size_t k = 0; k < a.sphere_count; k++) {
+        const material* m = materials[a.material_id[k]];
+        if (m->kind == material_kind::light)
+            add_sphere(point3(a.cx[k], a.cy[k], a.cz[k]), a.radius[k],
+                       static_cast<const diffuse_light*>(m)->emit);
+    }
+}
+
+void light_list::finish(bool sampling) {
+    this->sampling = sampling;
+    environment_probability = !environment || environment->dark() ? 0
+                              : spheres.empty()                  ? 1
+                                                                 : 0.5;
+    std::vector<double> power(spheres.size());
+    for (size_t k = 0; k < spheres.size(); k++)
+        power[k] = std::max(0.0, luminance(spheres[k].emit)) *
+                   spheres[k].radius * spheres[k].radius;
+    cdf.resize(spheres.size() + 1);
+    double total = build_cdf(power.data(), spheres.size(), cdf.data());
+    probabilities.resize(spheres.size());
+    for (size_t k = 0; k < spheres.size(); k++)
+        probabilities[k] = total > 0 ? (1 - environment_probability) *
+                                           power[k] / total
+                                     : 0;
+}
+
+bool light_list::sample(const point3& p, vec3& direction,
+                        real& density) const {
+    if (empty()) return false;
+    double pick = random_double();
+    double u1 = random_double(), u2 = random_double();
+    if (pick < environment_probability) {
+        real unused;
+        if (!environment->sample(u1, u2, direction, unused)) return false;
+    } else {
+        if (probabilities.empty()) return false;
+        pick = (pick - environment_probability) /
+               (1 - environment_probability);
+        const auto& s = spheres[sample_cdf(cdf.data(), spheres.size(),
+                                           pick)];
+        vec3 to = s.center - p;
+        auto width = cone_width(s, to);
+        if (width <= 0) return false;
+        // uniform over the cap of the unit sphere the cone cuts out
+        auto one_minus_z = u2 * width;
+        auto z = 1 - one_minus_z;
+        auto radial = std::sqrt(one_minus_z * (2 - one_minus_z));
+        auto phi = 2 * pi * u1;
+        vec3 w = unit_vector(to);
+        vec3 a = std::fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        vec3 v = unit_vector(cross(w, a));
+        vec3 u = cross(w, v);
+        direction = radial * std::cos(phi) * u +
+                    radial * std::sin(phi) * v + z * w;
+    }
+    density = pdf(p, direction);
+    return density > 0;
+}
+
+real light_list::pdf(const point3& p, const vec3& direction) const {
+    real density = 0;
+    for (size_t k = 0; k < spheres.size(); k++) {
+        const auto& s = spheres[k];
+        vec3 to = s.center - p;
+        auto width = cone_width(s, to);
+        if (width <= 0) continue;
+        // inside the cone: cos(angle to center) >= 1 - width
+        auto along = dot(direction, to);
+        if (along <= 0 ||
+            along * along < (1 - width) * (1 - width) * to.length_squared())
+            continue;
+        density += probabilities[k] / (2 * pi * width);
+    }
+    if (environment)
+        density += environment_probability * environment->pdf(direction);
+    return density;
+}
+
+#endif
@@ -1,60 +1,32 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <vector>
 
-#include "ThreadPool.h"
+#include "adaptive.h"
+#include "baked_scene.h"
+#include "bvh.h"
+#include "checkpoint.h"
 #include "common.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "framebuffer.h"
 #include "hittable_list.h"
+#include "image_output.h"
+#include "integrator.h"
+#include "interactive.h"
+#include "light.h"
 #include "material.h"
+#include "options.h"
+#include "packet.h"
+#include "reference.h"
+#include "scene_cache.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "scheduler.h"
 #include "sphere.h"
-
-hittable_list random_scene() {
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2,
-                          b + 0.9 * random_double());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(
-                        make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(
-                        make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(
-                        make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
-    }
-
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    return world;
-}
+#include "stats.h"
+#include "wavefront.h"
 
 // Returns `t` of the hit point that we faces or -1.0
 double hit_sphere(const point3& center, double radius, const ray& r) {
@@ -73,96 +45,866 @@ double hit_sphere(const point3& center, double radius, const ray& r) {
     }
 }
 
-// Assign the given ray a color in the world.
-// If the ray hits nothing, it's in blue-scale background color.
-color ray_color(const ray& r, const hittable& world, int depth) {
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0) return color(0, 0, 0);
-    hit_record rec;
-    if (world.hit(r, 0.001, infinity, rec)) {
-        ray scattered;
-        color attenuation;
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth - 1);
-        return color(0, 0, 0);
-    }
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5 * (unit_direction.y() + 1.0);  // map y to [0, 1]
-    // blend blue and white linearly in background
-    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+// Adds rays through pixel (i, j) to result until it has `target` samples,
+// fewer if adaptive sampling finds it converged first. The AOVs of the
+// samples go to aovs if given. The kernel is compiled like
+// ray_color_kernel.
+template <typename World, unsigned Kinds, bool Lights, bool AOVs>
+void render_pixel(int j, int i, const World& world,
+                  const light_list& lights, const camera& cam, int w, int h,
+                  const render_options& opts, int target,
+                  pixel_estimator& estimator,
+                  framebuffer& result, aov_buffer* aovs) {
+    color_sum pixel_color = result.sum(i, j);  // accumulator
+    pixel_sampler sampler(opts.sampler, i, j, w, opts.seed);
+    // a pixel continues the sample sequence where the last pass stopped
+    int s = result.samples(i, j);
+    while (s < target && !opts.adaptive.converged(estimator)) {
+        sampler.start_sample(s++);
+        RT_STAT(paths, 1);
+        // randomly pick surronding color to antialiasing
+        double du, dv, lens_u, lens_v;
+        sampler.next_2d(du, dv);
+        sampler.next_2d(lens_u, lens_v);
+        // the time is only drawn with the shutter open, still images keep
+        // their samples
+        double time_u = 0, unused;
+        if (cam.has_shutter()) sampler.next_2d(time_u, unused);
+        auto u = (i + du) / (w - 1);
+        auto v = (j + dv) / (h - 1);
+        ray r = cam.get_ray(u, v, lens_u, lens_v, time_u);
+        aov_sample first;
+        auto sample = ray_color_kernel<World, Kinds, Lights, AOVs>(
+            r, world, lights, opts.path, aovs ? &first : nullptr);
+        pixel_color += color_sum(sample);
+        if (opts.adaptive.enabled()) estimator.add(sample);
+        if constexpr (AOVs)
+            if (aovs) aovs->add(i, j, first, sample);
+    }
+    result.set(i, j, pixel_color, s);
 }
 
-std::mutex cnt_mutex;
-int rendered_pixels = 0;
+// Renders the pixels of a tile one ray at a time, see render_pixel. There
+// are no estimators without adaptive sampling.
+template <typename World, unsigned Kinds, bool Lights, bool AOVs>
+void render_tile(const tile& t, const hittable& world,
+                 const light_list& lights, const camera& cam, int w, int h,
+                 const render_options& opts, int target,
+                 std::vector<pixel_estimator>& estimators,
+                 framebuffer& result, aov_buffer* aovs) {
+    const auto& scene = static_cast<const World&>(world);
+    pixel_estimator unused;
+    for (int j = t.y0; j < t.y1; j++) {
+        for (int i = t.x0; i < t.x1; i++) {
+            auto& estimator =
+                estimators.empty() ? unused : estimators[j * w + i];
+            render_pixel<World, Kinds, Lights, AOVs>(
+                j, i, scene, lights, cam, w, h, opts, target, estimator,
+                result, aovs);
+        }
+    }
+}
 
-void render_pixel(int j, int i, const hittable_list& world, const camera& cam,
-                  int w, int h, int samples_per_pixel, int max_depth,
-                  std::vector<color>& result) {
-    color pixel_color(0, 0, 0);  // accumulator
-    for (int s = 0; s < samples_per_pixel; s++) {
-        // randomly pick surronding color to antialiasing
-        auto u = (i + random_double()) / (w - 1);
-        auto v = (j + random_double()) / (h - 1);
-        ray r = cam.get_ray(u, v);
-        pixel_color += ray_color(r, world, max_depth);
-    }
-    cnt_mutex.lock();
-    rendered_pixels++;
-    std::cerr << "\r" << w * h - rendered_pixels << ' ' << std::flush;
-    cnt_mutex.unlock();
-    result[j * w + i] = pixel_color;
+// A render_tile compiled for one kind of scene
+using tile_kernel = void (*)(const tile&, const hittable&, const light_list&,
+                             const camera&, int, int, const render_options&,
+                             int, std::vector<pixel_estimator>&, framebuffer&,
+                             aov_buffer*);
+
+template <typename World, unsigned Kinds, bool Lights>
+tile_kernel tile_kernel_for(bool aovs) {
+    return aovs ? render_tile<World, Kinds, Lights, true>
+                : render_tile<World, Kinds, Lights, false>;
+}
+
+// Picks the tile kernel for the world and names it. A baked scene of the
+// random scene's materials gets a kernel that calls the baked scene
+// directly and inlines the materials, without the light sampling code if
+// no lights are sampled, and with it if the scene has lights. Any other
+// world, or any world if generic, gets the kernel that calls the objects
+// and materials through their vtables.
+tile_kernel select_tile_kernel(const hittable& world,
+                               const light_list& lights, bool aovs,
+                               bool generic, const char** name = nullptr) {
+    const auto* baked = dynamic_cast<const baked_scene*>(&world);
+    unsigned kinds = baked ? baked->material_kinds() : all_material_kinds;
+    const unsigned with_light =
+        weekend_material_kinds | kind_bit(material_kind::light);
+    const char* chosen = "generic";
+    tile_kernel kernel;
+    if (generic || !baked || (kinds & ~with_light) != 0) {
+        kernel = tile_kernel_for<hittable, all_material_kinds, true>(aovs);
+    } else if ((kinds & ~weekend_material_kinds) == 0 && lights.empty()) {
+        chosen = "baked spheres";
+        kernel = tile_kernel_for<baked_scene, weekend_material_kinds,
+                                 false>(aovs);
+    } else {
+        chosen = "baked spheres with lights";
+        kernel = tile_kernel_for<baked_scene, with_light, true>(aovs);
+    }
+    if (name) *name = chosen;
+    return kernel;
 }
 
-void concurrent_render(const int thread_cnt, const hittable_list& world,
-                       const camera& cam, int image_width, int image_height,
-                       int samples_per_pixel, int max_depth) {
-    ThreadPool thread_pool(thread_cnt);
-    std::vector<color> result(image_width * image_height);
-    std::cerr << ">> Rendering" << std::endl;
-    for (int j = image_height - 1; j >= 0; j--) {
-        for (int i = 0; i < image_width; i++) {
-            thread_pool.enqueue([j, i, &world, cam, image_width, image_height,
-                                 samples_per_pixel, max_depth, &result]() {
-                render_pixel(j, i, world, cam, image_width, image_height,
-                             samples_per_pixel, max_depth, result);
-            });
+// Renders the pixels of a tile like render_tile, but traces the primary
+// rays of neighbouring pixels together in packets. Pixels that reached
+// the target or converged leave the packet.
+void render_tile_packets(const tile& t, const sphere_packet_bvh& packets,
+                         simd_level level, const hittable& world,
+                         const light_list& lights, const camera& cam, int w,
+                         int h,
+                         const render_options& opts, int target,
+                         std::vector<pixel_estimator>& estimators,
+                         framebuffer& result, aov_buffer* aovs) {
+    const int width = packet_width(level);
+    ray rays[max_packet_size];
+    pcg32 generators[max_packet_size];  // the random stream of every lane
+    int lane_pixel[max_packet_size];    // pixel of the group in every lane
+    ray_packet p;
+    for (int j = t.y0; j < t.y1; j++) {
+        for (int i0 = t.x0; i0 < t.x1; i0 += width) {
+            int group = std::min(width, t.x1 - i0);
+            color_sum sums[max_packet_size];
+            int counts[max_packet_size];
+            pixel_sampler samplers[max_packet_size];
+            pixel_estimator unused[max_packet_size];
+            pixel_estimator* estimator[max_packet_size];
+            for (int k = 0; k < group; k++) {
+                int i = i0 + k;
+                sums[k] = result.sum(i, j);
+                counts[k] = result.samples(i, j);
+                samplers[k] = pixel_sampler(opts.sampler, i, j, w, opts.seed);
+                estimator[k] = estimators.empty() ? &unused[k]
+                                                  : &estimators[j * w + i];
+            }
+            for (;;) {
+                p.size = 0;
+                for (int k = 0; k < group; k++) {
+                    if (counts[k] >= target ||
+                        opts.adaptive.converged(*estimator[k]))
+                        continue;
+                    samplers[k].start_sample(counts[k]++);
+                    RT_STAT(paths, 1);
+                    double du, dv, lens_u, lens_v;
+                    samplers[k].next_2d(du, dv);
+                    samplers[k].next_2d(lens_u, lens_v);
+                    double time_u = 0, unused;
+                    if (cam.has_shutter())
+                        samplers[k].next_2d(time_u, unused);
+                    auto u = (i0 + k + du) / (w - 1);
+                    auto v = (j + dv) / (h - 1);
+                    int lane = p.size++;
+                    lane_pixel[lane] = k;
+                    rays[lane] = cam.get_ray(u, v, lens_u, lens_v, time_u);
+                    p.set(lane, rays[lane], 0.001);
+                    generators[lane] = thread_rng();
+                }
+                if (p.size == 0) break;
+                packets.intersect(p, level);
+                for (int lane = 0; lane < p.size; lane++) {
+                    RT_TIMER(timer_integrate);
+                    RT_STAT(rays, 1);
+                    thread_rng() = generators[lane];
+                    const ray& r = rays[lane];
+                    color sample;
+                    hit_record rec;
+                    aov_sample first;
+                    if (p.hit[lane] < 0) {
+                        RT_STAT(escaped, 1);
+                        sample = background(r, lights);
+                        if (aovs) first = first_hit_aovs(r, nullptr, lights);
+                    } else if (packets.refine(static_cast<int>(p.hit[lane]),
+                                              r, 0.001, infinity, rec)) {
+                        if (aovs) first = first_hit_aovs(r, &rec, lights);
+                        sample = hit_color(r, rec, world, lights, opts.path,
+                                           aovs ? &first : nullptr);
+                    } else {  // grazing ray rejected by the refinement
+                        sample = ray_color(r, world, lights, opts.path,
+                                           aovs ? &first : nullptr);
+                    }
+                    int k = lane_pixel[lane];
+                    sums[k] += color_sum(sample);
+                    if (opts.adaptive.enabled()) estimator[k]->add(sample);
+                    if (aovs) aovs->add(i0 + k, j, first, sample);
+                }
+            }
+            for (int k = 0; k < group; k++)
+                result.set(i0 + k, j, sums[k], counts[k]);
         }
     }
-    thread_pool.wait_until_nothing_in_flight();
-    std::cerr << "\r";
+}
+
+// Renders tiles of a frame with the engine of the options: one wavefront
+// engine per thread, which keeps its buffers between tiles, or the
+// megakernel, one ray at a time or with primary rays in packets
+struct tile_renderer {
+    tile_renderer(const render_options& opts, const hittable& world,
+                  const light_list& lights, const sphere_packet_bvh& packets,
+                  const camera& cam, int w, int h, int threads,
+                  bool with_aovs)
+        : opts(opts),
+          world(world),
+          lights(lights),
+          packets(packets),
+          cam(cam),
+          w(w),
+          h(h),
+          level(opts.packets && !packets.empty() ? opts.simd
+                                                 : simd_level::scalar),
+          kernel(select_tile_kernel(world, lights, with_aovs,
+                                    opts.generic_kernel)) {
+        if (opts.engine != render_engine::wavefront) return;
+        engines.assign(threads,
+                       wavefront_engine(world, lights, cam, w, h,
+                                        opts.sampler, opts.seed, opts.path,
+                                        opts.adaptive));
+        for (auto& engine : engines) {
+            engine.reserve(opts.tile_size * opts.tile_size, with_aovs);
+            if (level != simd_level::scalar)
+                engine.use_packets(packets, level);
+        }
+    }
+
+    // Renders tile t on thread thread_id up to target samples per pixel
+    void render(const tile& t, int thread_id, int target,
+                std::vector<pixel_estimator>& estimators, framebuffer& result,
+                aov_buffer* aovs) {
+        if (opts.engine == render_engine::wavefront)
+            engines[thread_id].render_tile(t, target, estimators, result,
+                                           aovs);
+        else if (level != simd_level::scalar)
+            render_tile_packets(t, packets, level, world, lights, cam, w, h,
+                                opts, target, estimators, result, aovs);
+        else
+            kernel(t, world, lights, cam, w, h, opts, target, estimators,
+                   result, aovs);
+    }
+
+    const render_options& opts;
+    const hittable& world;
+    const light_list& lights;
+    const sphere_packet_bvh& packets;
+    const camera& cam;
+    int w, h;
+    simd_level level;  // of the packets, scalar without them
+    tile_kernel kernel;  // of the megakernel without packets
+    std::vector<wavefront_engine> engines;
+};
+
+// Prints the error of image against the reference of opts if there is
+// one, returns false if it cannot be read
+bool report_error(const render_options& opts, const framebuffer& image) {
+    if (opts.reference.empty()) return true;
+    image_error error;
+    if (!compare_to_reference(opts.reference, image, error)) return false;
+    std::cerr << ">> Error against " << opts.reference << ": RMSE "
+              << error.rmse << ", max " << error.max_error
+              << ", relative RMSE " << error.relative_rmse << std::endl;
+    return true;
+}
+
+// Renders the frame tile by tile, writing the tiles to output as they are
+// done. Progressive renders take passes of opts.pass_samples spp over the
+// whole frame and can stop after any of them on the time budget or a
+// signal, saving the samples to the checkpoint, which is tied to the
+// fingerprints of the scene file and the view. The finished image is moved
+// to image, denoised and not yet written with --denoise. Returns false if
+// an output failed.
+bool concurrent_render(const render_options& opts, const hittable& world,
+                       const light_list& lights,
+                       const sphere_packet_bvh& packets, const camera& cam,
+                       uint64_t scene_fingerprint, uint64_t view_fingerprint,
+                       int image_width, int image_height,
+                       tile_scheduler& scheduler, image_output& output,
+                       framebuffer& image) {
+    framebuffer result(image_width, image_height);
+    std::vector<pixel_estimator> estimators;
+    if (opts.adaptive.enabled())
+        estimators.resize(static_cast<size_t>(image_width) * image_height);
+    // first-hit AOVs, kept for the denoiser or to be written out
+    const bool keep_aovs = opts.denoise || !opts.aov.empty();
+    aov_buffer aov_storage;
+    if (keep_aovs) aov_storage = aov_buffer(image_width, image_height);
+    aov_buffer* aovs = keep_aovs ? &aov_storage : nullptr;
+    auto tiles =
+        make_tiles(image_width, image_height, opts.tile_size, opts.order);
+    std::cerr << ">> Rendering " << tiles.size() << " tiles on "
+              << scheduler.threads() << " threads" << std::endl;
+    tile_renderer renderer(opts, world, lights, packets, cam, image_width,
+                           image_height, scheduler.threads(),
+                           aovs != nullptr);
+    if (opts.packets && packets.empty())
+        std::cerr << ">> Packets need a scene made only of spheres, at "
+                     "most 2^24 of them, tracing rays one by one"
+                  << std::endl;
+    if (sizeof(real) == sizeof(float))
+        std::cerr << ">> Rendering in single precision" << std::endl;
+    if (opts.engine == render_engine::wavefront)
+        std::cerr << ">> Rendering with the wavefront engine" << std::endl;
+    if (renderer.level != simd_level::scalar)
+        std::cerr << ">> Tracing primary rays in "
+                  << simd_level_name(renderer.level) << " packets"
+                  << std::endl;
+
+    auto header = make_checkpoint_header(image_width, image_height,
+                                         opts.seed, opts.sampler, opts.path,
+                                         opts.light_sampling,
+                                         opts.adaptive.enabled(),
+                                         scene_fingerprint, view_fingerprint);
+    if (!opts.checkpoint.empty()) {
+        if (file_exists(opts.checkpoint)) {
+            if (!load_checkpoint(opts.checkpoint, header, result, estimators))
+                return false;
+            // the tiles of this run only cover the pixels it samples
+            output.write_tile(tile{0, 0, image_width, image_height}, result);
+            std::cerr << ">> Resuming " << opts.checkpoint << " at "
+                      << result.average_samples() << " spp" << std::endl;
+        }
+        install_stop_handlers();
+    }
+
+    // statistics of every thread, and the clock of their timers
+    std::vector<render_stats> stats(scheduler.threads());
+    stats_clock clock;
+
+    const int spp = opts.samples_per_pixel;
+    const int pass = opts.pass_samples > 0 ? std::min(opts.pass_samples, spp)
+                                           : spp;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() -
+                                          start;
+        return d.count();
+    };
+    auto out_of_time = [&]() {
+        return stop_requested() ||
+               (opts.time_budget > 0 && elapsed() >= opts.time_budget);
+    };
+    // every pass brings the pixels to the next multiple of pass samples,
+    // so a resumed render first completes the pass it was stopped in
+    int target = std::min(spp, (result.min_samples() / pass + 1) * pass);
+    for (;; target = std::min(spp, target + pass)) {
+        long taken = result.total_samples();
+        scheduler.run(tiles, [&](const tile& t, int thread_id) {
+            if (out_of_time()) return;  // the tile keeps its samples
+            RT_TILE_STATS(stats[thread_id], tile, t);
+            renderer.render(t, thread_id, target, estimators, result, aovs);
+            RT_TILE_STATS(stats[thread_id], write, t);
+            RT_TIMER(timer_output);
+            output.write_tile(t, result);
+        });
+        bool stopped = out_of_time();
+        if (pass < spp)
+            std::cerr << "\r>> Pass to " << target << " spp done after "
+                      << elapsed() << " s" << std::endl;
+        if (!opts.checkpoint.empty() &&
+            !save_checkpoint(opts.checkpoint, header, result, estimators))
+            return false;
+        if (!opts.preview.empty() && !write_preview(opts.preview, result))
+            return false;
+        // without new samples every pixel converged
+        if (stopped || target == spp || result.total_samples() == taken)
+            break;
+    }
+    if (out_of_time())
+        std::cerr << ">> Stopped at " << result.average_samples() << " spp"
+                  << (opts.checkpoint.empty()
+                          ? ""
+                          : ", run again to resume from the checkpoint")
+                  << std::endl;
+
+    clock.stop();
+    if (opts.stats) {
+        std::vector<std::string> kind_names;
+        for (int k = 0; k < material_kind_count; k++)
+            kind_names.push_back(
+                material_kind_name(static_cast<material_kind>(k)));
+        print_stats_summary(stats, kind_names, clock, elapsed());
+    }
+    if (!opts.trace.empty() && !write_chrome_trace(opts.trace, stats, clock))
+        return false;
+
+    if (opts.adaptive.enabled()) {
+        auto fixed = static_cast<double>(opts.samples_per_pixel) *
+                     image_width * image_height;
+        auto taken = result.total_samples();
+        std::cerr << ">> Adaptive sampling took " << taken << " samples, "
+                  << taken / (static_cast<double>(image_width) * image_height)
+                  << " per pixel, " << fixed / taken << "x fewer than "
+                  << opts.samples_per_pixel << " spp" << std::endl;
+    }
+    if (!opts.sample_map.empty() &&
+        !write_sample_map(opts.sample_map, result, opts.samples_per_pixel))
+        return false;
+    if (!opts.aov.empty() && !aovs->write(opts.aov)) return false;
+    // the image written out, and compared with the reference
+    if (opts.denoise) {
+        auto denoise_start = std::chrono::steady_clock::now();
+        image = denoise(result, *aovs, scheduler);
+        std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - denoise_start;
+        std::cerr << ">> Denoised in " << d.count() << " ms" << std::endl;
+    } else {
+        image = std::move(result);
+    }
+    return report_error(opts, image);
+}
+
+// Renders the frame on the workers of coordinator instead of this
+// process's threads, in units of opts.pass_samples spp per tile, all of
+// the frame in one if not given. Tiles are written to output as the
+// samples of their units arrive. A stopped render keeps the units done.
+// Returns false if an output failed.
+bool distributed_render(const render_options& opts,
+                        render_coordinator& coordinator, int frame,
+                        int image_width, int image_height,
+                        image_output& output, framebuffer& image) {
+    framebuffer result(image_width, image_height);
+    auto tiles =
+        make_tiles(image_width, image_height, opts.tile_size, opts.order);
+    const int spp = opts.samples_per_pixel;
+    const int pass = opts.pass_samples > 0 ? std::min(opts.pass_samples, spp)
+                                           : spp;
+    auto units = make_work_units(tiles, spp, pass);
+    std::cerr << ">> Rendering " << units.size() << " units of "
+              << tiles.size() << " tiles on the workers" << std::endl;
+    job_message job{0,
+                    image_width,
+                    image_height,
+                    frame,
+                    opts.seed,
+                    static_cast<int32_t>(opts.sampler),
+                    opts.path.max_depth,
+                    opts.path.roulette_depth,
+                    opts.light_sampling};
+    auto start = std::chrono::steady_clock::now();
+    bool done = coordinator.render(job, units, result, [&](const tile& t) {
+        RT_TIMER(timer_output);
+        output.write_tile(t, result);
+    });
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() -
+                                      start;
+    if (done)
+        std::cerr << ">> Rendered in " << d.count() << " s" << std::endl;
+    else
+        std::cerr << ">> Stopped at " << result.average_samples() << " spp"
+                  << std::endl;
+    if (!opts.sample_map.empty() &&
+        !write_sample_map(opts.sample_map, result, opts.samples_per_pixel))
+        return false;
+    image = std::move(result);
+    return report_error(opts, image);
+}
+
+// Renders a frame of the scene, whose file has the given fingerprint, to
+// the output of opts, on the workers of coordinator if given, and hands it
+// to writer to be finished while the next frame renders. Returns false on
+// an error.
+bool render_frame(const render_options& opts, const scene_description& scene,
+                  uint64_t fingerprint, int frame, const hittable& world,
+                  const light_list& lights,
+                  const sphere_packet_bvh& packets, int image_width,
+                  int image_height, tile_scheduler& scheduler,
+                  render_coordinator* coordinator, frame_writer& writer) {
+    auto output = make_output(opts.output, opts.format);
+    if (!output->begin(image_width, image_height)) return false;
+    auto cam = scene.frame_camera(
+        frame, static_cast<double>(image_width) / image_height);
+    framebuffer image;
+    if (coordinator ? !distributed_render(opts, *coordinator, frame,
+                                          image_width, image_height, *output,
+                                          image)
+                    : !concurrent_render(
+                          opts, world, lights, packets, cam, fingerprint,
+                          fingerprint_frame_view(scene, frame), image_width,
+                          image_height, scheduler, *output, image))
+        return false;
     std::cerr << ">> Writting to file" << std::endl;
-    for (int j = image_height - 1; j >= 0; j--) {
-        for (int i = 0; i < image_width; i++) {
-            write_color(std::cout, result[j * image_width + i],
-                        samples_per_pixel);
+    return writer.submit(std::move(output), std::move(image), !opts.denoise);
+}
+
+// Renders the units the coordinator at opts.worker hands out, job after
+// job, until it has no more. The image settings come with every job, the
+// engine and the threads are this process's. Returns false if the
+// coordinator cannot be reached or is lost.
+bool serve_coordinator(const render_options& opts,
+                       const scene_description& scene, const hittable& world,
+                       light_list& lights, const sphere_packet_bvh& packets,
+                       uint64_t fingerprint, tile_scheduler& scheduler) {
+    render_worker worker;
+    if (!worker.connect(opts.worker, fingerprint)) return false;
+    std::cerr << ">> Rendering for " << opts.worker << " on "
+              << scheduler.threads() << " threads" << std::endl;
+    job_message job;
+    while (worker.next_job(job)) {
+        auto job_opts = opts;
+        job_opts.adaptive = adaptive_settings();
+        job_opts.seed = job.seed;
+        job_opts.sampler = static_cast<sampler_type>(job.sampler);
+        job_opts.path.max_depth = job.max_depth;
+        job_opts.path.roulette_depth = job.roulette_depth;
+        lights.finish(job.light_sampling);
+        auto cam = scene.frame_camera(
+            job.frame, static_cast<double>(job.width) / job.height);
+        tile_renderer renderer(job_opts, world, lights, packets, cam,
+                               job.width, job.height, scheduler.threads(),
+                               false);
+        framebuffer frame(job.width, job.height);
+        std::vector<pixel_estimator> no_estimators;
+        std::vector<work_unit> units;
+        std::vector<tile> tiles;
+        long rendered = 0;
+        auto start = std::chrono::steady_clock::now();
+        // a unit per thread, every unit's samples summed from zero. Units
+        // of the same tile share its pixels, so they take turns: a round
+        // renders at most one unit of every tile.
+        bool sent = true;
+        while (sent && worker.next_units(scheduler.threads(), units)) {
+            rendered += units.size();
+            while (sent && !units.empty()) {
+                std::vector<work_unit> round, later;
+                tiles.clear();
+                for (const auto& unit : units) {
+                    tile t = unit.area();
+                    bool taken = std::any_of(
+                        tiles.begin(), tiles.end(), [&](const tile& o) {
+                            return o.x0 == t.x0 && o.y0 == t.y0;
+                        });
+                    (taken ? later : round).push_back(unit);
+                    if (taken) continue;
+                    for (int j = t.y0; j < t.y1; j++)
+                        for (int i = t.x0; i < t.x1; i++)
+                            frame.set(i, j, color_sum(0, 0, 0),
+                                      unit.sample_begin);
+                    tiles.push_back(t);
+                }
+                scheduler.run(tiles, [&](const tile& t, int thread_id) {
+                    const auto& unit = round[&t - tiles.data()];
+                    renderer.render(t, thread_id, unit.sample_end,
+                                    no_estimators, frame, nullptr);
+                }, false);
+                for (const auto& unit : round)
+                    if (!(sent = worker.send_result(unit, frame))) break;
+                units.swap(later);
+            }
         }
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() -
+                                          start;
+        std::cerr << ">> Frame " << job.frame << ": rendered " << rendered
+                  << (rendered == 1 ? " unit" : " units") << " in "
+                  << d.count() << " s" << std::endl;
+    }
+    if (worker.lost()) {
+        std::cerr << "Lost the coordinator at " << opts.worker << "\n";
+        return false;
     }
+    return true;
 }
 
-int main() {
-    const auto aspect_ratio = 16.0 / 9.0;
-    const int image_width = 3840;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 500;
-    const int max_depth = 50;
+// Renders the views of the edits read from opts.interactive until quit, a
+// signal, or the end of stdin once its last view is done. An edit gives up
+// on the view before it: the tiles in flight finish, the others are
+// skipped. Then it renders one sample per pixel at a fraction of the size,
+// chosen from the time the passes before took so it renders within
+// preview_ms, and refines the full image in passes of growing samples.
+// Every pass is sent to the output as a frame, and the latency of the
+// edits is reported. Returns false if the edits cannot be read or a frame
+// cannot be sent.
+bool interactive_render(const render_options& opts,
+                        const scene_description& scene,
+                        const hittable& world, const light_list& lights,
+                        const sphere_packet_bvh& packets, int w, int h,
+                        tile_scheduler& scheduler) {
+    const double preview_ms = 50;  // the rest of 100 ms sends the frame
+    edit_channel edits({scene.view_at(0), opts.samples_per_pixel});
+    if (!edits.open(opts.interactive)) return false;
+    install_stop_handlers();
+    const int threads = scheduler.threads();
+    const double aspect_ratio = static_cast<double>(w) / h;
+    auto full_tiles = make_tiles(w, h, opts.tile_size, opts.order);
+    std::vector<pixel_estimator> no_estimators;
+    double ns_per_path = 2000;  // a guess until a pass is timed
+    edit_latency latency;
+    bool finished = false;  // whether the view of `rendered` is done
+    uint64_t rendered = 0;
+    while (!edits.quitting() && !stop_requested()) {
+        uint64_t generation;
+        edit_clock::time_point arrived;
+        auto view = edits.current(generation, arrived);
+        if (finished && generation == rendered) {
+            if (edits.ended()) break;
+            edits.wait(generation, 0.1);
+            continue;
+        }
+        rendered = generation;
+        finished = false;
+        auto changed = [&]() {
+            return edits.generation() != generation || edits.quitting() ||
+                   stop_requested();
+        };
+        auto since = [&]() {
+            std::chrono::duration<double, std::milli> d =
+                edit_clock::now() - arrived;
+            return d.count();
+        };
+        auto cam = view.camera.make(aspect_ratio);
+        cam.open_shutter(scene.shutter_open, scene.shutter_close, cam);
+
+        // renders a pass over tiles to target spp, returns false if the
+        // view changed before it was done
+        std::atomic<bool> first_tile{false};
+        auto cancelled = [&]() {
+            std::cerr << ">> Edit " << generation << ": cancelled after "
+                      << since() << " ms" << std::endl;
+        };
+        double first_pixel_ms = 0;
+        auto pass = [&](tile_renderer& renderer,
+                        const std::vector<tile>& tiles, int target,
+                        framebuffer& result, long paths) {
+            auto start = edit_clock::now();
+            scheduler.run(
+                tiles,
+                [&](const tile& t, int thread_id) {
+                    if (changed()) return;
+                    renderer.render(t, thread_id, target, no_estimators,
+                                    result, nullptr);
+                    if (!first_tile.exchange(true)) first_pixel_ms = since();
+                },
+                false);
+            if (changed()) return false;
+            std::chrono::duration<double, std::nano> d =
+                edit_clock::now() - start;
+            ns_per_path = d.count() * threads / paths;
+            return true;
+        };
 
-    // P3: colors in ASCII, width * height, 255 for max color
-    std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
+        // the latency of the edit, once its first frame is sent
+        bool sent = false;
+        auto first_frame = [&]() {
+            if (sent) return;
+            sent = true;
+            std::cerr << ">> Edit " << generation << ": first pixel after "
+                      << first_pixel_ms << " ms, first frame after "
+                      << since() << " ms" << std::endl;
+            if (generation == 0) return;  // the scene's view is no edit
+            latency.first_pixel_ms.push_back(first_pixel_ms);
+            latency.first_frame_ms.push_back(since());
+        };
+
+        int scale = preview_scale(w, h, threads, ns_per_path, preview_ms);
+        if (scale > 1) {
+            int low_w = w / scale, low_h = h / scale;
+            framebuffer low(low_w, low_h);
+            tile_renderer renderer(opts, world, lights, packets, cam, low_w,
+                                   low_h, threads, false);
+            if (!pass(renderer,
+                      make_tiles(low_w, low_h, opts.tile_size, opts.order), 1,
+                      low, static_cast<long>(low_w) * low_h)) {
+                cancelled();
+                continue;
+            }
+            if (!send_frame(opts.output, opts.format, upscale(low, w, h)))
+                return false;
+            first_frame();
+        }
+        // passes double the samples up to opts.pass_samples more per pass,
+        // which bounds the time a tile in flight holds up the next edit
+        const int spp = view.samples_per_pixel;
+        const int most = opts.pass_samples > 0 ? opts.pass_samples : 16;
+        framebuffer result(w, h);
+        tile_renderer renderer(opts, world, lights, packets, cam, w, h,
+                               threads, false);
+        for (int taken = 0, target = 1;; taken = target,
+                 target = std::min(spp, target + std::min(target, most))) {
+            if (!pass(renderer, full_tiles, target, result,
+                      static_cast<long>(w) * h * (target - taken))) {
+                cancelled();
+                break;
+            }
+            if (!send_frame(opts.output, opts.format, result)) return false;
+            first_frame();
+            std::cerr << ">> Edit " << generation << ": " << target
+                      << " spp after " << since() << " ms" << std::endl;
+            if (target == spp) {
+                finished = true;
+                break;
+            }
+        }
+    }
+    edits.close();
+    latency.print();
+    return true;
+}
+
+// Loads the scene of the options into scene and its traced world: from
+// the scene cache if it is up to date, else from the scene file or the
+// built-in scene, baked when possible and cached if asked. Returns false
+// on an error.
+bool load_world(const render_options& opts, scene_description& scene,
+                baked_scene& baked, shared_ptr<bvh_node>& objects) {
+    auto start = std::chrono::steady_clock::now();
+    auto ms = [&]() {
+        std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start;
+        return d.count();
+    };
+    // the cache holds no objects, only their baked copy
+    bool use_cache = !opts.scene_cache.empty() && opts.bake &&
+                     !opts.packets && opts.save_scene.empty();
+    scene_stamp stamp;
+    if (use_cache && !stamp_scene_file(opts.scene, stamp)) return false;
+    if (use_cache && load_scene_cache(opts.scene_cache, stamp, scene, baked)) {
+        std::cerr << ">> Scene mapped from " << opts.scene_cache << " in "
+                  << ms() << " ms: " << baked.sphere_count() << " spheres, "
+                  << baked.material_count() << " materials" << std::endl;
+        return true;
+    }
+
+    if (opts.scene.empty())
+        scene = random_scene_description();
+    else if (!load_scene(opts.scene, scene))
+        return false;
+    else
+        std::cerr << ">> Scene read in " << ms() << " ms" << std::endl;
+    if (!opts.save_scene.empty() && !save_scene(opts.save_scene, scene))
+        return false;
+
+    start = std::chrono::steady_clock::now();
+    // only spheres can be baked, other scenes keep their objects
+    if (!opts.bake || !baked.build(scene.world)) {
+        objects = make_shared<bvh_node>(scene.world);
+        std::cerr << ">> BVH built in " << ms() << " ms" << std::endl;
+        if (use_cache)
+            std::cerr << ">> Scene not cached, only spheres are baked"
+                      << std::endl;
+        return true;
+    }
+    std::cerr << ">> Scene baked in " << ms() << " ms: "
+              << baked.sphere_count() << " spheres, "
+              << baked.material_count() << " materials" << std::endl;
+    if (use_cache) {
+        if (!save_scene_cache(opts.scene_cache, scene, baked, stamp))
+            return false;
+        std::cerr << ">> Scene cached in " << opts.scene_cache << std::endl;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    render_options opts;
+    if (!parse_options(argc, argv, opts)) return 1;
 
     // World
-    auto world = random_scene();
-
-    // Camera
-    point3 lookfrom(13, 2, 3);
-    point3 lookat(0, 0, 0);
-    vec3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
-    auto aperture = 0.1;
-    camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture,
-               dist_to_focus);
-    const int thread_cnt = 4;
-    concurrent_render(thread_cnt, world, cam, image_width, image_height,
-                      samples_per_pixel, max_depth);
+    scene_description scene;
+    baked_scene baked;
+    shared_ptr<bvh_node> objects;
+    if (!load_world(opts, scene, baked, objects)) return 1;
+    const hittable* world = objects ? objects.get()
+                                    : static_cast<const hittable*>(&baked);
+    sphere_packet_bvh packets;
+    if (opts.packets) packets.build(scene.world);
+    // the spheres of a cached scene are only in the baked copy
+    light_list lights;
+    if (objects)
+        lights.add_spheres(scene.world);
+    else
+        lights.add_spheres(baked);
+    lights.set_environment(scene.environment);
+    lights.finish(opts.light_sampling);
+    if (!lights.empty())
+        std::cerr << ">> Sampling " << lights.size()
+                  << (lights.size() == 1 ? " light" : " lights") << std::endl;
+    if (opts.engine == render_engine::megakernel && !opts.packets &&
+        opts.coordinator.empty()) {
+        const char* kernel;
+        select_tile_kernel(*world, lights, false, opts.generic_kernel,
+                           &kernel);
+        std::cerr << ">> Rendering with the " << kernel << " kernel"
+                  << std::endl;
+    }
+
+    // workers and their coordinator check they loaded the same scene, and
+    // checkpoints that they are resumed with it
+    uint64_t fingerprint = 0;
+    if ((!opts.worker.empty() || !opts.coordinator.empty() ||
+         !opts.checkpoint.empty()) &&
+        !fingerprint_scene_file(opts.scene, fingerprint))
+        return 1;
+    tile_scheduler scheduler(opts.threads);
+    if (!opts.worker.empty())
+        return serve_coordinator(opts, scene, *world, lights, packets,
+                                 fingerprint, scheduler)
+                   ? 0
+                   : 1;
+
+    // the options override the image of the scene
+    const int image_width = opts.width > 0 ? opts.width : scene.width;
+    const int image_height =
+        opts.height > 0
+            ? opts.height
+            : std::max(2, static_cast<int>(static_cast<double>(image_width) *
+                                           scene.height / scene.width));
+    if (opts.samples_per_pixel == 0)
+        opts.samples_per_pixel = scene.samples_per_pixel;
+    if (!opts.interactive.empty())
+        return interactive_render(opts, scene, *world, lights, packets,
+                                  image_width, image_height, scheduler)
+                   ? 0
+                   : 1;
+
+    // the frames of an animation, none for a still image
+    auto frames = opts.frames;
+    if (frames.empty() && !scene.keys.empty())
+        for (int f = scene.keys.front().frame; f <= scene.keys.back().frame;
+             f++)
+            frames.push_back(f);
+    if (!frames.empty() && opts.output == "-") {
+        std::cerr << "Frames need an output file, e.g. -o frame_####.ppm\n";
+        return 1;
+    }
+
+    // the threads, the scene and its BVH, or the workers, are shared by
+    // all frames
+    render_coordinator coordinator;
+    render_coordinator* remote = nullptr;
+    if (!opts.coordinator.empty()) {
+        if (!coordinator.listen(opts.coordinator, fingerprint)) return 1;
+        install_stop_handlers();
+        remote = &coordinator;
+    }
+    frame_writer writer;
+    if (frames.empty()) {
+        if (!render_frame(opts, scene, fingerprint, 0, *world, lights,
+                          packets, image_width, image_height, scheduler,
+                          remote, writer) ||
+            !writer.finish())
+            return 1;
+        std::cerr << "\rDone.\n";
+        return 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t rendered = 0;
+    for (; rendered < frames.size() && !stop_requested(); rendered++) {
+        int frame = frames[rendered];
+        std::cerr << ">> Frame " << frame << " (" << rendered + 1 << " of "
+                  << frames.size() << ")" << std::endl;
+        // every frame has files of its own
+        auto frame_opts = opts;
+        for (auto path : {&frame_opts.output, &frame_opts.checkpoint,
+                          &frame_opts.preview, &frame_opts.sample_map,
+                          &frame_opts.aov, &frame_opts.trace,
+                          &frame_opts.reference})
+            if (!path->empty()) *path = frame_path(*path, frame);
+        if (!render_frame(frame_opts, scene, fingerprint, frame, *world,
+                          lights, packets, image_width, image_height,
+                          scheduler, remote, writer))
+            return 1;
+    }
+    if (!writer.finish()) return 1;
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    std::cerr << ">> Rendered " << rendered << " frames in " << d.count()
+              << " s, " << d.count() / std::max<size_t>(rendered, 1)
+              << " s per frame" << std::endl;
     std::cerr << "\rDone.\n";
     return 0;
 }
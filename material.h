@@ -1,85 +1,209 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <algorithm>
+
 #include "common.h"
 #include "hittable.h"
+#include "stats.h"
+
+real schlick(real cosine, real ref_idx);
+
+// Lets renderers dispatch to the scatter code of a material without a
+// virtual call, and group hits by material
+enum class material_kind { lambertian, metal, dielectric, light, other };
 
-double schlick(double cosine, double ref_idx);
+const int material_kind_count = 5;
+static_assert(material_kind_count <= stats_material_kinds,
+              "every kind has a scatter counter");
+
+// Sets of material kinds as bit masks, for kernels compiled for the
+// kinds a scene holds
+constexpr unsigned kind_bit(material_kind kind) {
+    return 1u << static_cast<int>(kind);
+}
+const unsigned all_material_kinds = (1u << material_kind_count) - 1;
+// the materials of the random scene
+const unsigned weekend_material_kinds = kind_bit(material_kind::lambertian) |
+                                        kind_bit(material_kind::metal) |
+                                        kind_bit(material_kind::dielectric);
+
+// Name of a material kind, for statistics
+inline const char* material_kind_name(material_kind kind) {
+    switch (kind) {
+        case material_kind::lambertian:
+            return "lambertian";
+        case material_kind::metal:
+            return "metal";
+        case material_kind::dielectric:
+            return "dielectric";
+        case material_kind::light:
+            return "light";
+        default:
+            return "other";
+    }
+}
 
 class material {
    public:
+    explicit material(material_kind kind = material_kind::other)
+        : kind(kind) {}
+
+    const material_kind kind;
+
     virtual bool scatter(const ray& r_in, const hit_record& rec,
                          color& attenuation, ray& scattered) const = 0;
 };
 
 class lambertian : public material {
    public:
-    lambertian(const color& a) : albedo(a) {}
+    color albedo;  // albedo: ratio of light reflection
+
+    lambertian(const color& a)
+        : material(material_kind::lambertian), albedo(a) {}
+    // The normal plus a random unit vector is distributed by the cosine to
+    // the normal, so the BSDF albedo / pi times the cosine over the pdf
+    // cosine / pi leaves the albedo as the attenuation
     virtual bool scatter(const ray& r_in, const hit_record& rec,
                          color& attenuation, ray& scattered) const {
         vec3 scatter_direction = rec.normal + vec3::random_unit_vector();
-        scattered = ray(rec.p, scatter_direction);
+        scattered = ray(rec.p, scatter_direction, r_in.time());
         attenuation = albedo;
         return true;
     }
 
-   private:
-    color albedo;  // albedo: ratio of light reflection
+    // The cosine of unit direction to the normal over pi, both the density
+    // per solid angle with which scatter picks it and what the BSDF times
+    // the cosine is for a white albedo. Zero below the surface.
+    real cosine_over_pi(const hit_record& rec, const vec3& direction) const {
+        return std::max<real>(dot(direction, rec.normal), 0) / pi;
+    }
 };
 
 class metal : public material {
    public:
-    metal(const color& a, double f = 0) : albedo(a), fuzz(f) {}
+    color albedo;
+    real fuzz;
+
+    metal(const color& a, real f = 0)
+        : material(material_kind::metal), albedo(a), fuzz(f) {}
     virtual bool scatter(const ray& r_in, const hit_record& rec,
                          color& attenuation, ray& scattered) const {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         scattered =
-            ray(rec.p, reflected + fuzz * vec3::random_in_unit_sphere());
+            ray(rec.p, reflected + fuzz * vec3::random_in_unit_sphere(),
+                r_in.time());
         attenuation = albedo;
         return dot(scattered.direction(), rec.normal) > 0;
     }
-
-   private:
-    color albedo;
-    double fuzz;
 };
 
 class dielectric : public material {
    public:
-    dielectric(double ri) : ref_idx(ri) {}
+    real ref_idx;
+
+    dielectric(real ri) : material(material_kind::dielectric), ref_idx(ri) {}
     virtual bool scatter(const ray& r_in, const hit_record& rec,
                          color& attenuation, ray& scattered) const {
         attenuation = color(1.0, 1.0, 1.0);
-        double etai_over_etat;
+        real etai_over_etat;
         if (rec.front_face) {
             etai_over_etat = 1.0 / ref_idx;
         } else
             etai_over_etat = ref_idx;
         vec3 unit_direction = unit_vector(r_in.direction());
-        double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+        real cos_theta = std::min<real>(dot(-unit_direction, rec.normal), 1);
+        real sin_theta = sqrt(1 - cos_theta * cos_theta);
         if (etai_over_etat * sin_theta > 1.0) {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, reflected);
+            scattered = ray(rec.p, reflected, r_in.time());
             return true;
         }
         // approximates the fact that reflectivity varies with angle
-        double reflect_prob = schlick(cos_theta, etai_over_etat);
+        real reflect_prob = schlick(cos_theta, etai_over_etat);
         if (random_double() < reflect_prob) {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.p, reflected);
+            scattered = ray(rec.p, reflected, r_in.time());
             return true;
         }
         vec3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
-        scattered = ray(rec.p, refracted);
+        scattered = ray(rec.p, refracted, r_in.time());
         return true;
     }
+};
+
+// Gives off emit from the front of its surfaces, and scatters nothing
+class diffuse_light : public material {
+   public:
+    color emit;
 
-   private:
-    double ref_idx;
+    diffuse_light(const color& c) : material(material_kind::light), emit(c) {}
+    virtual bool scatter(const ray&, const hit_record&, color&,
+                         ray&) const {
+        return false;
+    }
 };
 
-double schlick(double cosine, double ref_idx) {
+// Light given off at rec towards the ray that hit it
+inline color emitted(const material& m, const hit_record& rec) {
+    if (m.kind != material_kind::light || !rec.front_face)
+        return color(0, 0, 0);
+    return static_cast<const diffuse_light&>(m).emit;
+}
+
+// Scatters with the code of the material's kind, called directly instead
+// of through the vtable, so the compiler can inline it. Only the kinds in
+// Kinds are inlined, the others take the virtual call.
+template <unsigned Kinds = all_material_kinds>
+inline bool scatter(const material& m, const ray& r_in, const hit_record& rec,
+                    color& attenuation, ray& scattered) {
+    RT_STAT(scatters[static_cast<int>(m.kind)], 1);
+    RT_TIMER(timer_scatter);
+    switch (m.kind) {
+        case material_kind::lambertian:
+            if constexpr ((Kinds & kind_bit(material_kind::lambertian)) != 0)
+                return static_cast<const lambertian&>(m).lambertian::scatter(
+                    r_in, rec, attenuation, scattered);
+            break;
+        case material_kind::metal:
+            if constexpr ((Kinds & kind_bit(material_kind::metal)) != 0)
+                return static_cast<const metal&>(m).metal::scatter(
+                    r_in, rec, attenuation, scattered);
+            break;
+        case material_kind::dielectric:
+            if constexpr ((Kinds & kind_bit(material_kind::dielectric)) != 0)
+                return static_cast<const dielectric&>(m).dielectric::scatter(
+                    r_in, rec, attenuation, scattered);
+            break;
+        case material_kind::light:
+            return false;
+        default:
+            break;
+    }
+    return m.scatter(r_in, rec, attenuation, scattered);
+}
+
+// Color of the surface for the albedo AOV: the attenuation of the
+// materials that have one, white for glass and unknown kinds
+inline color surface_albedo(const material& m) {
+    switch (m.kind) {
+        case material_kind::lambertian:
+            return static_cast<const lambertian&>(m).albedo;
+        case material_kind::metal:
+            return static_cast<const metal&>(m).albedo;
+        default:
+            return color(1, 1, 1);
+    }
+}
+
+// Whether the material reflects or refracts like a mirror, so its AOVs
+// should be those of what is seen in it
+inline bool is_specular(const material& m) {
+    return m.kind == material_kind::metal ||
+           m.kind == material_kind::dielectric;
+}
+
+real schlick(real cosine, real ref_idx) {
     auto r0 = (1 - ref_idx) / (1 + ref_idx);
     r0 = r0 * r0;
     return r0 + (1 - r0) * pow((1 - cosine), 5);
@@ -0,0 +1,180 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "common.h"
+#include "hittable.h"
+#include "stats.h"
+
+// A ray set up for the watertight ray-triangle test of Woop, Benthin and
+// Wald: the axis the direction is largest along becomes z, and a shear
+// maps the direction onto it. Triangles are then tested in 2D around the
+// origin, with edge functions that agree exactly on shared edges, so no
+// ray slips between two triangles.
+struct watertight_ray {
+    point3 origin;
+    int kx, ky, kz;
+    real sx, sy, sz;
+
+    explicit watertight_ray(const ray& r) : origin(r.origin()) {
+        const vec3& d = r.direction();
+        kz = std::fabs(d.x()) > std::fabs(d.y())
+                 ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                 : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keeps the winding of the triangles
+        if (d[kz] < 0) std::swap(kx, ky);
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+};
+
+// Returns whether r hits the triangle a, b, c between t_min and t_max, at
+// t with the barycentric weights u, v, w of a, b and c. Back faces are hit.
+inline bool hit_triangle(const watertight_ray& r, const point3& a,
+                         const point3& b, const point3& c, real t_min,
+                         real t_max, real& t, real& u, real& v, real& w) {
+    RT_STAT(triangle_tests, 1);
+    const vec3 pa = a - r.origin, pb = b - r.origin, pc = c - r.origin;
+    const real ax = pa[r.kx] - r.sx * pa[r.kz];
+    const real ay = pa[r.ky] - r.sy * pa[r.kz];
+    const real bx = pb[r.kx] - r.sx * pb[r.kz];
+    const real by = pb[r.ky] - r.sy * pb[r.kz];
+    const real cx = pc[r.kx] - r.sx * pc[r.kz];
+    const real cy = pc[r.ky] - r.sy * pc[r.kz];
+    u = cx * by - cy * bx;
+    v = ax * cy - ay * cx;
+    w = bx * ay - by * ax;
+    // an edge through the ray in float is decided in double
+    if (sizeof(real) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+        u = static_cast<double>(cx) * by - static_cast<double>(cy) * bx;
+        v = static_cast<double>(ax) * cy - static_cast<double>(ay) * cx;
+        w = static_cast<double>(bx) * ay - static_cast<double>(by) * ax;
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+    const real det = u + v + w;
+    if (det == 0) return false;
+    const real az = r.sz * pa[r.kz], bz = r.sz * pb[r.kz],
+               cz = r.sz * pc[r.kz];
+    t = (u * az + v * bz + w * cz) / det;
+    if (!(t > t_min && t < t_max)) return false;
+    u /= det;
+    v /= det;
+    w /= det;
+    return true;
+}
+
+// Triangles over shared vertex buffers, with a BVH of their own. A mesh
+// is a single hittable however many triangles it has: the triangles are
+// three indices each, not objects, and the BVH is a flat_bvh.
+// Fill the buffers, then call build() before tracing.
+class triangle_mesh : public hittable {
+   public:
+    std::vector<point3> positions;
+    std::vector<vec3> normals;      // one per vertex, or none for flat faces
+    std::vector<uint32_t> indices;  // three vertices per triangle
+    shared_ptr<material> mat_ptr;
+
+    triangle_mesh() {}
+    triangle_mesh(shared_ptr<material> m) : mat_ptr(m) {}
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    // Builds the BVH, reordering the triangles into its leaves. Returns
+    // false if the mesh has no triangles or an index out of range.
+    bool build();
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const {
+        if (bvh.empty()) return false;
+        output_box = bvh.bounds();
+        return true;
+    }
+
+    // Bytes of the buffers and the BVH
+    size_t memory() const {
+        return positions.capacity() * sizeof(point3) +
+               normals.capacity() * sizeof(vec3) +
+               indices.capacity() * sizeof(uint32_t) + bvh.memory();
+    }
+
+   private:
+    flat_bvh bvh;
+};
+
+bool triangle_mesh::build() {
+    bvh = flat_bvh();
+    if (indices.empty() || indices.size() % 3 != 0) return false;
+    if (!normals.empty() && normals.size() != positions.size()) return false;
+    for (auto index : indices)
+        if (index >= positions.size()) return false;
+
+    std::vector<size_t> order;
+    {
+        std::vector<bvh_build_item> items;
+        items.reserve(triangle_count());
+        for (size_t k = 0; k < triangle_count(); k++) {
+            aabb box;
+            for (int i = 0; i < 3; i++)
+                box.expand(positions[indices[3 * k + i]]);
+            items.push_back({box, box.centroid(), k});
+        }
+        bvh.build(items, order, 4);
+    }
+    std::vector<uint32_t> sorted;
+    sorted.reserve(indices.size());
+    for (auto k : order)
+        for (int i = 0; i < 3; i++) sorted.push_back(indices[3 * k + i]);
+    indices.swap(sorted);
+    return true;
+}
+
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max,
+                        hit_record& rec) const {
+    const watertight_ray wr(r);
+    int closest = -1;
+    real closest_u = 0, closest_v = 0, closest_w = 0;
+    real closest_t = t_max;
+    bvh.traverse(r, t_min, closest_t, [&](int k, real& limit) {
+        const uint32_t* v = &indices[3 * k];
+        real t, u, bv, w;
+        if (!hit_triangle(wr, positions[v[0]], positions[v[1]],
+                          positions[v[2]], t_min, limit, t, u, bv, w))
+            return false;
+        closest = k;
+        limit = t;
+        closest_u = u, closest_v = bv, closest_w = w;
+        return true;
+    });
+    if (closest < 0) return false;
+
+    const uint32_t* v = &indices[3 * closest];
+    const point3 &a = positions[v[0]], &b = positions[v[1]],
+                 &c = positions[v[2]];
+    rec.t = closest_t;
+    // from the weights rather than the ray, so the point lies on the face
+    rec.p = closest_u * a + closest_v * b + closest_w * c;
+    vec3 geometric = unit_vector(cross(b - a, c - a));
+    rec.front_face = dot(r.direction(), geometric) < 0;
+    vec3 normal = geometric;
+    if (!normals.empty()) {
+        vec3 shading = closest_u * normals[v[0]] + closest_v * normals[v[1]] +
+                       closest_w * normals[v[2]];
+        if (shading.length_squared() > 0) normal = unit_vector(shading);
+        // on the side of the face the ray came from
+        if (dot(normal, geometric) < 0) normal = -normal;
+    }
+    rec.normal = rec.front_face ? normal : -normal;
+    rec.mat_ptr = mat_ptr.get();
+    return true;
+}
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mesh.h"
+
+// Wavefront OBJ and PLY meshes, read in chunks straight into the buffers
+// of a triangle_mesh. Memory is the buffer of the reader and the mesh,
+// whatever the size of the file.
+
+// Reads a file a chunk at a time, by lines or by bytes
+class chunk_reader {
+   public:
+    explicit chunk_reader(const std::string& path)
+        : file(std::fopen(path.c_str(), "rb")), buffer(1 << 20) {}
+    ~chunk_reader() {
+        if (file) std::fclose(file);
+    }
+    chunk_reader(const chunk_reader&) = delete;
+    chunk_reader& operator=(const chunk_reader&) = delete;
+
+    bool is_open() const { return file != nullptr; }
+
+    // The next line, null-terminated in place of its '\n', or false at the
+    // end of the file
+    bool line(char*& text) {
+        for (;;) {
+            auto found = static_cast<char*>(
+                std::memchr(&buffer[pos], '\n', size - pos));
+            if (found) {
+                *found = '\0';
+                text = &buffer[pos];
+                pos = found - &buffer[0] + 1;
+                line_number++;
+                return true;
+            }
+            if (at_end) {
+                if (pos == size) return false;
+                // the last line has no '\n', fill() left room for the '\0'
+                buffer[size] = '\0';
+                text = &buffer[pos];
+                pos = size;
+                line_number++;
+                return true;
+            }
+            // a line longer than the buffer grows it
+            if (pos == 0 && size == buffer.size() - 1)
+                buffer.resize(2 * buffer.size());
+            fill();
+        }
+    }
+
+    // Copies the next n bytes to out, returns false at the end of the file
+    bool read(void* out, size_t n) {
+        auto bytes = static_cast<char*>(out);
+        while (n > 0) {
+            if (pos == size) {
+                if (at_end) return false;
+                fill();
+                continue;
+            }
+            size_t chunk = std::min(n, size - pos);
+            std::memcpy(bytes, &buffer[pos], chunk);
+            bytes += chunk;
+            pos += chunk;
+            n -= chunk;
+        }
+        return true;
+    }
+
+    int line_number = 0;  // of the last line read
+
+   private:
+    // Moves what is left to the front and reads behind it
+    void fill() {
+        std::memmove(&buffer[0], &buffer[pos], size - pos);
+        size -= pos;
+        pos = 0;
+        auto n = std::fread(&buffer[size], 1, buffer.size() - 1 - size, file);
+        size += n;
+        if (n == 0) at_end = true;
+    }
+
+    std::FILE* file;
+    std::vector<char> buffer;
+    size_t pos = 0;   // next byte to read
+    size_t size = 0;  // bytes in the buffer
+    bool at_end = false;
+};
+
+// Prints message at the current line of a mesh file, returns false
+inline bool mesh_error(const std::string& path, const chunk_reader& in,
+                       const std::string& message) {
+    std::cerr << path << ":" << in.line_number << ": " << message << "\n";
+    return false;
+}
+
+// Reads an OBJ file into the buffers of mesh. Polygons are split into
+// fans of triangles, texture coordinates, groups and materials are
+// ignored. Vertex normals are used if they come before the first face.
+bool load_obj(const std::string& path, triangle_mesh& mesh) {
+    chunk_reader in(path);
+    if (!in.is_open()) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+    std::vector<point3> positions;
+    std::vector<vec3> normals;
+    // with normals, a mesh vertex per pair of position and normal
+    bool first_face = true, with_normals = false;
+    std::unordered_map<uint64_t, uint32_t> vertices;
+    std::vector<uint32_t> polygon;
+    char* p;
+    while (in.line(p)) {
+        while (*p == ' ' || *p == '\t') p++;
+        char* end;
+        auto numbers = [&](double* x, int n) {
+            for (int i = 0; i < n; i++) {
+                x[i] = std::strtod(p, &end);
+                if (end == p) return false;
+                p = end;
+            }
+            return true;
+        };
+        double x[3];
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            if (!numbers(x, 3)) return mesh_error(path, in, "invalid vertex");
+            positions.emplace_back(x[0], x[1], x[2]);
+        } else if (p[0] == 'v' && p[1] == 'n' &&
+                   (p[2] == ' ' || p[2] == '\t')) {
+            p += 2;
+            if (!numbers(x, 3)) return mesh_error(path, in, "invalid normal");
+            normals.emplace_back(x[0], x[1], x[2]);
+        } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            if (first_face) {
+                with_normals = !normals.empty();
+                first_face = false;
+            }
+            // corners are v, v/vt, v//vn or v/vt/vn, negative indices
+            // count back from the last vertex read
+            polygon.clear();
+            for (;;) {
+                long v = std::strtol(p, &end, 10), n = 0;
+                if (end == p) break;
+                p = end;
+                if (*p == '/') {
+                    std::strtol(++p, &end, 10);
+                    p = end;
+                    if (*p == '/') {
+                        n = std::strtol(++p, &end, 10);
+                        p = end;
+                    }
+                }
+                v = v < 0 ? positions.size() + v : v - 1;
+                if (v < 0 || v >= static_cast<long>(positions.size()))
+                    return mesh_error(path, in, "vertex index out of range");
+                if (!with_normals) {
+                    polygon.push_back(v);
+                    continue;
+                }
+                n = n < 0 ? normals.size() + n : n - 1;
+                if (n >= static_cast<long>(normals.size()))
+                    return mesh_error(path, in, "normal index out of range");
+                // a corner without a normal gets a zero one, its faces are
+                // shaded flat
+                uint64_t key = static_cast<uint64_t>(v) << 32 | (n + 1);
+                auto found = vertices.find(key);
+                if (found == vertices.end()) {
+                    found = vertices.emplace(key, mesh.positions.size()).first;
+                    mesh.positions.push_back(positions[v]);
+                    mesh.normals.push_back(n >= 0 ? normals[n] : vec3());
+                }
+                polygon.push_back(found->second);
+            }
+            if (polygon.size() < 3)
+                return mesh_error(path, in, "face with less than 3 vertices");
+            for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                mesh.indices.push_back(polygon[0]);
+                mesh.indices.push_back(polygon[k]);
+                mesh.indices.push_back(polygon[k + 1]);
+            }
+        }
+    }
+    if (!with_normals) mesh.positions.swap(positions);
+    return true;
+}
+
+// Reads a PLY file, ASCII or binary, into the buffers of mesh. The vertex
+// element gives x, y, z and, if it has them, nx, ny, nz; the face element
+// gives polygons by a list named vertex_indices (or vertex_index), split
+// into fans. Other elements and properties are skipped.
+bool load_ply(const std::string& path, triangle_mesh& mesh) {
+    chunk_reader in(path);
+    if (!in.is_open()) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+
+    enum class ply_format { ascii, little_endian, big_endian };
+    struct ply_property {
+        std::string name;
+        int size;        // bytes of a value, of the items for a list
+        char kind;       // 'i'nteger, 'u'nsigned or 'f'loat
+        int count_size;  // bytes of the count of a list, 0 if no list
+        char count_kind;
+    };
+    struct ply_element {
+        std::string name;
+        size_t count;
+        std::vector<ply_property> properties;
+    };
+    auto parse_type = [](const std::string& name, int& size, char& kind) {
+        static const struct {
+            const char* name;
+            int size;
+            char kind;
+        } types[] = {{"char", 1, 'i'},    {"int8", 1, 'i'},
+                     {"uchar", 1, 'u'},   {"uint8", 1, 'u'},
+                     {"short", 2, 'i'},   {"int16", 2, 'i'},
+                     {"ushort", 2, 'u'},  {"uint16", 2, 'u'},
+                     {"int", 4, 'i'},     {"int32", 4, 'i'},
+                     {"uint", 4, 'u'},    {"uint32", 4, 'u'},
+                     {"float", 4, 'f'},   {"float32", 4, 'f'},
+                     {"double", 8, 'f'},  {"float64", 8, 'f'}};
+        for (const auto& t : types) {
+            if (name == t.name) {
+                size = t.size;
+                kind = t.kind;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // the header, one statement per line
+    char* p;
+    if (!in.line(p) || std::strncmp(p, "ply", 3) != 0)
+        return mesh_error(path, in, "not a PLY file");
+    ply_format format = ply_format::ascii;
+    std::vector<ply_element> elements;
+    for (;;) {
+        if (!in.line(p)) return mesh_error(path, in, "no end_header");
+        std::vector<std::string> words;
+        for (char* word = std::strtok(p, " \t\r"); word;
+             word = std::strtok(nullptr, " \t\r"))
+            words.push_back(word);
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+            continue;
+        if (words[0] == "end_header") break;
+        if (words[0] == "format" && words.size() == 3) {
+            if (words[1] == "ascii")
+                format = ply_format::ascii;
+            else if (words[1] == "binary_little_endian")
+                format = ply_format::little_endian;
+            else if (words[1] == "binary_big_endian")
+                format = ply_format::big_endian;
+            else
+                return mesh_error(path, in, "unknown format " + words[1]);
+        } else if (words[0] == "element" && words.size() == 3) {
+            elements.push_back(
+                {words[1], std::strtoull(words[2].c_str(), nullptr, 10), {}});
+        } else if (words[0] == "property" && !elements.empty()) {
+            ply_property property = {words.back(), 0, 0, 0, 0};
+            bool ok;
+            if (words.size() == 5 && words[1] == "list")
+                ok = parse_type(words[2], property.count_size,
+                                property.count_kind) &&
+                     parse_type(words[3], property.size, property.kind);
+            else
+                ok = words.size() == 3 &&
+                     parse_type(words[1], property.size, property.kind);
+            if (!ok) return mesh_error(path, in, "invalid property");
+            elements.back().properties.push_back(property);
+        } else {
+            return mesh_error(path, in, "unknown statement " + words[0]);
+        }
+    }
+
+    // the values of an element, from a line or from the bytes of the file
+    char* rest = nullptr;
+    auto next_item = [&]() {
+        if (format != ply_format::ascii) return true;
+        return in.line(rest);
+    };
+    auto value = [&](int size, char kind, double& x) {
+        if (format == ply_format::ascii) {
+            char* end;
+            x = std::strtod(rest, &end);
+            if (end == rest) return false;
+            rest = end;
+            return true;
+        }
+        unsigned char b[8];
+        if (!in.read(b, size)) return false;
+        if (format == ply_format::big_endian)
+            for (int i = 0; i < size / 2; i++) std::swap(b[i], b[size - 1 - i]);
+        union {
+            int8_t i8;
+            uint8_t u8;
+            int16_t i16;
+            uint16_t u16;
+            int32_t i32;
+            uint32_t u32;
+            float f32;
+            double f64;
+        } v;
+        std::memcpy(&v, b, size);  // now in the order of the host
+        switch (size) {
+            case 1:
+                x = kind == 'i' ? v.i8 : v.u8;
+                break;
+            case 2:
+                x = kind == 'i' ? v.i16 : v.u16;
+                break;
+            case 4:
+                x = kind == 'f' ? v.f32 : kind == 'i' ? v.i32 : v.u32;
+                break;
+            default:
+                x = v.f64;
+        }
+        return true;
+    };
+
+    std::vector<uint32_t> polygon;
+    for (const auto& e : elements) {
+        // where the coordinates are among the properties
+        int slot[6] = {-1, -1, -1, -1, -1, -1};
+        const char* names[6] = {"x", "y", "z", "nx", "ny", "nz"};
+        int face_list = -1;
+        for (size_t k = 0; k < e.properties.size(); k++) {
+            const auto& name = e.properties[k].name;
+            for (int s = 0; s < 6; s++)
+                if (name == names[s]) slot[s] = k;
+            if (e.properties[k].count_size &&
+                (name == "vertex_indices" || name == "vertex_index"))
+                face_list = k;
+        }
+        bool vertices = e.name == "vertex";
+        if (vertices && (slot[0] < 0 || slot[1] < 0 || slot[2] < 0))
+            return mesh_error(path, in, "vertices without x, y and z");
+        bool with_normals = vertices && slot[3] >= 0 && slot[4] >= 0 &&
+                            slot[5] >= 0;
+        if (vertices) {
+            mesh.positions.reserve(e.count);
+            if (with_normals) mesh.normals.reserve(e.count);
+        }
+
+        for (size_t item = 0; item < e.count; item++) {
+            if (!next_item()) return mesh_error(path, in, "truncated");
+            double x[6] = {};
+            polygon.clear();
+            for (size_t k = 0; k < e.properties.size(); k++) {
+                const auto& property = e.properties[k];
+                double v;
+                if (!property.count_size) {
+                    if (!value(property.size, property.kind, v))
+                        return mesh_error(path, in, "truncated");
+                    for (int s = 0; s < 6; s++)
+                        if (slot[s] == static_cast<int>(k)) x[s] = v;
+                    continue;
+                }
+                double count;
+                if (!value(property.count_size, property.count_kind, count))
+                    return mesh_error(path, in, "truncated");
+                for (long i = 0; i < static_cast<long>(count); i++) {
+                    if (!value(property.size, property.kind, v))
+                        return mesh_error(path, in, "truncated");
+                    if (static_cast<int>(k) == face_list)
+                        polygon.push_back(static_cast<uint32_t>(v));
+                }
+            }
+            if (vertices) {
+                mesh.positions.emplace_back(x[0], x[1], x[2]);
+                if (with_normals) mesh.normals.emplace_back(x[3], x[4], x[5]);
+            } else if (e.name == "face" && face_list >= 0) {
+                if (polygon.size() < 3)
+                    return mesh_error(path, in,
+                                      "face with less than 3 vertices");
+                for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                    mesh.indices.push_back(polygon[0]);
+                    mesh.indices.push_back(polygon[k]);
+                    mesh.indices.push_back(polygon[k + 1]);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Reads the OBJ or PLY file at path, by its extension, and builds the BVH
+// of mesh. Returns false on an error.
+bool load_mesh(const std::string& path, triangle_mesh& mesh) {
+    auto dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot);
+    for (auto& c : extension) c = std::tolower(c);
+    bool ok;
+    if (extension == ".obj")
+        ok = load_obj(path, mesh);
+    else if (extension == ".ply")
+        ok = load_ply(path, mesh);
+    else {
+        std::cerr << "Unknown mesh format " << path << "\n";
+        return false;
+    }
+    if (!ok) return false;
+    if (!mesh.build()) {
+        std::cerr << path << " has no triangles or an index out of range\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef NET_H
+#define NET_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Stream sockets named by an address: "unix:PATH" for a Unix domain socket,
+// anything else "HOST:PORT" for TCP. The functions print their errors to
+// std::cerr and return -1 or false.
+
+// Splits a TCP address at its last colon, returns false if it has none
+bool split_host_port(const std::string& address, std::string& host,
+                     std::string& port) {
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size()) {
+        std::cerr << "Invalid address " << address
+                  << ", expected unix:PATH or HOST:PORT\n";
+        return false;
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+bool is_unix_address(const std::string& address) {
+    return address.compare(0, 5, "unix:") == 0;
+}
+
+// Fills a Unix socket address from "unix:PATH", returns false if the path
+// does not fit
+bool unix_socket_address(const std::string& address, sockaddr_un& a) {
+    std::memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    std::string path = address.substr(5);
+    if (path.empty() || path.size() >= sizeof(a.sun_path)) {
+        std::cerr << "Invalid socket path " << path << "\n";
+        return false;
+    }
+    std::memcpy(a.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Opens a socket of the address and connects it (connecting) or binds it
+// and listens on it. A stale Unix socket file is replaced.
+int open_socket(const std::string& address, bool connecting) {
+    if (is_unix_address(address)) {
+        sockaddr_un a;
+        if (!unix_socket_address(address, a)) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            std::cerr << "Cannot create a socket: " << std::strerror(errno)
+                      << "\n";
+            return -1;
+        }
+        if (!connecting) unlink(a.sun_path);
+        auto* sa = reinterpret_cast<sockaddr*>(&a);
+        if (connecting ? connect(fd, sa, sizeof(a)) == 0
+                       : bind(fd, sa, sizeof(a)) == 0 && listen(fd, 64) == 0)
+            return fd;
+        if (!connecting)
+            std::cerr << "Cannot listen on " << address << ": "
+                      << std::strerror(errno) << "\n";
+        close(fd);
+        return -1;
+    }
+
+    std::string host, port;
+    if (!split_host_port(address, host, port)) return -1;
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (!connecting) hints.ai_flags = AI_PASSIVE;
+    addrinfo* found;
+    int error = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                            port.c_str(), &hints, &found);
+    if (error != 0) {
+        std::cerr << "Cannot resolve " << address << ": "
+                  << gai_strerror(error) << "\n";
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* ai = found; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int on = 1;
+        // results are sent as soon as they are written
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (!connecting)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (connecting ? connect(fd, ai->ai_addr, ai->ai_addrlen) == 0
+                       : bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                             listen(fd, 64) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    if (fd < 0 && !connecting)
+        std::cerr << "Cannot listen on " << address << ": "
+                  << std::strerror(errno) << "\n";
+    return fd;
+}
+
+// Turns on keepalive probes on a connected TCP socket, so a peer that
+// vanished without closing it, a machine that went down or a network that
+// was cut, fails its reads after about a minute instead of the system's
+// hours. Unix sockets have no such peers and keep their defaults.
+void enable_keepalive(int fd) {
+    int on = 1, idle = 30, interval = 10, count = 3;  // seconds, probes
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0)
+        return;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+// Listening socket of the address
+int listen_socket(const std::string& address) {
+    return open_socket(address, false);
+}
+
+// Socket connected to the address, retried for `seconds` so a worker may
+// start before the coordinator listens
+int connect_socket(const std::string& address, double seconds = 10) {
+    for (int attempt = 0;; attempt++) {
+        int fd = open_socket(address, true);
+        if (fd >= 0) {
+            enable_keepalive(fd);
+            return fd;
+        }
+        if (attempt * 0.1 >= seconds) break;
+        usleep(100000);
+    }
+    std::cerr << "Cannot connect to " << address << "\n";
+    return -1;
+}
+
+// Writes all size bytes of data, returns false if the peer is gone.
+// Writing to a closed socket fails instead of raising SIGPIPE.
+bool send_all(int fd, const void* data, size_t size) {
+    auto* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reads exactly size bytes into data, returns false at the end of the
+// stream or on an error
+bool receive_all(int fd, void* data, size_t size) {
+    auto* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,385 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "adaptive.h"
+#include "image_output.h"
+#include "integrator.h"
+#include "packet.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "wavefront.h"
+
+// Settings that can be changed from the command line
+struct render_options {
+    std::string scene;        // scene file, the built-in scene if empty
+    std::string scene_cache;  // binary cache of the baked scene
+    std::string save_scene;   // scene file written from the scene
+    int width = 0;            // 0 takes the scene's
+    int height = 0;           // 0 keeps the aspect ratio of the scene
+    int samples_per_pixel = 0;  // 0 takes the scene's, the maximum with
+                                // adaptive sampling
+    adaptive_settings adaptive;
+    std::string sample_map;  // debug image of the samples per pixel
+    std::string reference;   // PFM image the result is compared with
+    bool stats = false;      // print the render statistics
+    std::string trace;       // Chrome trace of the tiles
+    int pass_samples = 0;    // samples per pixel of a progressive pass
+    double time_budget = 0;  // seconds of rendering, 0 means no limit
+    std::string preview;     // image written after every pass
+    std::string checkpoint;  // saved after every pass, resumed from
+    bool denoise = false;    // filter the image guided by the AOVs
+    std::string aov;         // prefix of the AOV images written out
+    std::vector<int> frames;  // of the animation to render, empty takes
+                              // every frame of the scene's camera path
+    path_limits path;
+    bool light_sampling = true;  // sample the lights at diffuse hits
+    render_engine engine = render_engine::megakernel;
+    bool bake = true;  // trace a baked_scene when the scene allows it
+    // render with the kernel for any scene instead of one compiled for the
+    // scene's kind, see select_tile_kernel
+    bool generic_kernel = false;
+    sampler_type sampler = sampler_type::sobol;
+    uint64_t seed = 0;  // the same seed renders the same image
+    int threads = 0;  // 0 means one per hardware thread
+    int tile_size = 32;
+    tile_order order = tile_order::hilbert;
+    std::string output = "-";  // "-" is stdout
+    image_format format = image_format::p6;
+    bool packets = false;  // trace primary rays in SIMD packets
+    simd_level simd = best_simd_level();
+    std::string coordinator;  // address the workers connect to
+    std::string worker;       // address of the coordinator to render for
+    std::string interactive;  // where edits are read from, "-" is stdin
+};
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --scene FILE        scene file (default: the random "
+                 "scene)\n"
+              << "  --scene-cache FILE  map the baked scene from FILE, "
+                 "written first if it is\n"
+              << "                      missing or older than the scene\n"
+              << "  --save-scene FILE   write the scene as a scene file\n"
+              << "  --width N           image width (default: the scene's)\n"
+              << "  --height N          image height (default: the scene's "
+                 "aspect ratio)\n"
+              << "  --spp N             samples per pixel (default: the "
+                 "scene's)\n"
+              << "  --adaptive ERR      stop sampling a pixel once the "
+                 "relative error of its\n"
+              << "                      mean is below ERR, --spp is the "
+                 "maximum (default: off)\n"
+              << "  --min-spp N         minimum samples per pixel with "
+                 "--adaptive (default: 16)\n"
+              << "  --sample-map FILE   write the samples per pixel as a heat "
+                 "map\n"
+              << "  --reference FILE    print the error of the image against "
+                 "the PFM image FILE\n"
+              << "  --stats             print counters and timers of the "
+                 "render (-DRT_STATS builds)\n"
+              << "  --trace FILE        write the tiles of every thread as a "
+                 "Chrome trace\n"
+              << "                      (-DRT_STATS builds)\n"
+              << "  --pass N            render progressively in passes of N "
+                 "spp\n"
+              << "  --time SECONDS      stop after SECONDS of rendering, in "
+                 "passes of 16 spp\n"
+              << "                      unless --pass is given\n"
+              << "  --preview FILE      write the image after every pass\n"
+              << "  --checkpoint FILE   save the samples after every pass and "
+                 "resume from FILE\n"
+              << "                      if it exists\n"
+              << "  --denoise           filter the noise out of the image, "
+                 "guided by the albedo,\n"
+              << "                      normal and depth of the first hits\n"
+              << "  --aov PREFIX        write the first-hit albedo, normal "
+                 "and depth as\n"
+              << "                      PREFIX.albedo.pfm, PREFIX.normal.pfm "
+                 "and PREFIX.depth.pfm\n"
+              << "  --frames LIST       frames of the camera path to render, "
+                 "e.g. 0-99 or 1,5,10-20\n"
+              << "                      (default: all of them)\n"
+              << "  --max-depth N       rays per path (default: 50)\n"
+              << "  --roulette N        rays per path before Russian roulette "
+                 "may end it,\n"
+              << "                      --max-depth turns it off (default: "
+                 "5)\n"
+              << "  --no-light-sampling only find lights by scattering\n"
+              << "  --engine NAME       megakernel (default) or wavefront\n"
+              << "  --no-bake           trace the scene objects instead of "
+                 "a baked copy\n"
+              << "  --generic-kernel    render with the kernel for any "
+                 "scene, not one\n"
+              << "                      specialized for its materials\n"
+              << "  --sampler NAME      independent, halton, sobol (default) "
+                 "or blue-noise\n"
+              << "  --seed N            random seed of the samples "
+                 "(default: 0)\n"
+              << "  -t, --threads N     worker threads (default: all cores)\n"
+              << "  --tile N            tile size in pixels (default: 32)\n"
+              << "  --order ORDER       tile order: scanline, morton or "
+                 "hilbert (default)\n"
+              << "  -o, --output FILE   image file, .ppm or .pfm (default: "
+                 "stdout)\n"
+              << "  --format FORMAT     p3, p6 (default) or pfm, overrides "
+                 "the extension\n"
+              << "  --packets           trace primary rays in SIMD packets\n"
+              << "  --simd LEVEL        packet instruction set: scalar, sse "
+                 "or avx2 (default: best supported)\n"
+              << "  --coordinator ADDR  render on the workers connecting to "
+                 "ADDR, unix:PATH or\n"
+              << "                      HOST:PORT\n"
+              << "  --worker ADDR       render for the coordinator at ADDR\n"
+              << "  --interactive SRC   render the view again on every edit "
+                 "read from SRC, - for\n"
+              << "                      stdin, unix:PATH or HOST:PORT, and "
+                 "send every pass as a\n"
+              << "                      frame to the output\n"
+              << "  -h, --help          show this message\n";
+}
+
+// Parses a list of frames like "1,5,10-20" into frames, returns false if
+// it is invalid
+bool parse_frame_list(const std::string& list, std::vector<int>& frames) {
+    frames.clear();
+    const char* p = list.c_str();
+    while (*p) {
+        char* after;
+        long first = std::strtol(p, &after, 10), last = first;
+        if (after == p || first < 0) return false;
+        p = after;
+        if (*p == '-') {
+            last = std::strtol(++p, &after, 10);
+            if (after == p || last < first) return false;
+            p = after;
+        }
+        for (long f = first; f <= last; f++) frames.push_back(f);
+        if (*p == ',' && p[1])
+            p++;
+        else if (*p)
+            return false;
+    }
+    return !frames.empty();
+}
+
+// Parses the command line into opts. Prints the usage and returns false if
+// the arguments are invalid or help is requested.
+bool parse_options(int argc, char** argv, render_options& opts) {
+    bool format_given = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        // fetches the value of an option taking one
+        auto value = [&](std::string& out) {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << "\n";
+                return false;
+            }
+            out = argv[++i];
+            return true;
+        };
+        std::string v;
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return false;
+        } else if (arg == "--scene") {
+            if (!value(opts.scene)) return false;
+        } else if (arg == "--scene-cache") {
+            if (!value(opts.scene_cache)) return false;
+        } else if (arg == "--save-scene") {
+            if (!value(opts.save_scene)) return false;
+        } else if (arg == "--width" || arg == "--height") {
+            if (!value(v)) return false;
+            int& size = arg == "--width" ? opts.width : opts.height;
+            size = std::atoi(v.c_str());
+            if (size <= 1) {
+                std::cerr << "Invalid image size " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--spp") {
+            if (!value(v)) return false;
+            opts.samples_per_pixel = std::atoi(v.c_str());
+            if (opts.samples_per_pixel <= 0) {
+                std::cerr << "Invalid sample count " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--adaptive") {
+            if (!value(v)) return false;
+            opts.adaptive.threshold = std::atof(v.c_str());
+            if (opts.adaptive.threshold <= 0) {
+                std::cerr << "Invalid error threshold " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--min-spp") {
+            if (!value(v)) return false;
+            opts.adaptive.min_samples = std::atoi(v.c_str());
+            if (opts.adaptive.min_samples <= 0) {
+                std::cerr << "Invalid sample count " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--sample-map") {
+            if (!value(opts.sample_map)) return false;
+        } else if (arg == "--reference") {
+            if (!value(opts.reference)) return false;
+        } else if (arg == "--stats") {
+            opts.stats = true;
+        } else if (arg == "--trace") {
+            if (!value(opts.trace)) return false;
+        } else if (arg == "--pass") {
+            if (!value(v)) return false;
+            opts.pass_samples = std::atoi(v.c_str());
+            if (opts.pass_samples <= 0) {
+                std::cerr << "Invalid sample count " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--time") {
+            if (!value(v)) return false;
+            opts.time_budget = std::atof(v.c_str());
+            if (opts.time_budget <= 0) {
+                std::cerr << "Invalid time budget " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--preview") {
+            if (!value(opts.preview)) return false;
+        } else if (arg == "--checkpoint") {
+            if (!value(opts.checkpoint)) return false;
+        } else if (arg == "--denoise") {
+            opts.denoise = true;
+        } else if (arg == "--aov") {
+            if (!value(opts.aov)) return false;
+        } else if (arg == "--frames") {
+            if (!value(v)) return false;
+            if (!parse_frame_list(v, opts.frames)) {
+                std::cerr << "Invalid frame list " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--max-depth") {
+            if (!value(v)) return false;
+            opts.path.max_depth = std::atoi(v.c_str());
+            if (opts.path.max_depth <= 0) {
+                std::cerr << "Invalid path depth " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--roulette") {
+            if (!value(v)) return false;
+            opts.path.roulette_depth = std::atoi(v.c_str());
+            if (opts.path.roulette_depth <= 0) {
+                std::cerr << "Invalid path depth " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--engine") {
+            if (!value(v)) return false;
+            if (!parse_render_engine(v, opts.engine)) {
+                std::cerr << "Unknown engine " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--no-light-sampling") {
+            opts.light_sampling = false;
+        } else if (arg == "--no-bake") {
+            opts.bake = false;
+        } else if (arg == "--generic-kernel") {
+            opts.generic_kernel = true;
+        } else if (arg == "--sampler") {
+            if (!value(v)) return false;
+            if (!parse_sampler_type(v, opts.sampler)) {
+                std::cerr << "Unknown sampler " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--seed") {
+            if (!value(v)) return false;
+            opts.seed = std::strtoull(v.c_str(), nullptr, 10);
+        } else if (arg == "-t" || arg == "--threads") {
+            if (!value(v)) return false;
+            opts.threads = std::atoi(v.c_str());
+            if (opts.threads <= 0) {
+                std::cerr << "Invalid thread count " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--tile") {
+            if (!value(v)) return false;
+            opts.tile_size = std::atoi(v.c_str());
+            if (opts.tile_size <= 0) {
+                std::cerr << "Invalid tile size " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--order") {
+            if (!value(v)) return false;
+            if (!parse_tile_order(v, opts.order)) {
+                std::cerr << "Unknown tile order " << v << "\n";
+                return false;
+            }
+        } else if (arg == "-o" || arg == "--output") {
+            if (!value(opts.output)) return false;
+        } else if (arg == "--format") {
+            if (!value(v)) return false;
+            if (!parse_image_format(v, opts.format)) {
+                std::cerr << "Unknown image format " << v << "\n";
+                return false;
+            }
+            format_given = true;
+        } else if (arg == "--packets") {
+            opts.packets = true;
+        } else if (arg == "--simd") {
+            if (!value(v)) return false;
+            if (!parse_simd_level(v, opts.simd)) {
+                std::cerr << "Unsupported instruction set " << v << "\n";
+                return false;
+            }
+        } else if (arg == "--coordinator") {
+            if (!value(opts.coordinator)) return false;
+        } else if (arg == "--worker") {
+            if (!value(opts.worker)) return false;
+        } else if (arg == "--interactive") {
+            if (!value(opts.interactive)) return false;
+        } else {
+            std::cerr << "Unknown option " << arg << "\n";
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if (!format_given && opts.output != "-")
+        opts.format = format_for_path(opts.output);
+    if (opts.time_budget > 0 && opts.pass_samples == 0) opts.pass_samples = 16;
+    if (!opts.coordinator.empty() && !opts.worker.empty()) {
+        std::cerr << "--coordinator and --worker exclude each other\n";
+        return false;
+    }
+    // the workers only send the sums of their samples
+    if (!opts.coordinator.empty() &&
+        (opts.adaptive.enabled() || opts.time_budget > 0 || opts.denoise ||
+         !opts.aov.empty() || !opts.checkpoint.empty() ||
+         !opts.preview.empty() || opts.stats || !opts.trace.empty())) {
+        std::cerr << "--adaptive, --time, --denoise, --aov, --checkpoint, "
+                     "--preview, --stats and\n--trace are not supported "
+                     "with --coordinator\n";
+        return false;
+    }
+    // an interactive render has no end to save or measure
+    if (!opts.interactive.empty() &&
+        (!opts.coordinator.empty() || !opts.worker.empty() ||
+         !opts.frames.empty() || opts.adaptive.enabled() ||
+         opts.time_budget > 0 || opts.denoise || !opts.aov.empty() ||
+         !opts.checkpoint.empty() || !opts.preview.empty() ||
+         !opts.sample_map.empty() || !opts.reference.empty() || opts.stats ||
+         !opts.trace.empty())) {
+        std::cerr << "--coordinator, --worker, --frames, --adaptive, --time, "
+                     "--denoise, --aov,\n--checkpoint, --preview, "
+                     "--sample-map, --reference, --stats and --trace\nare "
+                     "not supported with --interactive\n";
+        return false;
+    }
+#ifndef RT_STATS
+    if (opts.stats || !opts.trace.empty()) {
+        std::cerr << "--stats and --trace need a build with -DRT_STATS\n";
+        return false;
+    }
+#endif
+    return true;
+}
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RT_X86_SIMD
+// The AVX2 kernel is compiled for its own target with a GCC pragma
+#if defined(__GNUC__) && !defined(__clang__)
+#define RT_AVX2_KERNEL
+#endif
+#endif
+
+#include "bvh.h"
+#include "common.h"
+#include "hittable_list.h"
+#include "sphere.h"
+
+// Instruction sets the packet tracer can run on
+enum class simd_level { scalar, sse, avx2 };
+
+std::string simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::scalar:
+            return "scalar";
+        case simd_level::sse:
+            return "sse";
+        case simd_level::avx2:
+            return "avx2";
+    }
+    return "";
+}
+
+// Returns the widest instruction set supported by both the build and the CPU
+simd_level best_simd_level() {
+#if defined(RT_AVX2_KERNEL)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return simd_level::avx2;
+#endif
+#if defined(RT_X86_SIMD)
+    return simd_level::sse;
+#else
+    return simd_level::scalar;
+#endif
+}
+
+// Parses an instruction set name, returns false if it is unknown or not
+// supported by this build and CPU
+bool parse_simd_level(const std::string& name, simd_level& level) {
+    for (auto l : {simd_level::scalar, simd_level::sse, simd_level::avx2}) {
+        if (name == simd_level_name(l) && l <= best_simd_level()) {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+int packet_width(simd_level level) {
+    return level == simd_level::avx2 ? 8 : level == simd_level::sse ? 4 : 1;
+}
+
+const int max_packet_size = 8;
+
+// Up to 8 coherent rays in structure-of-arrays layout. Directions are
+// normalized so the distances are comparable between the rays.
+struct ray_packet {
+    alignas(32) float ox[max_packet_size], oy[max_packet_size],
+        oz[max_packet_size];
+    alignas(32) float dx[max_packet_size], dy[max_packet_size],
+        dz[max_packet_size];
+    alignas(32) float inv_dx[max_packet_size], inv_dy[max_packet_size],
+        inv_dz[max_packet_size];
+    alignas(32) float t_min[max_packet_size];
+    alignas(32) float t_hit[max_packet_size];  // closest hit so far
+    // sphere index or -1, exact up to sphere_packet_bvh::max_spheres
+    alignas(32) float hit[max_packet_size];
+    int size = 0;
+
+    // Stores r in the given lane, t_min is in units of r.direction()
+    void set(int lane, const ray& r, real ray_t_min) {
+        auto len = r.direction().length();
+        auto d = r.direction() / len;
+        ox[lane] = r.origin().x();
+        oy[lane] = r.origin().y();
+        oz[lane] = r.origin().z();
+        dx[lane] = d.x();
+        dy[lane] = d.y();
+        dz[lane] = d.z();
+        inv_dx[lane] = 1 / dx[lane];
+        inv_dy[lane] = 1 / dy[lane];
+        inv_dz[lane] = 1 / dz[lane];
+        t_min[lane] = ray_t_min * len;
+        t_hit[lane] = infinity;
+        hit[lane] = -1;
+    }
+
+    // Fills the lanes from size to width with copies of lane 0, whose
+    // results are ignored
+    void pad(int width) {
+        for (int lane = size; lane < width; lane++) {
+            ox[lane] = ox[0];
+            oy[lane] = oy[0];
+            oz[lane] = oz[0];
+            dx[lane] = dx[0];
+            dy[lane] = dy[0];
+            dz[lane] = dz[0];
+            inv_dx[lane] = inv_dx[0];
+            inv_dy[lane] = inv_dy[0];
+            inv_dz[lane] = inv_dz[0];
+            t_min[lane] = t_min[0];
+            t_hit[lane] = infinity;
+            hit[lane] = -1;
+        }
+    }
+};
+
+// A BVH over spheres only, with single precision boxes and leaves stored as
+// structure-of-arrays batches so a whole packet is tested against one
+// sphere per instruction. Hits found by a packet are refined by the double
+// precision sphere::hit of the closest sphere.
+class sphere_packet_bvh {
+   public:
+    struct node {
+        float min[3];
+        float max[3];
+        int first;  // first sphere of a leaf, or the right child
+        int count;  // spheres in the leaf, 0 for an inner node
+        int axis;   // split axis of an inner node
+    };
+
+    // Sphere indices are kept in the float lanes of ray_packet::hit,
+    // which hold integers exactly up to 2^24
+    static const size_t max_spheres = size_t(1) << 24;
+
+    // Returns false and stays empty if world contains anything else than
+    // spheres, or more than max_spheres of them
+    bool build(const hittable_list& world);
+
+    bool empty() const { return nodes.empty(); }
+
+    // Finds the closest sphere of every ray of p, with the given kernel
+    void intersect(ray_packet& p, simd_level level) const;
+
+    // Fills rec with the hit of r on sphere index, found by a packet
+    bool refine(int index, const ray& r, real t_min, real t_max,
+                hit_record& rec) const {
+        return spheres[index]->hit(r, t_min, t_max, rec);
+    }
+
+    template <typename L>
+    void intersect_kernel(ray_packet& p) const;
+
+   private:
+    static const int max_leaf_size = 4;
+
+    // Builds the node of items[start, end) at depth, returns its index
+    int build_node(std::vector<bvh_build_item>& items, size_t start,
+                   size_t end, int depth,
+                   const std::vector<const sphere*>& source);
+
+    std::vector<node> nodes;
+    std::vector<const sphere*> spheres;
+    // sphere batches: centers and squared radii
+    std::vector<float> cx, cy, cz, r2;
+};
+
+bool sphere_packet_bvh::build(const hittable_list& world) {
+    nodes.clear();
+    spheres.clear();
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    r2.clear();
+    std::vector<const sphere*> source;
+    std::vector<bvh_build_item> items;
+    if (world.objects.size() > max_spheres) return false;
+    for (const auto& object : world.objects) {
+        auto s = dynamic_cast<const sphere*>(object.get());
+        if (!s) return false;
+        aabb box;
+        s->bounding_box(box);
+        items.push_back({box, box.centroid(), source.size()});
+        source.push_back(s);
+    }
+    if (items.empty()) return false;
+    build_node(items, 0, items.size(), 0, source);
+    return true;
+}
+
+int sphere_packet_bvh::build_node(std::vector<bvh_build_item>& items,
+                                  size_t start, size_t end, int depth,
+                                  const std::vector<const sphere*>& source) {
+    aabb box;
+    for (size_t i = start; i < end; i++) box.expand(items[i].box);
+    int index = nodes.size();
+    nodes.push_back(node());
+    // round outwards so the box still contains the spheres
+    const float inf = std::numeric_limits<float>::infinity();
+    for (int a = 0; a < 3; a++) {
+        auto lo = static_cast<float>(box.minimum[a]);
+        auto hi = static_cast<float>(box.maximum[a]);
+        nodes[index].min[a] = std::nextafter(lo, -inf);
+        nodes[index].max[a] = std::nextafter(hi, inf);
+    }
+    nodes[index].axis = box.longest_axis();
+
+    if (end - start <= max_leaf_size) {
+        nodes[index].first = spheres.size();
+        nodes[index].count = end - start;
+        for (size_t i = start; i < end; i++) {
+            auto s = source[items[i].index];
+            spheres.push_back(s);
+            cx.push_back(s->center.x());
+            cy.push_back(s->center.y());
+            cz.push_back(s->center.z());
+            r2.push_back(s->radius * s->radius);
+        }
+        return index;
+    }
+
+    auto mid = bvh_partition(items, start, end, depth);
+    // the left child follows
+    build_node(items, start, mid, depth + 1, source);
+    int right = build_node(items, mid, end, depth + 1, source);
+    nodes[index].first = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+// The packet traversal, written once against a set of lane operations L
+// and instantiated for every instruction set. Arithmetic uses the vector
+// operators GCC and Clang define on the intrinsic types.
+template <typename L>
+void sphere_packet_bvh::intersect_kernel(ray_packet& p) const {
+    typedef typename L::vf vf;
+    const int W = L::width;
+    for (int base = 0; base < p.size; base += W) {
+        vf ox = L::load(p.ox + base), oy = L::load(p.oy + base),
+           oz = L::load(p.oz + base);
+        vf dx = L::load(p.dx + base), dy = L::load(p.dy + base),
+           dz = L::load(p.dz + base);
+        vf ix = L::load(p.inv_dx + base), iy = L::load(p.inv_dy + base),
+           iz = L::load(p.inv_dz + base);
+        vf t_min = L::load(p.t_min + base);
+        vf t_hit = L::load(p.t_hit + base);
+        vf hit = L::load(p.hit + base);
+
+        // both children are pushed, and the root: one more than the depth
+        int stack[bvh_stack_size + 1];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const node& n = nodes[stack[--top]];
+
+            // slab test of every ray against the node's box
+            vf tx0 = (L::set1(n.min[0]) - ox) * ix;
+            vf tx1 = (L::set1(n.max[0]) - ox) * ix;
+            vf ty0 = (L::set1(n.min[1]) - oy) * iy;
+            vf ty1 = (L::set1(n.max[1]) - oy) * iy;
+            vf tz0 = (L::set1(n.min[2]) - oz) * iz;
+            vf tz1 = (L::set1(n.max[2]) - oz) * iz;
+            vf t_near = L::max(L::max(L::min(tx0, tx1), L::min(ty0, ty1)),
+                               L::max(L::min(tz0, tz1), t_min));
+            vf t_far = L::min(L::min(L::max(tx0, tx1), L::max(ty0, ty1)),
+                              L::min(L::max(tz0, tz1), t_hit));
+            if (!L::any(L::le(t_near, t_far))) continue;
+
+            if (n.count == 0) {
+                // push the far child first, judged by the first ray
+                int left = &n - nodes.data() + 1;
+                bool left_first = p.dx[base] * (n.axis == 0) +
+                                      p.dy[base] * (n.axis == 1) +
+                                      p.dz[base] * (n.axis == 2) >=
+                                  0;
+                stack[top++] = left_first ? n.first : left;
+                stack[top++] = left_first ? left : n.first;
+                continue;
+            }
+
+            for (int s = n.first; s < n.first + n.count; s++) {
+                // oc = o - c, b = oc.d, the distance from the center to
+                // the ray is |oc - b d|, which is accurate in single
+                // precision even for big spheres
+                vf ocx = ox - L::set1(cx[s]);
+                vf ocy = oy - L::set1(cy[s]);
+                vf ocz = oz - L::set1(cz[s]);
+                vf b = ocx * dx + ocy * dy + ocz * dz;
+                vf fx = ocx - b * dx, fy = ocy - b * dy, fz = ocz - b * dz;
+                vf disc = L::set1(r2[s]) - (fx * fx + fy * fy + fz * fz);
+                vf valid = L::gt(disc, L::set1(0));
+                vf root = L::sqrt(L::max(disc, L::set1(0)));
+                vf t_near_root = L::set1(0) - b - root;
+                vf t = L::select(L::gt(t_near_root, t_min), t_near_root,
+                                 root - b);
+                vf closer = L::land(valid, L::land(L::gt(t, t_min),
+                                                   L::lt(t, t_hit)));
+                t_hit = L::select(closer, t, t_hit);
+                hit = L::select(closer, L::set1(s), hit);
+            }
+        }
+        L::store(p.t_hit + base, t_hit);
+        L::store(p.hit + base, hit);
+    }
+}
+
+// One ray at a time, used where no SIMD kernel is available
+struct scalar_lanes {
+    static const int width = 1;
+    typedef float vf;
+    static vf set1(float x) { return x; }
+    static vf load(const float* p) { return *p; }
+    static void store(float* p, vf a) { *p = a; }
+    static vf min(vf a, vf b) { return a < b ? a : b; }
+    static vf max(vf a, vf b) { return a > b ? a : b; }
+    static vf sqrt(vf a) { return std::sqrt(a); }
+    // masks are 0 or 1
+    static vf lt(vf a, vf b) { return a < b; }
+    static vf le(vf a, vf b) { return a <= b; }
+    static vf gt(vf a, vf b) { return a > b; }
+    static vf land(vf a, vf b) { return a * b; }
+    static vf select(vf m, vf a, vf b) { return m != 0 ? a : b; }
+    static bool any(vf m) { return m != 0; }
+};
+
+#if defined(RT_X86_SIMD)
+struct sse_lanes {
+    static const int width = 4;
+    typedef __m128 vf;
+    static vf set1(float x) { return _mm_set1_ps(x); }
+    static vf load(const float* p) { return _mm_load_ps(p); }
+    static void store(float* p, vf a) { _mm_store_ps(p, a); }
+    static vf min(vf a, vf b) { return _mm_min_ps(a, b); }
+    static vf max(vf a, vf b) { return _mm_max_ps(a, b); }
+    static vf sqrt(vf a) { return _mm_sqrt_ps(a); }
+    static vf lt(vf a, vf b) { return _mm_cmplt_ps(a, b); }
+    static vf le(vf a, vf b) { return _mm_cmple_ps(a, b); }
+    static vf gt(vf a, vf b) { return _mm_cmpgt_ps(a, b); }
+    static vf land(vf a, vf b) { return _mm_and_ps(a, b); }
+    static vf select(vf m, vf a, vf b) {
+        return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+    }
+    static bool any(vf m) { return _mm_movemask_ps(m) != 0; }
+};
+#endif
+
+#if defined(RT_AVX2_KERNEL)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+struct avx2_lanes {
+    static const int width = 8;
+    typedef __m256 vf;
+    static vf set1(float x) { return _mm256_set1_ps(x); }
+    static vf load(const float* p) { return _mm256_load_ps(p); }
+    static void store(float* p, vf a) { _mm256_store_ps(p, a); }
+    static vf min(vf a, vf b) { return _mm256_min_ps(a, b); }
+    static vf max(vf a, vf b) { return _mm256_max_ps(a, b); }
+    static vf sqrt(vf a) { return _mm256_sqrt_ps(a); }
+    static vf lt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static vf le(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static vf gt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static vf land(vf a, vf b) { return _mm256_and_ps(a, b); }
+    static vf select(vf m, vf a, vf b) { return _mm256_blendv_ps(b, a, m); }
+    static bool any(vf m) { return _mm256_movemask_ps(m) != 0; }
+};
+
+// instantiated here so the kernel is compiled for AVX2
+template void sphere_packet_bvh::intersect_kernel<avx2_lanes>(
+    ray_packet& p) const;
+#pragma GCC pop_options
+#endif
+
+void sphere_packet_bvh::intersect(ray_packet& p, simd_level level) const {
+    switch (level) {
+#if defined(RT_AVX2_KERNEL)
+        case simd_level::avx2:
+            p.pad(8);
+            intersect_kernel<avx2_lanes>(p);
+            return;
+#endif
+#if defined(RT_X86_SIMD)
+        case simd_level::sse:
+            p.pad(4 * ((p.size + 3) / 4));
+            intersect_kernel<sse_lanes>(p);
+            return;
+#endif
+        default:
+            intersect_kernel<scalar_lanes>(p);
+            return;
+    }
+}
+
+#endif
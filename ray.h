@@ -7,15 +7,17 @@ class ray {
    public:
     point3 orig;  // origin point
     vec3 dir;       // direction
+    real tm = 0;    // the time it is traced at, for moving objects
 
     ray() {}
-    ray(const point3& origin, const vec3& direction)
-        : orig(origin), dir(direction) {}
+    ray(const point3& origin, const vec3& direction, real time = 0)
+        : orig(origin), dir(direction), tm(time) {}
 
     point3 origin() const { return orig; }
     vec3 direction() const { return dir; }
+    real time() const { return tm; }
 
-    point3 at(double t) const { return orig + t * dir; }
+    point3 at(real t) const { return orig + t * dir; }
 };
 
 #endif
\ No newline at end of file
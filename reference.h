@@ -0,0 +1,78 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+
+// Reads a PFM image written by --format pfm: linear RGB floats, rows from
+// the bottom, little-endian. Returns false if path is not such an image.
+bool read_pfm(const std::string& path, int& w, int& h,
+              std::vector<float>& rgb) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    double scale;
+    if (!(in >> magic >> w >> h >> scale) || magic != "PF" || w <= 0 ||
+        h <= 0 || scale >= 0) {
+        std::cerr << path << " is not a little-endian RGB PFM image\n";
+        return false;
+    }
+    in.get();  // the single whitespace ending the header
+    rgb.resize(static_cast<size_t>(w) * h * 3);
+    if (!in.read(reinterpret_cast<char*>(rgb.data()),
+                 rgb.size() * sizeof(float))) {
+        std::cerr << path << " is truncated\n";
+        return false;
+    }
+    return true;
+}
+
+// Difference of an image from a reference, over the pixel averages
+struct image_error {
+    double rmse = 0;           // root mean squared error of the components
+    double max_error = 0;      // largest absolute error of a component
+    double relative_rmse = 0;  // rmse over the root mean square reference
+};
+
+// Compares frame with the PFM image at path, returns false if it cannot
+// be read or has another size
+bool compare_to_reference(const std::string& path, const framebuffer& frame,
+                          image_error& error) {
+    int w, h;
+    std::vector<float> rgb;
+    if (!read_pfm(path, w, h, rgb)) return false;
+    if (w != frame.width() || h != frame.height()) {
+        std::cerr << path << " is " << w << "x" << h << ", the image is "
+                  << frame.width() << "x" << frame.height() << "\n";
+        return false;
+    }
+    double squared = 0, reference = 0;
+    error = image_error();
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            int n = frame.samples(i, j);
+            for (int c = 0; c < 3; c++) {
+                double expected = rgb[(static_cast<size_t>(j) * w + i) * 3 + c];
+                // rounded to float like the reference was
+                double value = static_cast<float>(
+                    n > 0 ? frame.sum(i, j)[c] / n : 0.0);
+                double d = value - expected;
+                squared += d * d;
+                reference += expected * expected;
+                error.max_error = std::max(error.max_error, std::fabs(d));
+            }
+        }
+    }
+    double components = 3.0 * w * h;
+    error.rmse = std::sqrt(squared / components);
+    error.relative_rmse =
+        reference > 0 ? std::sqrt(squared / reference) : 0.0;
+    return true;
+}
+
+#endif
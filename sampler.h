@@ -0,0 +1,308 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// PCG32 random number generator (pcg-random.org): 64 bits of state, 32-bit
+// outputs, cheap to seed and to copy
+class pcg32 {
+   public:
+    // the default state of the reference implementation
+    constexpr pcg32()
+        : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
+    pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+    // Restarts the generator at initstate on stream initseq
+    void seed(uint64_t initstate, uint64_t initseq) {
+        state = 0;
+        inc = (initseq << 1) | 1;
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // Returns a random real in [0,1)
+    double next_double() { return next_uint() * 0x1p-32; }
+
+   private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+// The generator behind random_double() on the calling thread
+inline pcg32& thread_rng() {
+    static thread_local pcg32 rng;
+    return rng;
+}
+
+// Scrambles the bits of x (the splitmix64 finalizer)
+inline uint64_t mix_bits(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Restarts the thread's generator for sample `index` of pixel `pixel`, so
+// every sample draws the same numbers whichever thread renders it
+inline void seed_sample(uint64_t seed, uint32_t pixel, uint32_t index) {
+    uint64_t key = (static_cast<uint64_t>(pixel) << 32) | index;
+    thread_rng().seed(mix_bits(seed ^ mix_bits(key)), mix_bits(key + seed));
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// The first two dimensions of the Sobol sequence, a (0,2)-sequence, as
+// 32-bit fixed point fractions
+inline uint32_t sobol_dim0(uint32_t index) { return reverse_bits(index); }
+
+inline uint32_t sobol_dim1(uint32_t index) {
+    uint32_t v = 1u << 31;
+    uint32_t result = 0;
+    for (; index; index >>= 1, v ^= v >> 1)
+        if (index & 1) result ^= v;
+    return result;
+}
+
+// Hash-based Owen scrambling of a fixed point fraction (Burley, "Practical
+// Hash-based Owen Scrambling", 2020): every bit is flipped depending on the
+// bits above it, which keeps the stratification of the sequence
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// The radical inverse of index in a prime base, the Halton sequence
+inline double radical_inverse(uint32_t base, uint32_t index) {
+    double inv_base = 1.0 / base;
+    double inv = inv_base;
+    double result = 0;
+    while (index) {
+        result += (index % base) * inv;
+        index /= base;
+        inv *= inv_base;
+    }
+    return result;
+}
+
+inline double fraction(double x) { return x - std::floor(x); }
+
+// A 64 * 64 tileable blue noise threshold mask with values in (0, 1), made
+// with the void-and-cluster method (Ulichney 1993). The energy of a cell is
+// a toroidal gaussian sum over the set cells around it.
+std::vector<float> make_blue_noise_mask(int n, double sigma, uint64_t seed) {
+    int size = n * n;
+    std::vector<double> kernel(size);
+    for (int dy = 0; dy < n; dy++) {
+        for (int dx = 0; dx < n; dx++) {
+            int x = std::min(dx, n - dx), y = std::min(dy, n - dy);
+            kernel[dy * n + dx] =
+                std::exp(-(x * x + y * y) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<char> on(size, 0);
+    std::vector<double> energy(size, 0);
+    auto toggle = [&](int p) {
+        double sign = on[p] ? -1 : 1;
+        on[p] = !on[p];
+        int px = p % n, py = p / n;
+        for (int y = 0; y < n; y++) {
+            const double* row = &kernel[((y - py + n) % n) * n];
+            for (int x = 0; x < n; x++)
+                energy[y * n + x] += sign * row[(x - px + n) % n];
+        }
+    };
+    // the set cell with the most neighbours, or the empty cell with fewest
+    auto tightest_cluster = [&]() {
+        int best = -1;
+        for (int p = 0; p < size; p++)
+            if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+        return best;
+    };
+    auto largest_void = [&]() {
+        int best = -1;
+        for (int p = 0; p < size; p++)
+            if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+        return best;
+    };
+
+    // start from a random pattern and move points out of clusters into
+    // voids until it is evenly spread
+    pcg32 rng(seed, 0);
+    int initial = size / 10;
+    for (int k = 0; k < initial;) {
+        int p = rng.next_uint() % size;
+        if (on[p]) continue;
+        toggle(p);
+        k++;
+    }
+    for (int iteration = 0; iteration < size; iteration++) {
+        int cluster = tightest_cluster();
+        toggle(cluster);
+        int hole = largest_void();
+        toggle(hole);
+        if (hole == cluster) break;
+    }
+
+    std::vector<int> rank(size);
+    auto initial_on = on;
+    auto initial_energy = energy;
+    // the initial points are ranked by removing the tightest cluster first
+    for (int r = initial - 1; r >= 0; r--) {
+        int cluster = tightest_cluster();
+        toggle(cluster);
+        rank[cluster] = r;
+    }
+    // and the others by filling the largest void first
+    on = initial_on;
+    energy = initial_energy;
+    for (int r = initial; r < size; r++) {
+        int hole = largest_void();
+        toggle(hole);
+        rank[hole] = r;
+    }
+
+    std::vector<float> mask(size);
+    for (int p = 0; p < size; p++) mask[p] = (rank[p] + 0.5f) / size;
+    return mask;
+}
+
+const int blue_noise_size = 64;
+
+const std::vector<float>& blue_noise_mask() {
+    static const std::vector<float> mask =
+        make_blue_noise_mask(blue_noise_size, 1.5, 0x5eed);
+    return mask;
+}
+
+// independent: uniform random numbers
+// halton: Halton sequence with a random shift per pixel
+// sobol: Owen-scrambled Sobol sequence, shuffled per pixel
+// blue_noise: Sobol sequence shifted by a blue noise mask, so at low sample
+//   counts the error is high frequency noise that the eye barely notices
+enum class sampler_type { independent, halton, sobol, blue_noise };
+
+// Parses a sampler name, returns false if it is unknown
+bool parse_sampler_type(const std::string& name, sampler_type& type) {
+    if (name == "independent")
+        type = sampler_type::independent;
+    else if (name == "halton")
+        type = sampler_type::halton;
+    else if (name == "sobol")
+        type = sampler_type::sobol;
+    else if (name == "blue-noise")
+        type = sampler_type::blue_noise;
+    else
+        return false;
+    return true;
+}
+
+// Produces the samples of one pixel. The first dimensions of every sample
+// (pixel jitter, then lens position) come from the chosen sequence, the
+// rest of the path draws from random_double(), which is reseeded for every
+// sample.
+class pixel_sampler {
+   public:
+    pixel_sampler() {}
+    pixel_sampler(sampler_type type, int i, int j, int w, uint64_t seed)
+        : type(type),
+          x(i),
+          y(j),
+          pixel(static_cast<uint32_t>(j) * w + i),
+          seed(seed) {}
+
+    // Starts sample `index` of the pixel
+    void start_sample(uint32_t index) {
+        sample = index;
+        dimension = 0;
+        seed_sample(seed, pixel, index);
+    }
+
+    // Returns the next two dimensions of the current sample in [0,1)
+    void next_2d(double& u, double& v) {
+        int d = dimension++;
+        switch (type) {
+            case sampler_type::independent:
+                u = thread_rng().next_double();
+                v = thread_rng().next_double();
+                return;
+            case sampler_type::halton: {
+                static const uint32_t primes[] = {2, 3, 5, 7, 11, 13, 17, 19};
+                if (d >= 4) break;
+                uint64_t shift = mix_bits(seed ^ mix_bits(pixel * 4ULL + d));
+                u = fraction(radical_inverse(primes[2 * d], sample) +
+                             (shift & 0xffffffff) * 0x1p-32);
+                v = fraction(radical_inverse(primes[2 * d + 1], sample) +
+                             (shift >> 32) * 0x1p-32);
+                return;
+            }
+            case sampler_type::sobol: {
+                // every dimension pair gets its own shuffle and scramble
+                uint64_t hash = mix_bits(seed ^ mix_bits(pixel * 4ULL + d));
+                uint32_t index = nested_uniform_scramble(sample, hash);
+                uint64_t scramble = mix_bits(hash);
+                u = nested_uniform_scramble(sobol_dim0(index), scramble) *
+                    0x1p-32;
+                v = nested_uniform_scramble(sobol_dim1(index),
+                                            scramble >> 32) *
+                    0x1p-32;
+                return;
+            }
+            case sampler_type::blue_noise: {
+                const auto& mask = blue_noise_mask();
+                const int n = blue_noise_size;
+                // every dimension pair shuffles the sequence the same way in
+                // all pixels, so only the mask decorrelates the pixels
+                uint32_t index = sample;
+                if (d > 0)
+                    index = nested_uniform_scramble(sample, mix_bits(seed + d));
+                // and reads the mask at different offsets
+                int ox = (x + 17 * (2 * d)) % n, oy = (y + 41 * (2 * d)) % n;
+                int px = (x + 17 * (2 * d + 1)) % n,
+                    py = (y + 41 * (2 * d + 1)) % n;
+                u = fraction(sobol_dim0(index) * 0x1p-32 + mask[oy * n + ox]);
+                v = fraction(sobol_dim1(index) * 0x1p-32 + mask[py * n + px]);
+                return;
+            }
+        }
+        u = thread_rng().next_double();
+        v = thread_rng().next_double();
+    }
+
+   private:
+    sampler_type type = sampler_type::independent;
+    int x = 0, y = 0;
+    uint32_t pixel = 0;
+    uint64_t seed = 0;
+    uint32_t sample = 0;
+    int dimension = 0;
+};
+
+#endif
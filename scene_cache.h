@@ -0,0 +1,355 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "baked_scene.h"
+#include "light.h"
+#include "material.h"
+#include "scene_file.h"
+#include "scenes.h"
+
+// Binary scene caches: a baked scene with its BVH, materials, camera and
+// settings, written once and then memory-mapped. The arrays of the baked
+// scene are traced where they lie in the mapping, so loading costs the
+// page faults of what the rays touch instead of parsing and building.
+//
+// Layout: the header, then the nodes, the sphere arrays cx, cy, cz and
+// radius, the material ids, the materials, the camera keyframes and the
+// path of the environment map, each 64-byte aligned. The map itself is
+// read again from its file. A cache is tied to the canonical path, size
+// and modification time of its scene file and to the precision of the
+// build.
+
+// Identifies the scene file a cache was made from, zeros for the built-in
+// scene
+struct scene_stamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;  // nanoseconds
+    uint64_t path = 0;  // FNV-1a hash of the canonical path
+
+    bool operator==(const scene_stamp& other) const {
+        return size == other.size && mtime == other.mtime &&
+               path == other.path;
+    }
+};
+
+// Stamp of the file at path, or of the built-in scene if path is empty
+bool stamp_scene_file(const std::string& path, scene_stamp& stamp) {
+    stamp = scene_stamp();
+    if (path.empty()) return true;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    stamp.size = st.st_size;
+    stamp.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                  st.st_mtim.tv_nsec;
+    std::string canonical;
+    if (!canonical_path(path, canonical)) return false;
+    stamp.path = fnv1a(canonical.data(), canonical.size());
+    return true;
+}
+
+struct scene_cache_header {
+    char magic[8];       // "RTSCN07"
+    uint32_t real_size;  // sizeof(real) of the build that baked it
+    uint32_t node_size;
+    scene_stamp source;
+    uint64_t node_count;
+    uint64_t sphere_count;
+    uint64_t material_count;
+    int32_t width, height, samples_per_pixel;
+    int32_t keyframe_count;
+    double view[12];  // see pack_view
+    double shutter[2];  // open, close
+    uint32_t environment_length;  // of the path, none without a map
+    uint32_t reserved;
+    double environment_scale;
+};
+
+// A camera keyframe of the cache, view like the header's
+struct cached_keyframe {
+    int64_t frame;
+    double view[12];
+};
+
+// A material of the cache, params depend on its kind: albedo for
+// lambertian, albedo and fuzz for metal, the refractive index for
+// dielectric, the emitted color for light
+struct cached_material {
+    uint32_t kind;
+    uint32_t reserved;
+    double params[4];
+};
+
+// Where the sections of a cache start, and its size
+struct scene_cache_layout {
+    size_t nodes, cx, cy, cz, radius, material_id, materials, keyframes,
+        environment, size;
+
+    scene_cache_layout(const scene_cache_header& h) {
+        auto align = [](size_t offset) { return (offset + 63) / 64 * 64; };
+        nodes = align(sizeof(h));
+        cx = align(nodes + h.node_count * sizeof(baked_scene::node));
+        cy = align(cx + h.sphere_count * sizeof(real));
+        cz = align(cy + h.sphere_count * sizeof(real));
+        radius = align(cz + h.sphere_count * sizeof(real));
+        material_id = align(radius + h.sphere_count * sizeof(real));
+        materials = align(material_id + h.sphere_count * sizeof(uint32_t));
+        keyframes =
+            align(materials + h.material_count * sizeof(cached_material));
+        environment =
+            align(keyframes + h.keyframe_count * sizeof(cached_keyframe));
+        size = environment + h.environment_length;
+    }
+};
+
+scene_cache_header make_scene_cache_header(const scene_description& scene,
+                                           const baked_scene& baked,
+                                           const scene_stamp& source) {
+    scene_cache_header h = {};
+    std::memcpy(h.magic, "RTSCN07", 8);
+    h.real_size = sizeof(real);
+    h.node_size = sizeof(baked_scene::node);
+    h.source = source;
+    h.node_count = baked.baked().node_count;
+    h.sphere_count = baked.sphere_count();
+    h.material_count = baked.material_count();
+    h.width = scene.width;
+    h.height = scene.height;
+    h.samples_per_pixel = scene.samples_per_pixel;
+    h.keyframe_count = scene.keys.size();
+    h.shutter[0] = scene.shutter_open;
+    h.shutter[1] = scene.shutter_close;
+    if (scene.environment)
+        h.environment_length = scene.environment_path.size();
+    h.environment_scale = scene.environment_scale;
+    pack_view(scene.view, h.view);
+    return h;
+}
+
+// Writes the baked scene and the settings of scene to a cache at path,
+// returns false if it cannot be written or has materials of other kinds
+// than lambertian, metal, dielectric and light
+bool save_scene_cache(const std::string& path, const scene_description& scene,
+                      const baked_scene& baked, const scene_stamp& source) {
+    auto header = make_scene_cache_header(scene, baked, source);
+    scene_cache_layout layout(header);
+    std::vector<cached_material> materials;
+    for (const material* m : baked.material_table()) {
+        cached_material c;
+        std::memset(&c, 0, sizeof(c));
+        c.kind = static_cast<uint32_t>(m->kind);
+        if (m->kind == material_kind::lambertian) {
+            auto& a = static_cast<const lambertian*>(m)->albedo;
+            c.params[0] = a.x(), c.params[1] = a.y(), c.params[2] = a.z();
+        } else if (m->kind == material_kind::metal) {
+            auto mm = static_cast<const metal*>(m);
+            c.params[0] = mm->albedo.x(), c.params[1] = mm->albedo.y();
+            c.params[2] = mm->albedo.z(), c.params[3] = mm->fuzz;
+        } else if (m->kind == material_kind::dielectric) {
+            c.params[0] = static_cast<const dielectric*>(m)->ref_idx;
+        } else if (m->kind == material_kind::light) {
+            auto& e = static_cast<const diffuse_light*>(m)->emit;
+            c.params[0] = e.x(), c.params[1] = e.y(), c.params[2] = e.z();
+        } else {
+            std::cerr << "Cannot cache a material of kind "
+                      << material_kind_name(m->kind) << "\n";
+            return false;
+        }
+        materials.push_back(c);
+    }
+    std::vector<cached_keyframe> keyframes(scene.keys.size());
+    for (size_t k = 0; k < keyframes.size(); k++) {
+        keyframes[k].frame = scene.keys[k].frame;
+        pack_view(scene.keys[k].view, keyframes[k].view);
+    }
+
+    // written next to the cache and renamed over it, a reader never maps
+    // half a file
+    auto tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out) {
+        std::cerr << "Cannot open " << tmp << "\n";
+        return false;
+    }
+    const auto& a = baked.baked();
+    auto section = [&](size_t offset, const void* data, size_t size) {
+        static const char zeros[64] = {};
+        out.write(zeros, offset - out.tellp());
+        out.write(static_cast<const char*>(data), size);
+    };
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    section(layout.nodes, a.nodes, a.node_count * sizeof(baked_scene::node));
+    section(layout.cx, a.cx, a.sphere_count * sizeof(real));
+    section(layout.cy, a.cy, a.sphere_count * sizeof(real));
+    section(layout.cz, a.cz, a.sphere_count * sizeof(real));
+    section(layout.radius, a.radius, a.sphere_count * sizeof(real));
+    section(layout.material_id, a.material_id,
+            a.sphere_count * sizeof(uint32_t));
+    section(layout.materials, materials.data(),
+            materials.size() * sizeof(cached_material));
+    section(layout.keyframes, keyframes.data(),
+            keyframes.size() * sizeof(cached_keyframe));
+    section(layout.environment, scene.environment_path.data(),
+            header.environment_length);
+    if (!out.flush()) {
+        std::cerr << "Cannot write " << tmp << "\n";
+        return false;
+    }
+    out.close();
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Cannot rename " << tmp << " to " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+// The mapping of a loaded cache and the materials rebuilt from it, alive
+// as long as a baked scene traces them
+struct mapped_scene_cache {
+    void* data = MAP_FAILED;
+    size_t size = 0;
+    std::vector<lambertian> lambertians;
+    std::vector<metal> metals;
+    std::vector<dielectric> dielectrics;
+    std::vector<diffuse_light> lights;
+
+    ~mapped_scene_cache() {
+        if (data != MAP_FAILED) munmap(data, size);
+    }
+};
+
+// Maps the cache at path into baked and reads its settings into scene
+// (whose world stays empty). Returns false without a message if the file
+// does not exist or was made from another source, by another build or by
+// another version, and with one if it is damaged.
+bool load_scene_cache(const std::string& path, const scene_stamp& source,
+                      scene_description& scene, baked_scene& baked) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    auto cache = std::make_shared<mapped_scene_cache>();
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(scene_cache_header)) {
+        cache->size = st.st_size;
+        cache->data = mmap(nullptr, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (cache->data == MAP_FAILED) {
+        std::cerr << "Cannot map " << path << "\n";
+        return false;
+    }
+    auto bytes = static_cast<const unsigned char*>(cache->data);
+    scene_cache_header header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, "RTSCN", 5) != 0) {
+        std::cerr << path << " is not a scene cache\n";
+        return false;
+    }
+    // a cache of an older version is made again
+    if (std::memcmp(header.magic, "RTSCN07", 8) != 0 ||
+        header.real_size != sizeof(real) ||
+        header.node_size != sizeof(baked_scene::node) ||
+        !(header.source == source))
+        return false;
+    scene_cache_layout layout(header);
+    if (layout.size > cache->size) {
+        std::cerr << path << " is truncated\n";
+        return false;
+    }
+
+    auto materials =
+        reinterpret_cast<const cached_material*>(bytes + layout.materials);
+    auto count = [&](material_kind kind) {
+        size_t n = 0;
+        for (size_t k = 0; k < header.material_count; k++)
+            n += materials[k].kind == static_cast<uint32_t>(kind);
+        return n;
+    };
+    // reserved up front, the table points into the vectors
+    cache->lambertians.reserve(count(material_kind::lambertian));
+    cache->metals.reserve(count(material_kind::metal));
+    cache->dielectrics.reserve(count(material_kind::dielectric));
+    cache->lights.reserve(count(material_kind::light));
+    std::vector<const material*> table;
+    table.reserve(header.material_count);
+    for (size_t k = 0; k < header.material_count; k++) {
+        const double* p = materials[k].params;
+        switch (static_cast<material_kind>(materials[k].kind)) {
+            case material_kind::lambertian:
+                cache->lambertians.emplace_back(color(p[0], p[1], p[2]));
+                table.push_back(&cache->lambertians.back());
+                break;
+            case material_kind::metal:
+                cache->metals.emplace_back(color(p[0], p[1], p[2]), p[3]);
+                table.push_back(&cache->metals.back());
+                break;
+            case material_kind::dielectric:
+                cache->dielectrics.emplace_back(p[0]);
+                table.push_back(&cache->dielectrics.back());
+                break;
+            case material_kind::light:
+                cache->lights.emplace_back(color(p[0], p[1], p[2]));
+                table.push_back(&cache->lights.back());
+                break;
+            default:
+                std::cerr << path << " has an unknown material\n";
+                return false;
+        }
+    }
+
+    baked_scene::arrays a;
+    a.nodes = reinterpret_cast<const baked_scene::node*>(bytes + layout.nodes);
+    a.node_count = header.node_count;
+    a.cx = reinterpret_cast<const real*>(bytes + layout.cx);
+    a.cy = reinterpret_cast<const real*>(bytes + layout.cy);
+    a.cz = reinterpret_cast<const real*>(bytes + layout.cz);
+    a.radius = reinterpret_cast<const real*>(bytes + layout.radius);
+    a.sphere_count = header.sphere_count;
+    a.material_id =
+        reinterpret_cast<const uint32_t*>(bytes + layout.material_id);
+    baked.adopt(a, std::move(table), cache);
+
+    scene.world.clear();
+    scene.width = header.width;
+    scene.height = header.height;
+    scene.samples_per_pixel = header.samples_per_pixel;
+    scene.view = unpack_view(header.view);
+    scene.shutter_open = header.shutter[0];
+    scene.shutter_close = header.shutter[1];
+    auto keyframes =
+        reinterpret_cast<const cached_keyframe*>(bytes + layout.keyframes);
+    scene.keys.clear();
+    for (int k = 0; k < header.keyframe_count; k++)
+        scene.keys.push_back(camera_keyframe{
+            static_cast<int>(keyframes[k].frame),
+            unpack_view(keyframes[k].view)});
+    scene.environment.reset();
+    scene.environment_path.assign(
+        reinterpret_cast<const char*>(bytes + layout.environment),
+        header.environment_length);
+    scene.environment_scale = header.environment_scale;
+    if (header.environment_length > 0) {
+        auto map = std::make_shared<environment_map>();
+        if (!map->load(scene.environment_path, scene.environment_scale))
+            return false;
+        scene.environment = map;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,521 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+#include "common.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "light.h"
+#include "material.h"
+#include "mesh_file.h"
+#include "scenes.h"
+#include "sphere.h"
+
+// Text scene files. Every line is a statement, words are separated by
+// blanks and # starts a comment:
+//
+//   image WIDTH HEIGHT
+//   spp SAMPLES
+//   camera FROM_X FROM_Y FROM_Z AT_X AT_Y AT_Z UP_X UP_Y UP_Z VFOV APERTURE
+//          FOCUS_DIST                                       (on one line)
+//   keyframe FRAME FROM_X ... FOCUS_DIST    (the camera at a frame of an
+//                                            animation, frames ascending)
+//   shutter OPEN CLOSE           (frames from the start of a frame)
+//   material NAME lambertian R G B
+//   material NAME metal R G B FUZZ
+//   material NAME dielectric INDEX
+//   material NAME light R G B    (gives off light, and is sampled as a
+//                                 light on spheres)
+//   environment PATH [SCALE]     (a latitude-longitude PFM image lighting
+//                                 the scene instead of the sky, relative
+//                                 to the scene)
+//   sphere X Y Z RADIUS MATERIAL
+//   moving_sphere RADIUS MATERIAL TIME X Y Z [TIME X Y Z...]
+//                                (the center at frame times, ascending)
+//   mesh PATH MATERIAL           (an OBJ or PLY file, relative to the scene)
+//   prototype NAME               (the objects up to the matching "end" are
+//   end                           defined once, and placed by instances)
+//   instance NAME [translate X Y Z] [rotate AXIS_X AXIS_Y AXIS_Z DEGREES]
+//                 [scale X Y Z] [material MATERIAL]
+//
+// A material or prototype is defined before the objects that use it. The
+// transforms of an instance apply in the order written. Statements left
+// out keep the values of random_scene_description().
+
+// Reads the words and numbers of a scene file in place. Errors count lines
+// from first_line, for text that is a part of its source.
+class scene_parser {
+   public:
+    scene_parser(const std::string& path, const std::string& text,
+                 int first_line = 1)
+        : path(path),
+          begin(text.c_str()),
+          p(begin),
+          end(begin + text.size()),
+          first_line(first_line) {}
+
+    // Moves to the next statement, returns false at the end of the file
+    bool next_line() {
+        while (p < end) {
+            skip_blanks();
+            if (p < end && *p != '\n' && *p != '#') return true;
+            skip_line();
+        }
+        return false;
+    }
+
+    // Returns whether the statement has no words left
+    bool at_line_end() {
+        skip_blanks();
+        return p >= end || *p == '\n' || *p == '#';
+    }
+
+    bool word(std::string& w) {
+        if (at_line_end()) return error("missing word");
+        auto start = p;
+        while (p < end && !is_blank(*p) && *p != '\n' && *p != '#') p++;
+        w.assign(start, p);
+        return true;
+    }
+
+    bool number(double& x) {
+        if (at_line_end()) return error("missing number");
+        char* after;
+        x = std::strtod(p, &after);
+        if (after == p || (after < end && !is_blank(*after) &&
+                           *after != '\n' && *after != '#'))
+            return error("invalid number");
+        p = after;
+        return true;
+    }
+
+    bool integer(int& n) {
+        double x;
+        if (!number(x)) return false;
+        // converting a double out of the range of int is undefined
+        if (!(x >= 1 && x <= std::numeric_limits<int>::max()) ||
+            x != std::floor(x))
+            return error("expected a positive integer");
+        n = static_cast<int>(x);
+        return true;
+    }
+
+    bool vector(vec3& v) {
+        double x, y, z;
+        if (!number(x) || !number(y) || !number(z)) return false;
+        v = vec3(x, y, z);
+        return true;
+    }
+
+    // Ends the statement, which must have no words left
+    bool done() {
+        if (!at_line_end()) return error("unexpected words");
+        skip_line();
+        return true;
+    }
+
+    // Prints message at the current line, returns false
+    bool error(const std::string& message) {
+        int line = first_line;
+        for (auto c = begin; c < p && c < end; c++)
+            line += *c == '\n';
+        std::cerr << path << ":" << line << ": " << message << "\n";
+        return false;
+    }
+
+   private:
+    static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    void skip_blanks() {
+        while (p < end && is_blank(*p)) p++;
+    }
+    void skip_line() {
+        while (p < end && *p != '\n') p++;
+        if (p < end) p++;
+    }
+
+    std::string path;
+    const char* begin;
+    const char* p;  // the next character to read
+    const char* end;
+    int first_line;
+};
+
+// A file named in the scene file at scene, relative to its directory
+std::string relative_path(const std::string& scene, const std::string& file) {
+    auto slash = scene.rfind('/');
+    if (file[0] == '/' || slash == std::string::npos) return file;
+    return scene.substr(0, slash + 1) + file;
+}
+
+// The absolute path of path with no links, dots or repeated slashes.
+// Returns false if it does not exist.
+bool canonical_path(const std::string& path, std::string& canonical) {
+    char buffer[PATH_MAX];
+    if (!realpath(path.c_str(), buffer)) {
+        std::cerr << "Cannot resolve " << path << "\n";
+        return false;
+    }
+    canonical = buffer;
+    return true;
+}
+
+// Reads the scene file at path into scene, returns false on an error
+bool load_scene(const std::string& path, scene_description& scene) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    // the whole file in one read, parsed in place
+    std::string text(static_cast<size_t>(in.tellg()), '\0');
+    in.seekg(0);
+    if (!in.read(&text[0], text.size())) {
+        std::cerr << "Cannot read " << path << "\n";
+        return false;
+    }
+
+    // the defaults of random_scene_description(), without its spheres
+    scene = scene_description();
+    scene.view = random_scene_view();
+    // everything the scene defines lives as long as its world
+    auto arena = make_shared<scene_arena>();
+    std::unordered_map<std::string, shared_ptr<material>> materials;
+    // objects go to the innermost prototype being defined, or the world
+    struct group {
+        std::string name;
+        hittable_list objects;
+        shared_ptr<instance_set> instances;
+    };
+    std::vector<group> groups;
+    auto begin_group = [&](const std::string& name) {
+        groups.push_back(group());
+        groups.back().name = name;
+        groups.back().instances = arena->make<instance_set>();
+    };
+    begin_group("");
+    std::unordered_map<std::string, shared_ptr<hittable>> prototypes;
+    // the instances of a group under their own BVH, next to its objects
+    auto close = [](group& g) {
+        if (g.instances->size() == 0) return;
+        g.instances->build();
+        g.objects.add(g.instances);
+    };
+    scene_parser parser(path, text);
+    std::string statement, name, kind;
+    while (parser.next_line()) {
+        if (!parser.word(statement)) return false;
+        if (statement == "sphere") {
+            vec3 center;
+            double radius;
+            if (!parser.vector(center) || !parser.number(radius) ||
+                !parser.word(name))
+                return false;
+            auto found = materials.find(name);
+            if (found == materials.end())
+                return parser.error("unknown material " + name);
+            groups.back().objects.add(
+                arena->make<sphere>(center, radius, found->second));
+        } else if (statement == "moving_sphere") {
+            double radius;
+            if (!parser.number(radius) || !parser.word(name)) return false;
+            auto found = materials.find(name);
+            if (found == materials.end())
+                return parser.error("unknown material " + name);
+            std::vector<moving_sphere::key> keys;
+            do {
+                moving_sphere::key key;
+                if (!parser.number(key.time) || !parser.vector(key.center))
+                    return false;
+                if (!keys.empty() && key.time <= keys.back().time)
+                    return parser.error("keys out of order");
+                keys.push_back(key);
+            } while (!parser.at_line_end());
+            groups.back().objects.add(arena->make<moving_sphere>(
+                std::move(keys), radius, found->second));
+        } else if (statement == "mesh") {
+            std::string file;
+            if (!parser.word(file) || !parser.word(name)) return false;
+            auto found = materials.find(name);
+            if (found == materials.end())
+                return parser.error("unknown material " + name);
+            file = relative_path(path, file);
+            auto mesh = arena->make<triangle_mesh>(found->second);
+            if (!load_mesh(file, *mesh)) return false;
+            groups.back().objects.add(mesh);
+        } else if (statement == "prototype") {
+            if (!parser.word(name)) return false;
+            if (prototypes.count(name))
+                return parser.error("prototype " + name + " defined twice");
+            begin_group(name);
+        } else if (statement == "end") {
+            if (groups.size() == 1) return parser.error("end of nothing");
+            group& g = groups.back();
+            close(g);
+            if (g.objects.objects.empty())
+                return parser.error("empty prototype " + g.name);
+            // a single object needs no BVH of its own
+            prototypes[g.name] = g.objects.objects.size() == 1
+                                     ? g.objects.objects[0]
+                                     : arena->make<bvh_node>(g.objects);
+            groups.pop_back();
+        } else if (statement == "instance") {
+            if (!parser.word(name)) return false;
+            auto prototype = prototypes.find(name);
+            if (prototype == prototypes.end())
+                return parser.error("unknown prototype " + name);
+            affine_transform to_world;
+            shared_ptr<material> m;
+            std::string op;
+            while (!parser.at_line_end()) {
+                vec3 v;
+                double degrees;
+                if (!parser.word(op)) return false;
+                if (op == "translate") {
+                    if (!parser.vector(v)) return false;
+                    to_world = affine_transform::translate(v) * to_world;
+                } else if (op == "rotate") {
+                    if (!parser.vector(v) || !parser.number(degrees))
+                        return false;
+                    to_world = affine_transform::rotate(v, degrees) * to_world;
+                } else if (op == "scale") {
+                    if (!parser.vector(v)) return false;
+                    to_world = affine_transform::scale(v) * to_world;
+                } else if (op == "material") {
+                    if (!parser.word(op)) return false;
+                    auto found = materials.find(op);
+                    if (found == materials.end())
+                        return parser.error("unknown material " + op);
+                    m = found->second;
+                } else {
+                    return parser.error("unknown transform " + op);
+                }
+            }
+            if (!groups.back().instances->add(
+                    instance(prototype->second, to_world, m)))
+                return parser.error("singular transform");
+        } else if (statement == "material") {
+            if (!parser.word(name) || !parser.word(kind)) return false;
+            vec3 albedo;
+            double x;
+            if (kind == "lambertian") {
+                if (!parser.vector(albedo)) return false;
+                materials[name] = arena->make<lambertian>(albedo);
+            } else if (kind == "metal") {
+                if (!parser.vector(albedo) || !parser.number(x)) return false;
+                materials[name] = arena->make<metal>(albedo, x);
+            } else if (kind == "dielectric") {
+                if (!parser.number(x)) return false;
+                materials[name] = arena->make<dielectric>(x);
+            } else if (kind == "light") {
+                if (!parser.vector(albedo)) return false;
+                materials[name] = arena->make<diffuse_light>(albedo);
+            } else {
+                return parser.error("unknown material kind " + kind);
+            }
+        } else if (statement == "camera") {
+            auto& v = scene.view;
+            if (!parser.vector(v.lookfrom) || !parser.vector(v.lookat) ||
+                !parser.vector(v.vup) || !parser.number(v.vfov) ||
+                !parser.number(v.aperture) || !parser.number(v.focus_dist))
+                return false;
+        } else if (statement == "keyframe") {
+            double frame;
+            camera_keyframe key;
+            auto& v = key.view;
+            if (!parser.number(frame) || !parser.vector(v.lookfrom) ||
+                !parser.vector(v.lookat) || !parser.vector(v.vup) ||
+                !parser.number(v.vfov) || !parser.number(v.aperture) ||
+                !parser.number(v.focus_dist))
+                return false;
+            if (!(frame >= 0 && frame <= std::numeric_limits<int>::max()) ||
+                frame != std::floor(frame))
+                return parser.error("expected a frame number");
+            key.frame = static_cast<int>(frame);
+            if (!scene.keys.empty() && key.frame <= scene.keys.back().frame)
+                return parser.error("keyframes out of order");
+            scene.keys.push_back(key);
+        } else if (statement == "shutter") {
+            if (!parser.number(scene.shutter_open) ||
+                !parser.number(scene.shutter_close))
+                return false;
+            if (scene.shutter_close < scene.shutter_open)
+                return parser.error("shutter closes before it opens");
+        } else if (statement == "environment") {
+            std::string file;
+            double scale = 1;
+            if (!parser.word(file)) return false;
+            if (!parser.at_line_end() && !parser.number(scale)) return false;
+            auto map = make_shared<environment_map>();
+            if (!map->load(relative_path(path, file), scale)) return false;
+            scene.environment = map;
+            // absolute, so that saved scenes and caches find it from
+            // anywhere
+            if (!canonical_path(relative_path(path, file),
+                                scene.environment_path))
+                return false;
+            scene.environment_scale = scale;
+        } else if (statement == "image") {
+            if (!parser.integer(scene.width) || !parser.integer(scene.height))
+                return false;
+        } else if (statement == "spp") {
+            if (!parser.integer(scene.samples_per_pixel)) return false;
+        } else {
+            return parser.error("unknown statement " + statement);
+        }
+        if (!parser.done()) return false;
+    }
+    if (groups.size() > 1)
+        return parser.error("prototype " + groups.back().name + " has no end");
+    close(groups[0]);
+    scene.world = groups[0].objects;
+    scene.world.owner = arena;
+    return true;
+}
+
+// FNV-1a hash of size bytes at data, continuing hash
+const uint64_t fnv_offset_basis = 14695981039346656037ull;
+uint64_t fnv1a(const void* data, size_t size,
+               uint64_t hash = fnv_offset_basis) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t k = 0; k < size; k++) {
+        hash ^= bytes[k];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hashes the bytes of the scene file (FNV-1a), zero for the built-in scene
+bool fingerprint_scene_file(const std::string& path, uint64_t& fingerprint) {
+    fingerprint = 0;
+    if (path.empty()) return true;
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    fingerprint = fnv_offset_basis;
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+        fingerprint = fnv1a(buffer, file.gcount(), fingerprint);
+    return true;
+}
+
+// Hashes the camera of a frame of scene, where its shutter opens and
+// closes
+uint64_t fingerprint_frame_view(const scene_description& scene, int frame) {
+    uint64_t fingerprint = fnv_offset_basis;
+    for (double time : {frame + scene.shutter_open,
+                        frame + scene.shutter_close}) {
+        double view[12];
+        pack_view(scene.view_at(time), view);
+        fingerprint = fnv1a(view, sizeof(view), fingerprint);
+    }
+    return fingerprint;
+}
+
+// Writes scene as a scene file, returns false if it has objects other
+// than spheres or materials of other kinds than the file knows
+bool save_scene(const std::string& path, const scene_description& scene) {
+    std::FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    const auto& v = scene.view;
+    std::fprintf(out, "image %d %d\nspp %d\n", scene.width, scene.height,
+                 scene.samples_per_pixel);
+    // enough digits to read back the same doubles
+    std::fprintf(out,
+                 "camera %.17g %.17g %.17g  %.17g %.17g %.17g  %.17g %.17g "
+                 "%.17g  %.17g %.17g %.17g\n",
+                 v.lookfrom.x(), v.lookfrom.y(), v.lookfrom.z(), v.lookat.x(),
+                 v.lookat.y(), v.lookat.z(), v.vup.x(), v.vup.y(), v.vup.z(),
+                 v.vfov, v.aperture, v.focus_dist);
+    for (const auto& key : scene.keys) {
+        const auto& k = key.view;
+        std::fprintf(out,
+                     "keyframe %d  %.17g %.17g %.17g  %.17g %.17g %.17g  "
+                     "%.17g %.17g %.17g  %.17g %.17g %.17g\n",
+                     key.frame, k.lookfrom.x(), k.lookfrom.y(),
+                     k.lookfrom.z(), k.lookat.x(), k.lookat.y(),
+                     k.lookat.z(), k.vup.x(), k.vup.y(), k.vup.z(), k.vfov,
+                     k.aperture, k.focus_dist);
+    }
+    if (scene.shutter_open != 0 || scene.shutter_close != 0)
+        std::fprintf(out, "shutter %.17g %.17g\n", scene.shutter_open,
+                     scene.shutter_close);
+    if (scene.environment)
+        std::fprintf(out, "environment %s %.17g\n",
+                     scene.environment_path.c_str(), scene.environment_scale);
+    std::unordered_map<const material*, int> names;
+    bool ok = true;
+    for (const auto& object : scene.world.objects) {
+        auto s = dynamic_cast<const sphere*>(object.get());
+        auto moving = dynamic_cast<const moving_sphere*>(object.get());
+        if (!s && !moving) {
+            std::cerr << "Only scenes of spheres can be saved\n";
+            ok = false;
+            break;
+        }
+        const material* m = s ? s->mat_ptr.get() : moving->mat_ptr.get();
+        auto found = names.find(m);
+        if (found == names.end()) {
+            int id = names.size();
+            found = names.emplace(m, id).first;
+            if (m->kind == material_kind::lambertian) {
+                auto& a = static_cast<const lambertian*>(m)->albedo;
+                std::fprintf(out, "material m%d lambertian %.17g %.17g %.17g\n",
+                             id, a.x(), a.y(), a.z());
+            } else if (m->kind == material_kind::metal) {
+                auto mm = static_cast<const metal*>(m);
+                std::fprintf(out,
+                             "material m%d metal %.17g %.17g %.17g %.17g\n",
+                             id, mm->albedo.x(), mm->albedo.y(),
+                             mm->albedo.z(), mm->fuzz);
+            } else if (m->kind == material_kind::dielectric) {
+                std::fprintf(out, "material m%d dielectric %.17g\n", id,
+                             static_cast<const dielectric*>(m)->ref_idx);
+            } else if (m->kind == material_kind::light) {
+                auto& e = static_cast<const diffuse_light*>(m)->emit;
+                std::fprintf(out, "material m%d light %.17g %.17g %.17g\n",
+                             id, e.x(), e.y(), e.z());
+            } else {
+                std::cerr << "Scene files cannot hold a material of kind "
+                          << material_kind_name(m->kind) << "\n";
+                ok = false;
+                break;
+            }
+        }
+        if (s) {
+            std::fprintf(out, "sphere %.17g %.17g %.17g %.17g m%d\n",
+                         s->center.x(), s->center.y(), s->center.z(),
+                         s->radius, found->second);
+            continue;
+        }
+        std::fprintf(out, "moving_sphere %.17g m%d", moving->radius,
+                     found->second);
+        for (const auto& k : moving->keys)
+            std::fprintf(out, "  %.17g %.17g %.17g %.17g", k.time,
+                         k.center.x(), k.center.y(), k.center.z());
+        std::fprintf(out, "\n");
+    }
+    if (std::fclose(out) != 0 && ok) {
+        std::cerr << "Cannot write " << path << "\n";
+        ok = false;
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "camera.h"
+#include "common.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+class environment_map;
+
+// The final scene of Ray Tracing in One Weekend: a field of small random
+// spheres around three big ones. The small spheres fill a grid of
+// (2 * extent)^2 cells, 11 in the book. They are drawn from the calling
+// thread's generator restarted for seed, 0 being its default state, so a
+// seed always gives the same scene.
+hittable_list random_scene(uint64_t seed = 0, int extent = 11) {
+    hittable_list world;
+    // one arena for the spheres and materials instead of an allocation each
+    auto arena = make_shared<scene_arena>();
+    world.owner = arena;
+    thread_rng() = seed == 0 ? pcg32() : pcg32(seed, 0);
+
+    auto ground_material = arena->make<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(
+        arena->make<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -extent; a < extent; a++) {
+        for (int b = -extent; b < extent; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2,
+                          b + 0.9 * random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = arena->make<lambertian>(albedo);
+                    world.add(
+                        arena->make<sphere>(center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = arena->make<metal>(albedo, fuzz);
+                    world.add(
+                        arena->make<sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = arena->make<dielectric>(1.5);
+                    world.add(
+                        arena->make<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = arena->make<dielectric>(1.5);
+    world.add(arena->make<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = arena->make<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(arena->make<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = arena->make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena->make<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+// The camera looking at random_scene()
+camera_settings random_scene_view() {
+    point3 lookfrom(13, 2, 3);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    auto dist_to_focus = 10.0;
+    auto aperture = 0.1;
+    return camera_settings{lookfrom, lookat, vup, 20, aperture,
+                           dist_to_focus};
+}
+
+camera random_scene_camera(double aspect_ratio) {
+    return random_scene_view().make(aspect_ratio);
+}
+
+// Everything a render needs besides its options, what a scene file holds
+struct scene_description {
+    hittable_list world;
+    camera_settings view;
+    std::vector<camera_keyframe> keys;  // the camera path of an animation
+    int width = 3840;
+    int height = 2160;
+    int samples_per_pixel = 500;
+    // when the shutter opens and closes, in frames from the frame's start
+    double shutter_open = 0;
+    double shutter_close = 0;
+    // the environment map lighting the scene, the sky gradient if null,
+    // and the absolute path and scale it was loaded with
+    shared_ptr<const environment_map> environment;
+    std::string environment_path;
+    double environment_scale = 1;
+
+    // The camera at a time in frames, view if there is no path
+    camera_settings view_at(double time) const {
+        return keys.empty() ? view : camera_at(keys, time);
+    }
+
+    // The camera of a frame, with its shutter
+    camera frame_camera(int frame, double aspect_ratio) const {
+        double time0 = frame + shutter_open, time1 = frame + shutter_close;
+        auto cam = view_at(time0).make(aspect_ratio);
+        cam.open_shutter(time0, time1, view_at(time1).make(aspect_ratio));
+        return cam;
+    }
+};
+
+// random_scene() in 4K at 500 spp, the scene without a scene file
+scene_description random_scene_description() {
+    scene_description scene;
+    scene.world = random_scene();
+    scene.view = random_scene_view();
+    return scene;
+}
+
+#endif
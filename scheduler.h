@@ -0,0 +1,305 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A rectangle of pixels [x0, x1) * [y0, y1), y grows upwards like in the
+// camera's (u, v) coordinates
+struct tile {
+    int x0, y0, x1, y1;
+
+    int pixel_count() const { return (x1 - x0) * (y1 - y0); }
+};
+
+enum class tile_order { scanline, morton, hilbert };
+
+// Parses "scanline", "morton" or "hilbert", returns false on anything else
+bool parse_tile_order(const std::string& name, tile_order& order) {
+    if (name == "scanline")
+        order = tile_order::scanline;
+    else if (name == "morton")
+        order = tile_order::morton;
+    else if (name == "hilbert")
+        order = tile_order::hilbert;
+    else
+        return false;
+    return true;
+}
+
+// Interleaves the bits of x and y (x in the even bits)
+uint64_t morton_code(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Distance of (x, y) along the Hilbert curve filling an n * n grid, n is a
+// power of two
+uint64_t hilbert_code(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so the sub-curve is in standard orientation
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Splits a w * h image into tiles of tile_size * tile_size pixels (smaller
+// at the right and top borders) and sorts them along the given curve so
+// consecutive tiles are close on screen
+std::vector<tile> make_tiles(int w, int h, int tile_size, tile_order order) {
+    int tiles_x = (w + tile_size - 1) / tile_size;
+    int tiles_y = (h + tile_size - 1) / tile_size;
+    uint32_t n = 1;
+    while (n < static_cast<uint32_t>(std::max(tiles_x, tiles_y))) n *= 2;
+
+    std::vector<std::pair<uint64_t, tile>> keyed;
+    keyed.reserve(tiles_x * tiles_y);
+    for (int ty = tiles_y - 1; ty >= 0; ty--) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            tile t{tx * tile_size, ty * tile_size,
+                   std::min(w, (tx + 1) * tile_size),
+                   std::min(h, (ty + 1) * tile_size)};
+            uint64_t key = keyed.size();
+            if (order == tile_order::morton)
+                key = morton_code(tx, ty);
+            else if (order == tile_order::hilbert)
+                key = hilbert_code(n, tx, ty);
+            keyed.push_back({key, t});
+        }
+    }
+    std::stable_sort(
+        keyed.begin(), keyed.end(),
+        [](const std::pair<uint64_t, tile>& a,
+           const std::pair<uint64_t, tile>& b) { return a.first < b.first; });
+
+    std::vector<tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto& k : keyed) tiles.push_back(k.second);
+    return tiles;
+}
+
+// Number of worker threads to use when none is requested
+int default_thread_count() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Renders a list of tiles on a set of worker threads with work stealing.
+//
+// Every worker owns a contiguous range of tile indices, packed as
+// (begin, end) in one atomic word. The owner pops tiles from the front of
+// its range and an idle worker steals the back half of a victim's range,
+// both with a single compare-and-swap, so no locks are taken while
+// rendering. Since the tiles are sorted along a space-filling curve, both
+// owned and stolen ranges stay compact on screen.
+//
+// The workers are started by the first run and wait for the next one in
+// between, so a scheduler rendering many frames or passes starts its
+// threads once.
+class tile_scheduler {
+   public:
+    explicit tile_scheduler(int thread_cnt = 0)
+        : thread_cnt(thread_cnt > 0 ? thread_cnt : default_thread_count()),
+          ranges(this->thread_cnt) {}
+    ~tile_scheduler();
+    tile_scheduler(const tile_scheduler&) = delete;
+    tile_scheduler& operator=(const tile_scheduler&) = delete;
+
+    int threads() const { return thread_cnt; }
+
+    // Calls render_tile(t, thread_id) once for every tile and returns when
+    // all of them are done. Progress is printed to std::cerr if requested.
+    template <typename F>
+    void run(const std::vector<tile>& tiles, F&& render_tile,
+             bool report_progress = true);
+
+    // Pixels finished so far in the current run
+    long pixels_done() const {
+        return done_pixels.load(std::memory_order_relaxed);
+    }
+
+   private:
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return (static_cast<uint64_t>(begin) << 32) | end;
+    }
+    static uint32_t range_begin(uint64_t r) { return r >> 32; }
+    static uint32_t range_end(uint64_t r) { return r & 0xFFFFFFFFu; }
+
+    bool pop(int id, uint32_t& index);
+    bool steal(int id);
+    void render(int id);
+    void work(int id);
+
+    // Keeps each range on its own cache line
+    struct alignas(64) padded_range {
+        std::atomic<uint64_t> value{0};
+    };
+
+    // The tiles of the current run and the function rendering them,
+    // called through a plain function pointer so the workers need not
+    // know its type
+    struct job {
+        const std::vector<tile>* tiles = nullptr;
+        void (*call)(void* render_tile, const tile& t, int thread_id);
+        void* render_tile = nullptr;
+    };
+
+    int thread_cnt;
+    std::vector<padded_range> ranges;
+    std::atomic<long> done_pixels{0};
+
+    std::vector<std::thread> workers;
+    std::mutex lock;  // guards the fields below
+    std::condition_variable started, finished;
+    job current;
+    uint64_t generation = 0;  // runs started so far
+    int busy = 0;             // workers still in the current run
+    bool stopping = false;
+};
+
+tile_scheduler::~tile_scheduler() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+// Takes the first tile of the worker's own range
+bool tile_scheduler::pop(int id, uint32_t& index) {
+    auto& range = ranges[id].value;
+    auto r = range.load(std::memory_order_acquire);
+    while (range_begin(r) < range_end(r)) {
+        if (range.compare_exchange_weak(
+                r, pack(range_begin(r) + 1, range_end(r)),
+                std::memory_order_acq_rel)) {
+            index = range_begin(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the back half of the first non-empty victim range into the worker's
+// own (empty) range. Returns false when there is nothing left to steal.
+bool tile_scheduler::steal(int id) {
+    for (int k = 1; k < thread_cnt; k++) {
+        auto& victim = ranges[(id + k) % thread_cnt].value;
+        auto r = victim.load(std::memory_order_acquire);
+        while (range_begin(r) < range_end(r)) {
+            uint32_t begin = range_begin(r), end = range_end(r);
+            uint32_t mid = begin + (end - begin) / 2;
+            if (victim.compare_exchange_weak(r, pack(begin, mid),
+                                             std::memory_order_acq_rel)) {
+                ranges[id].value.store(pack(mid, end),
+                                       std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Renders tiles of the current run until none are left to take
+void tile_scheduler::render(int id) {
+    const auto& tiles = *current.tiles;
+    uint32_t index;
+    while (true) {
+        if (!pop(id, index)) {
+            if (steal(id)) continue;
+            break;
+        }
+        current.call(current.render_tile, tiles[index], id);
+        done_pixels.fetch_add(tiles[index].pixel_count(),
+                              std::memory_order_relaxed);
+    }
+}
+
+// The loop of a worker thread: waits for a run, takes part in it
+void tile_scheduler::work(int id) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            started.wait(guard,
+                         [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        render(id);
+        std::lock_guard<std::mutex> guard(lock);
+        if (--busy == 0) finished.notify_all();
+    }
+}
+
+template <typename F>
+void tile_scheduler::run(const std::vector<tile>& tiles, F&& render_tile,
+                         bool report_progress) {
+    long total_pixels = 0;
+    for (const auto& t : tiles) total_pixels += t.pixel_count();
+    done_pixels.store(0, std::memory_order_relaxed);
+
+    // hand out equal contiguous slices of the curve
+    uint32_t count = tiles.size();
+    for (int id = 0; id < thread_cnt; id++) {
+        uint32_t begin = static_cast<uint64_t>(count) * id / thread_cnt;
+        uint32_t end = static_cast<uint64_t>(count) * (id + 1) / thread_cnt;
+        ranges[id].value.store(pack(begin, end), std::memory_order_relaxed);
+    }
+
+    using function = typename std::remove_reference<F>::type;
+    job next;
+    next.tiles = &tiles;
+    next.call = [](void* f, const tile& t, int thread_id) {
+        (*static_cast<function*>(f))(t, thread_id);
+    };
+    next.render_tile = const_cast<void*>(
+        static_cast<const void*>(std::addressof(render_tile)));
+
+    std::unique_lock<std::mutex> guard(lock);
+    if (workers.empty())
+        for (int id = 0; id < thread_cnt; id++)
+            workers.emplace_back(&tile_scheduler::work, this, id);
+    current = next;
+    busy = thread_cnt;
+    generation++;
+    started.notify_all();
+    auto done = [&]() { return busy == 0; };
+    if (!report_progress) {
+        finished.wait(guard, done);
+        return;
+    }
+    while (!finished.wait_for(guard, std::chrono::milliseconds(200), done))
+        std::cerr << "\r" << total_pixels - pixels_done() << ' '
+                  << std::flush;
+    std::cerr << "\r";
+}
+
+#endif
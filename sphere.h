@@ -1,26 +1,33 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
+#include <utility>
+#include <vector>
+
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class sphere : public hittable {
    public:
     point3 center;
-    double radius;
+    real radius;
     shared_ptr<material> mat_ptr;
 
     sphere() {}
-    sphere(point3 c, double r) : center(c), radius(r){};
-    sphere(point3 c, double r, shared_ptr<material> m)
+    sphere(point3 c, real r) : center(c), radius(r){};
+    sphere(point3 c, real r, shared_ptr<material> m)
         : center(c), radius(r), mat_ptr(m){};
 
-    virtual bool hit(const ray& r, double t_min, double t_max,
+    virtual bool hit(const ray& r, real t_min, real t_max,
                      hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max,
+bool sphere::hit(const ray& r, real t_min, real t_max,
                  hit_record& rec) const {
+    RT_STAT(sphere_tests, 1);
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -35,7 +42,7 @@ bool sphere::hit(const ray& r, double t_min, double t_max,
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
             return true;
         }
         temp = (-half_b + root) / a;
@@ -44,10 +51,110 @@ bool sphere::hit(const ray& r, double t_min, double t_max,
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
             return true;
         }
     }
     return false;
 }
+
+bool sphere::bounding_box(aabb& output_box) const {
+    auto extent = vec3(radius, radius, radius);
+    output_box = aabb(center - extent, center + extent);
+    return true;
+}
+
+// A sphere whose center moves along keys: linearly between them, and
+// standing still before the first and after the last. Two keys make a
+// linear motion.
+class moving_sphere : public hittable {
+   public:
+    struct key {
+        double time;
+        point3 center;
+    };
+
+    std::vector<key> keys;  // by time, at least one
+    real radius;
+    shared_ptr<material> mat_ptr;
+
+    moving_sphere(std::vector<key> keys, real r, shared_ptr<material> m)
+        : keys(std::move(keys)), radius(r), mat_ptr(m) {}
+
+    point3 center(double time) const;
+
+    virtual bool hit(const ray& r, real t_min, real t_max,
+                     hit_record& rec) const;
+
+    virtual bool bounding_box(aabb& output_box) const;
+
+    virtual bool motion_interval(double& time0, double& time1) const {
+        time0 = keys.front().time;
+        time1 = keys.back().time;
+        return time1 > time0;
+    }
+
+    virtual bool motion_bounds(double time0, double time1, aabb& box0,
+                               aabb& box1) const;
+
+   private:
+    std::vector<timed_box> boxes() const;
+};
+
+point3 moving_sphere::center(double time) const {
+    if (time <= keys.front().time) return keys.front().center;
+    if (time >= keys.back().time) return keys.back().center;
+    size_t i = 1;
+    while (keys[i].time <= time) i++;
+    const auto& a = keys[i - 1];
+    const auto& b = keys[i];
+    auto s = (time - a.time) / (b.time - a.time);
+    return a.center + s * (b.center - a.center);
+}
+
+// The same arithmetic as sphere::hit, around the center at the ray's time
+bool moving_sphere::hit(const ray& r, real t_min, real t_max,
+                        hit_record& rec) const {
+    RT_STAT(sphere_tests, 1);
+    point3 c0 = center(r.time());
+    vec3 oc = r.origin() - c0;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant <= 0) return false;
+    auto root = sqrt(discriminant);
+    auto temp = (-half_b - root) / a;
+    if (!(temp < t_max && temp > t_min)) {
+        temp = (-half_b + root) / a;
+        if (!(temp < t_max && temp > t_min)) return false;
+    }
+    rec.t = temp;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - c0) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr.get();
+    return true;
+}
+
+std::vector<timed_box> moving_sphere::boxes() const {
+    auto extent = vec3(radius, radius, radius);
+    std::vector<timed_box> result;
+    for (const auto& k : keys)
+        result.push_back({k.time, aabb(k.center - extent, k.center + extent)});
+    return result;
+}
+
+bool moving_sphere::bounding_box(aabb& output_box) const {
+    output_box = aabb();
+    for (const auto& b : boxes()) output_box.expand(b.box);
+    return true;
+}
+
+bool moving_sphere::motion_bounds(double time0, double time1, aabb& box0,
+                                  aabb& box1) const {
+    linear_bounds(boxes(), time0, time1, box0, box1);
+    return true;
+}
+
 #endif
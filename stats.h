@@ -0,0 +1,343 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "sampler.h"
+#include "scheduler.h"
+
+// Render statistics: counters and timers of the hot paths, kept per
+// thread and summed once the frame is done. They are compiled in with
+// -DRT_STATS, without it RT_STAT and RT_TIMER expand to nothing.
+
+// Ticks of a cheap clock: the time stamp counter on x86, nanoseconds
+// elsewhere. stats_clock converts them to seconds.
+inline uint64_t stats_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+// The ticks and the time at the start of a frame, to convert ticks to
+// seconds from that start
+class stats_clock {
+   public:
+    stats_clock()
+        : start_ticks(stats_ticks()),
+          start_time(std::chrono::steady_clock::now()) {}
+
+    // Measures the tick rate over the time since the start
+    void stop() {
+        std::chrono::duration<double> d =
+            std::chrono::steady_clock::now() - start_time;
+        auto ticks = stats_ticks() - start_ticks;
+        if (d.count() > 0 && ticks > 0) ticks_per_second = ticks / d.count();
+    }
+
+    double seconds(uint64_t ticks) const { return ticks / ticks_per_second; }
+    // Seconds from the start to the moment ticks was read
+    double at(uint64_t ticks) const { return seconds(ticks - start_ticks); }
+
+   private:
+    uint64_t start_ticks;
+    std::chrono::steady_clock::time_point start_time;
+    double ticks_per_second = 1e9;
+};
+
+// Scoped timers, nested ones are also counted in the outer ones
+enum stats_timer {
+    timer_integrate,  // paths from their camera ray on
+    timer_trace,      // closest hits of the rays in the world
+    timer_scatter,    // materials
+    timer_output,     // tiles, previews and checkpoints written out
+    timer_count
+};
+
+// Timers measure one call in timer_period and count it that many times,
+// as reading the clock costs more than a ray-sphere test. The calls are
+// drawn at random: every n-th call would line up with the regular pattern
+// of the renderer's calls (e.g. the bounces of paths of the same length)
+// and skew the times. Tiles are few, the output timer measures every call.
+inline int timer_period(stats_timer timer) {
+    return timer == timer_output ? 1 : 16;
+}
+
+// Ticks that reading the clock twice takes, subtracted from every timed
+// call. The least of a few tries, measured once.
+inline uint64_t timer_overhead() {
+    static const uint64_t overhead = []() {
+        uint64_t least = ~uint64_t(0);
+        for (int k = 0; k < 64; k++) {
+            auto start = stats_ticks();
+            least = std::min(least, stats_ticks() - start);
+        }
+        return least;
+    }();
+    return overhead;
+}
+
+const int stats_material_kinds = 8;  // at least material_kind_count
+
+// The statistics of one thread, on cache lines of its own
+struct alignas(64) render_stats {
+    long paths = 0;           // camera samples
+    long rays = 0;            // rays traced, camera rays included
+    long shadow_rays = 0;     // rays towards sampled lights
+    long box_tests = 0;       // ray-box tests of the BVH
+    long sphere_tests = 0;    // ray-sphere tests
+    long triangle_tests = 0;  // ray-triangle tests
+    // how paths ended
+    long escaped = 0;    // to the background
+    long absorbed = 0;   // by a material that did not scatter
+    long max_depth = 0;  // cut off at the depth limit
+    long roulette = 0;   // lost at Russian roulette
+    long scatters[stats_material_kinds] = {};
+    long allocations = 0;  // heap allocations, which tiles should not make
+    uint64_t timers[timer_count] = {};
+    long timer_calls[timer_count] = {};
+    // draws the calls the timers measure, a stream of its own per thread
+    pcg32 timer_draws{reinterpret_cast<uintptr_t>(this), 0x5157};
+
+    // A stage of a tile, for the trace of the frame
+    struct event {
+        const char* name;
+        tile t;
+        uint64_t begin, end;
+    };
+    std::vector<event> events;
+    int tiles = 0;
+    uint64_t busy = 0;  // ticks spent on tiles
+
+    void add(const render_stats& other) {
+        paths += other.paths;
+        rays += other.rays;
+        shadow_rays += other.shadow_rays;
+        box_tests += other.box_tests;
+        sphere_tests += other.sphere_tests;
+        triangle_tests += other.triangle_tests;
+        escaped += other.escaped;
+        absorbed += other.absorbed;
+        max_depth += other.max_depth;
+        roulette += other.roulette;
+        for (int k = 0; k < stats_material_kinds; k++)
+            scatters[k] += other.scatters[k];
+        allocations += other.allocations;
+        for (int k = 0; k < timer_count; k++) {
+            timers[k] += other.timers[k];
+            timer_calls[k] += other.timer_calls[k];
+        }
+        tiles += other.tiles;
+        busy += other.busy;
+    }
+};
+
+// The statistics the calling thread counts into, none outside of tiles.
+// Only the owning thread writes them, so no atomics are needed.
+inline thread_local render_stats* bound_stats = nullptr;
+
+// Adds the time of its scope to a timer of the bound statistics, measuring
+// one call in period, see timer_period
+class scoped_timer {
+   public:
+    scoped_timer(stats_timer timer, int period)
+        : timer(timer), period(period) {
+        if (!bound_stats) return;
+        bound_stats->timer_calls[timer]++;
+        if (period == 1 || bound_stats->timer_draws.next_uint() % period == 0)
+            start = stats_ticks();
+    }
+    ~scoped_timer() {
+        if (!start) return;
+        auto ticks = stats_ticks() - start;
+        auto overhead = timer_overhead();
+        ticks = ticks > overhead ? ticks - overhead : 0;
+        bound_stats->timers[timer] += ticks * period;
+    }
+
+   private:
+    stats_timer timer;
+    int period;
+    uint64_t start = 0;
+};
+
+// Binds stats to the calling thread for a stage of tile t, the stage is
+// recorded as an event of the trace. The stage "tile" counts as busy time.
+class tile_stats_scope {
+   public:
+    tile_stats_scope(render_stats& stats, const char* name, const tile& t)
+        : stats(stats), name(name), t(t), start(stats_ticks()) {
+        bound_stats = &stats;
+    }
+    ~tile_stats_scope() {
+        auto end = stats_ticks();
+        // the event is not an allocation of the tile
+        bound_stats = nullptr;
+        stats.events.push_back({name, t, start, end});
+        if (std::strcmp(name, "tile") == 0) {
+            stats.tiles++;
+            stats.busy += end - start;
+        }
+    }
+
+   private:
+    render_stats& stats;
+    const char* name;
+    tile t;
+    uint64_t start;
+};
+
+#ifdef RT_STATS
+#define RT_STAT(counter, n) \
+    (bound_stats ? (void)(bound_stats->counter += (n)) : (void)0)
+#define RT_TIMER(timer) \
+    scoped_timer rt_timer_##timer(timer, timer_period(timer))
+// A timer of a scope that runs long and seldom, like a stage of a batch of
+// paths, which measures every call: sampled, a few calls decide its time
+#define RT_STAGE_TIMER(timer) scoped_timer rt_timer_##timer(timer, 1)
+#define RT_TILE_STATS(stats, name, t) \
+    tile_stats_scope rt_tile_stats_##name(stats, #name, t)
+
+// Every heap allocation made while statistics are bound is counted. The
+// arrays new[] makes go through these too. Not inlined, or GCC sees free()
+// called on what operator new returned and warns.
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    if (bound_stats) bound_stats->allocations++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new(std::size_t size,
+                                     std::align_val_t align) {
+    if (bound_stats) bound_stats->allocations++;
+    // aligned_alloc wants a nonzero multiple of the alignment
+    auto a = static_cast<std::size_t>(align);
+    auto bytes = size == 0 ? a : (size + a - 1) / a * a;
+    if (void* p = std::aligned_alloc(a, bytes)) return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+[[gnu::noinline]] void operator delete(void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+[[gnu::noinline]] void operator delete(void* p, std::size_t,
+                                       std::align_val_t) noexcept {
+    std::free(p);
+}
+#else
+#define RT_STAT(counter, n) ((void)0)
+#define RT_TIMER(timer) ((void)0)
+#define RT_STAGE_TIMER(timer) ((void)0)
+#define RT_TILE_STATS(stats, name, t) ((void)0)
+#endif
+
+// Prints the statistics of every thread and their sum. kind_names names
+// the scatter counters, wall is the seconds the frame took.
+void print_stats_summary(const std::vector<render_stats>& stats,
+                         const std::vector<std::string>& kind_names,
+                         const stats_clock& clock, double wall) {
+    render_stats total;
+    std::fprintf(stderr, ">> Render statistics\n%-8s %8s %10s %10s %8s\n",
+                 "thread", "tiles", "busy s", "idle s", "busy");
+    for (size_t id = 0; id < stats.size(); id++) {
+        total.add(stats[id]);
+        auto busy = clock.seconds(stats[id].busy);
+        std::fprintf(stderr, "%-8zu %8d %10.3f %10.3f %7.1f%%\n", id,
+                     stats[id].tiles, busy, wall - busy,
+                     wall > 0 ? 100 * busy / wall : 0.0);
+    }
+
+    auto per = [](double count, double total) {
+        return total > 0 ? count / total : 0.0;
+    };
+    std::fprintf(stderr, "\n%-24s %14s %12s\n", "counter", "total",
+                 "per path");
+    auto row = [&](const char* name, long count) {
+        std::fprintf(stderr, "%-24s %14ld %12.3f\n", name, count,
+                     per(count, total.paths));
+    };
+    row("paths", total.paths);
+    row("rays", total.rays);
+    row("shadow rays", total.shadow_rays);
+    row("box tests", total.box_tests);
+    row("sphere tests", total.sphere_tests);
+    row("triangle tests", total.triangle_tests);
+    row("escaped", total.escaped);
+    row("absorbed", total.absorbed);
+    row("cut at max depth", total.max_depth);
+    row("lost at roulette", total.roulette);
+    for (size_t k = 0; k < kind_names.size(); k++)
+        row(("scatter " + kind_names[k]).c_str(), total.scatters[k]);
+    row("heap allocations", total.allocations);
+
+    auto busy = clock.seconds(total.busy);
+    const char* timer_names[timer_count] = {"integrate", "trace", "scatter",
+                                            "output"};
+    std::fprintf(stderr, "\n%-24s %14s %12s\n", "timer", "thread s",
+                 "of busy");
+    for (int k = 0; k < timer_count; k++) {
+        auto s = clock.seconds(total.timers[k]);
+        std::fprintf(stderr, "%-24s %14.3f %11.1f%%\n", timer_names[k], s,
+                     100 * per(s, busy));
+    }
+}
+
+// Writes the tile events of every thread as a Chrome trace (JSON that
+// chrome://tracing and Perfetto open), one track per thread
+bool write_chrome_trace(const std::string& path,
+                        const std::vector<render_stats>& stats,
+                        const stats_clock& clock) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    auto separator = [&]() {
+        if (!first) out << ",\n";
+        first = false;
+    };
+    for (size_t id = 0; id < stats.size(); id++) {
+        separator();
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+               "\"tid\": "
+            << id << ", \"args\": {\"name\": \"worker " << id << "\"}}";
+        for (const auto& e : stats[id].events) {
+            separator();
+            // timestamps in microseconds
+            out << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", "
+                << "\"pid\": 1, \"tid\": " << id
+                << ", \"ts\": " << clock.at(e.begin) * 1e6
+                << ", \"dur\": " << clock.seconds(e.end - e.begin) * 1e6
+                << ", \"args\": {\"x0\": " << e.t.x0 << ", \"y0\": "
+                << e.t.y0 << ", \"x1\": " << e.t.x1 << ", \"y1\": " << e.t.y1
+                << "}}";
+        }
+    }
+    out << "\n]}\n";
+    return bool(out.flush());
+}
+
+#endif
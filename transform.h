@@ -0,0 +1,106 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "aabb.h"
+#include "common.h"
+
+// An affine transform p -> m p + offset, a 3x3 matrix and a translation
+class affine_transform {
+   public:
+    real m[3][3];
+    vec3 offset;
+
+    // The identity
+    affine_transform() : m{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}} {}
+
+    static affine_transform translate(const vec3& v) {
+        affine_transform t;
+        t.offset = v;
+        return t;
+    }
+
+    static affine_transform scale(const vec3& s) {
+        affine_transform t;
+        for (int i = 0; i < 3; i++) t.m[i][i] = s[i];
+        return t;
+    }
+
+    // Rotation by degrees around axis, counterclockwise looking down it
+    static affine_transform rotate(const vec3& axis, double degrees) {
+        auto a = unit_vector(axis);
+        double s = std::sin(degrees_to_radians(degrees));
+        double c = std::cos(degrees_to_radians(degrees));
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) t.m[i][j] = a[i] * a[j] * (1 - c);
+        for (int i = 0; i < 3; i++) t.m[i][i] += c;
+        t.m[0][1] -= a.z() * s, t.m[1][0] += a.z() * s;
+        t.m[0][2] += a.y() * s, t.m[2][0] -= a.y() * s;
+        t.m[1][2] -= a.x() * s, t.m[2][1] += a.x() * s;
+        return t;
+    }
+
+    // The transform applying other first, then this
+    affine_transform operator*(const affine_transform& other) const {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                t.m[i][j] = m[i][0] * other.m[0][j] +
+                            m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j];
+        t.offset = point(other.offset);
+        return t;
+    }
+
+    point3 point(const point3& p) const { return vector(p) + offset; }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                    m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                    m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    // Maps a normal of the space this transform maps to into the space it
+    // maps from, by the transpose. Called on the inverse of a transform, it
+    // maps normals the way the transform maps points.
+    vec3 normal(const vec3& n) const {
+        return vec3(m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+                    m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+                    m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z());
+    }
+
+    // Computes the inverse, returns false if the transform is singular
+    bool inverse(affine_transform& out) const {
+        // the adjugate over the determinant
+        double c[3][3];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+                int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                c[j][i] = static_cast<double>(m[i1][j1]) * m[i2][j2] -
+                          static_cast<double>(m[i1][j2]) * m[i2][j1];
+            }
+        }
+        double det = m[0][0] * c[0][0] + m[0][1] * c[1][0] + m[0][2] * c[2][0];
+        if (det == 0 || !std::isfinite(det)) return false;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) out.m[i][j] = c[i][j] / det;
+        out.offset = -out.vector(offset);
+        return true;
+    }
+
+    // The box around the image of box, from its 8 corners
+    aabb box(const aabb& box) const {
+        aabb result;
+        for (int k = 0; k < 8; k++) {
+            point3 corner((k & 1 ? box.maximum : box.minimum).x(),
+                          (k & 2 ? box.maximum : box.minimum).y(),
+                          (k & 4 ? box.maximum : box.minimum).z());
+            result.expand(point(corner));
+        }
+        return result;
+    }
+};
+
+#endif
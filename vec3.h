@@ -4,56 +4,66 @@
 #include <cmath>
 #include <iostream>
 
-class vec3;
-double dot(const vec3 &u, const vec3 &v);
-
-class vec3 {
+// A 3-component vector of scalars T. With Lanes = 4 it is padded to 4
+// components and aligned to their size (16 bytes for floats), so the
+// component-wise operators map to single SIMD instructions; the padding
+// component is kept at zero by the constructors.
+template <typename T, int Lanes = 3>
+class vec3_t {
    public:
-    double e[3];
-
-    vec3() : e{0, 0, 0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
-
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
-
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double &operator[](int i) { return e[i]; }
+    static_assert(Lanes == 3 || Lanes == 4, "vec3_t has 3 or 4 lanes");
+    typedef T scalar;
+
+    alignas(Lanes == 4 ? 4 * sizeof(T) : alignof(T)) T e[Lanes];
+
+    vec3_t() : e{} {}
+    vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
+    // Converts between precisions and layouts
+    template <typename U, int M>
+    explicit vec3_t(const vec3_t<U, M> &v)
+        : e{static_cast<T>(v.e[0]), static_cast<T>(v.e[1]),
+            static_cast<T>(v.e[2])} {}
+
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+
+    vec3_t operator-() const {
+        vec3_t r;
+        for (int i = 0; i < Lanes; i++) r.e[i] = -e[i];
+        return r;
+    }
+    T operator[](int i) const { return e[i]; }
+    T &operator[](int i) { return e[i]; }
 
-    vec3 &operator+=(const vec3 &v) {
-        e[0] += v.e[0];
-        e[1] += v.e[1];
-        e[2] += v.e[2];
+    vec3_t &operator+=(const vec3_t &v) {
+        for (int i = 0; i < Lanes; i++) e[i] += v.e[i];
         return *this;
     }
 
-    vec3 &operator*=(const double t) {
-        e[0] *= t;
-        e[1] *= t;
-        e[2] *= t;
+    vec3_t &operator*=(const T t) {
+        for (int i = 0; i < Lanes; i++) e[i] *= t;
         return *this;
     }
 
-    vec3 &operator/=(const double t) { return *this *= 1 / t; }
+    vec3_t &operator/=(const T t) { return *this *= 1 / t; }
 
-    double length_squared() const {
+    T length_squared() const {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
 
-    double length() { return sqrt(length_squared()); }
+    T length() const { return sqrt(length_squared()); }
 
-    inline static vec3 random() {
-        return vec3(random_double(), random_double(), random_double());
+    inline static vec3_t random() {
+        return vec3_t(random_double(), random_double(), random_double());
     }
 
-    inline static vec3 random(double min, double max) {
-        return vec3(random_double(min, max), random_double(min, max),
-                    random_double(min, max));
+    inline static vec3_t random(double min, double max) {
+        return vec3_t(random_double(min, max), random_double(min, max),
+                      random_double(min, max));
     }
 
-    static vec3 random_in_unit_sphere() {
+    static vec3_t random_in_unit_sphere() {
         while (true) {
             auto p = random(-1, 1);
             if (p.length_squared() >= 1) continue;
@@ -61,56 +71,97 @@ class vec3 {
         }
     }
 
-    static vec3 random_unit_vector() {
+    static vec3_t random_unit_vector() {
         auto a = random_double(0, 2 * pi);
         auto z = random_double(-1, 1);
         auto r = sqrt(1 - z * z);
-        return vec3(r * cos(a), r * sin(a), z);
+        return vec3_t(r * cos(a), r * sin(a), z);
     }
 };
 
+// The vectors of the renderer, in its precision. Build with
+// -DRT_SINGLE_PRECISION for floats and -DRT_ALIGNED_VEC3 for the 4-lane
+// layout.
+#ifdef RT_ALIGNED_VEC3
+using vec3 = vec3_t<real, 4>;
+#else
+using vec3 = vec3_t<real>;
+#endif
+
 // Type aliases for vec3
 using point3 = vec3;  // 3D point
 using color = vec3;   // RGB color
 
-// vec3 Utility Functions
+// Sums of many color samples, in double precision whatever the precision
+// of the renderer
+using color_sum = vec3_t<double>;
 
-inline std::ostream &operator<<(std::ostream &out, const vec3 &v) {
+// vec3 Utility Functions. The scalar operands are not deduced, so any
+// arithmetic type converts to the vector's scalar type.
+
+template <typename T, int N>
+inline std::ostream &operator<<(std::ostream &out, const vec3_t<T, N> &v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T, int N>
+inline vec3_t<T, N> operator+(const vec3_t<T, N> &u, const vec3_t<T, N> &v) {
+    vec3_t<T, N> r;
+    for (int i = 0; i < N; i++) r.e[i] = u.e[i] + v.e[i];
+    return r;
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T, int N>
+inline vec3_t<T, N> operator-(const vec3_t<T, N> &u, const vec3_t<T, N> &v) {
+    vec3_t<T, N> r;
+    for (int i = 0; i < N; i++) r.e[i] = u.e[i] - v.e[i];
+    return r;
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T, int N>
+inline vec3_t<T, N> operator*(const vec3_t<T, N> &u, const vec3_t<T, N> &v) {
+    vec3_t<T, N> r;
+    for (int i = 0; i < N; i++) r.e[i] = u.e[i] * v.e[i];
+    return r;
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template <typename T, int N>
+inline vec3_t<T, N> operator*(typename vec3_t<T, N>::scalar t,
+                              const vec3_t<T, N> &v) {
+    vec3_t<T, N> r;
+    for (int i = 0; i < N; i++) r.e[i] = t * v.e[i];
+    return r;
 }
 
-inline vec3 operator*(const vec3 &v, double t) { return t * v; }
+template <typename T, int N>
+inline vec3_t<T, N> operator*(const vec3_t<T, N> &v,
+                              typename vec3_t<T, N>::scalar t) {
+    return t * v;
+}
 
-inline vec3 operator/(vec3 v, double t) { return (1 / t) * v; }
+template <typename T, int N>
+inline vec3_t<T, N> operator/(const vec3_t<T, N> &v,
+                              typename vec3_t<T, N>::scalar t) {
+    return (1 / t) * v;
+}
 
-inline double dot(const vec3 &u, const vec3 &v) {
+template <typename T, int N>
+inline T dot(const vec3_t<T, N> &u, const vec3_t<T, N> &v) {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T, int N>
+inline vec3_t<T, N> cross(const vec3_t<T, N> &u, const vec3_t<T, N> &v) {
+    return vec3_t<T, N>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                        u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                        u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
 // Returns the unit vector of v
-inline vec3 unit_vector(vec3 v) { return v / v.length(); }
+template <typename T, int N>
+inline vec3_t<T, N> unit_vector(const vec3_t<T, N> &v) {
+    return v / v.length();
+}
 
 // Returns reflected ray v with normal n
 vec3 reflect(const vec3 &v, const vec3 &n) { return v - 2 * dot(v, n) * n; }
@@ -118,7 +169,7 @@ vec3 reflect(const vec3 &v, const vec3 &n) { return v - 2 * dot(v, n) * n; }
 /**
  * uv: incoming ray, n: normal, etai_over_etat: eta/eta'
  */
-vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
+vec3 refract(const vec3 &uv, const vec3 &n, real etai_over_etat) {
     auto cos_theta = dot(-uv, n);
     vec3 r_out_parallel = etai_over_etat * (uv + cos_theta * n);
     vec3 r_out_perp = -sqrt(1.0 - r_out_parallel.length_squared()) * n;
@@ -134,4 +185,21 @@ vec3 random_in_unit_disk() {
     }
 }
 
+// Maps a sample in [0,1)^2 to the unit disk, keeping its stratification
+// (Shirley and Chiu's concentric mapping)
+vec3 sample_unit_disk(double u, double v) {
+    auto a = 2 * u - 1;
+    auto b = 2 * v - 1;
+    if (a == 0 && b == 0) return vec3(0, 0, 0);
+    double r, theta;
+    if (a * a > b * b) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = (pi / 2) - (pi / 4) * (a / b);
+    }
+    return vec3(r * cos(theta), r * sin(theta), 0);
+}
+
 #endif
@@ -0,0 +1,532 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "adaptive.h"
+#include "camera.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "light.h"
+#include "material.h"
+#include "packet.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "stats.h"
+
+// megakernel: every thread follows one path at a time through ray_color
+// wavefront: every thread keeps a batch of paths in flight and moves them
+//   through the stages of wavefront_engine together
+enum class render_engine { megakernel, wavefront };
+
+// Parses "megakernel" or "wavefront", returns false on anything else
+bool parse_render_engine(const std::string& name, render_engine& engine) {
+    if (name == "megakernel")
+        engine = render_engine::megakernel;
+    else if (name == "wavefront")
+        engine = render_engine::wavefront;
+    else
+        return false;
+    return true;
+}
+
+// Renders tiles as streams of paths. A batch of camera rays is generated,
+// then until every path has ended the batch goes through
+// - extend: trace the next ray of every path,
+// - shade: scatter the hits, grouped by material kind so every kind's
+//   scatter code runs in one tight, non-virtual loop, and draw lights for
+//   the diffuse ones,
+// - connect: trace the shadow rays towards the lights drawn,
+// - continue: apply the attenuation and Russian roulette, and drop the
+//   paths that ended from the batch.
+// Each path carries its own random generator, so a path draws the same
+// numbers as under ray_color and, as the samples of a pixel are added in
+// order, the image is the same as the megakernel's.
+// An engine keeps its buffers between tiles, one is needed per thread.
+class wavefront_engine {
+   public:
+    wavefront_engine(const hittable& world, const light_list& lights,
+                     const camera& cam, int w, int h, sampler_type sampler,
+                     uint64_t seed, const path_limits& limits,
+                     const adaptive_settings& adaptive)
+        : world(&world),
+          lights(&lights),
+          cam(&cam),
+          w(w),
+          h(h),
+          sampler(sampler),
+          seed(seed),
+          limits(limits),
+          adaptive(adaptive) {}
+
+    // Adds samples to every pixel of t until it has `target`, like
+    // render_pixel. There are no estimators without adaptive sampling, and
+    // the AOVs of the samples go to aovs if given.
+    void render_tile(const tile& t, int target,
+                     std::vector<pixel_estimator>& estimators,
+                     framebuffer& result, aov_buffer* aovs = nullptr);
+
+    // Sizes the buffers for tiles of up to `pixels` pixels, so that
+    // rendering them allocates nothing
+    void reserve(int pixels, bool with_aovs) {
+        resize(std::max(batch_size, pixels), with_aovs);
+        samplers.reserve(pixels);
+        next_sample.reserve(pixels);
+        sums.reserve(pixels);
+    }
+
+    // Traces the rays of the batch in SIMD packets through `packets`, which
+    // must hold the same spheres as the world
+    void use_packets(const sphere_packet_bvh& packets, simd_level level) {
+        this->packets = &packets;
+        this->level = level;
+    }
+
+    // Rays traced by this engine so far
+    long rays_traced() const { return rays; }
+
+    // Paths generated in one go, when adaptive sampling does not need the
+    // result of a pixel's previous sample first
+    static const int batch_size = 4096;
+
+   private:
+    void resize(int size, bool with_aovs);
+    void generate(int path, int pixel, int sample);
+    void extend();
+    bool trace(const ray& r, const ray_packet* p, int lane,
+               hit_record& rec);
+    void shade();
+    void sample_lights(const int* begin, const int* end);
+    void connect();
+    void continue_paths();
+
+    template <typename M>
+    void shade_kind(const int* begin, const int* end);
+
+    ray current_ray(int path) const {
+        return ray(point3(ox[path], oy[path], oz[path]),
+                   vec3(dx[path], dy[path], dz[path]), ray_time[path]);
+    }
+
+    void set_ray(int path, const ray& r) {
+        ox[path] = r.origin().x();
+        oy[path] = r.origin().y();
+        oz[path] = r.origin().z();
+        dx[path] = r.direction().x();
+        dy[path] = r.direction().y();
+        dz[path] = r.direction().z();
+        ray_time[path] = r.time();
+    }
+
+    const hittable* world;
+    const light_list* lights;
+    const camera* cam;
+    int w, h;
+    sampler_type sampler;
+    uint64_t seed;
+    path_limits limits;
+    adaptive_settings adaptive;
+    const sphere_packet_bvh* packets = nullptr;
+    simd_level level = simd_level::scalar;
+    long rays = 0;
+
+    // the tile being rendered
+    tile current;
+    aov_buffer* aovs = nullptr;
+    std::vector<pixel_sampler> samplers;
+    std::vector<int> next_sample;  // next sample index of every pixel
+    std::vector<color_sum> sums;   // of the samples of every pixel
+
+    // every path of the batch, indexed by its place in generation order
+    std::vector<real> ox, oy, oz, dx, dy, dz;  // ray to trace next
+    std::vector<real> ray_time;
+    std::vector<real> tr, tg, tb;              // throughput
+    std::vector<real> ar, ag, ab;              // attenuation of a bounce
+    std::vector<color> radiance;               // result of ended paths
+    std::vector<aov_sample> first;             // AOVs of the camera ray
+    std::vector<char> following;  // whether they follow a specular path
+    std::vector<hit_record> hits;
+    std::vector<pcg32> generators;
+    std::vector<int> path_pixel;  // pixel of the tile
+    std::vector<int> depth;       // rays traced so far
+    std::vector<char> scattered;  // whether the last hit scattered
+    // density of the last scatter if it is weighted against a light
+    // sample, else zero, see hit_color
+    std::vector<real> scatter_pdf;
+    // the shadow rays of the bounce, and what the light along them times
+    // the albedo is multiplied by
+    std::vector<int> shadow_paths;
+    std::vector<ray> shadow_rays;
+    std::vector<color> shadow_albedo;
+    std::vector<real> shadow_factor;
+
+    std::vector<int> active;  // paths still in flight
+    std::vector<int> next;    // scratch for the next active list
+    std::vector<int> sorted;  // hit paths grouped by material kind
+};
+
+void wavefront_engine::resize(int size, bool with_aovs) {
+    if (with_aovs && static_cast<int>(first.size()) < size) {
+        first.resize(size);
+        following.resize(size);
+    }
+    if (static_cast<int>(ox.size()) >= size) return;
+    for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &ray_time, &tr, &tg, &tb,
+                    &ar, &ag, &ab})
+        v->resize(size);
+    radiance.resize(size);
+    hits.resize(size);
+    generators.resize(size);
+    path_pixel.resize(size);
+    depth.resize(size);
+    scattered.resize(size);
+    scatter_pdf.resize(size);
+    shadow_paths.reserve(size);
+    shadow_rays.resize(size);
+    shadow_albedo.resize(size);
+    shadow_factor.resize(size);
+    active.reserve(size);
+    next.reserve(size);
+    sorted.resize(size);
+}
+
+// Stage 1: the camera ray of sample `sample` of pixel `pixel` of the tile
+void wavefront_engine::generate(int path, int pixel, int sample) {
+    int tw = current.x1 - current.x0;
+    int i = current.x0 + pixel % tw, j = current.y0 + pixel / tw;
+    auto& s = samplers[pixel];
+    s.start_sample(sample);
+    double du, dv, lens_u, lens_v;
+    s.next_2d(du, dv);
+    s.next_2d(lens_u, lens_v);
+    double time_u = 0, unused;
+    if (cam->has_shutter()) s.next_2d(time_u, unused);
+    auto u = (i + du) / (w - 1);
+    auto v = (j + dv) / (h - 1);
+    set_ray(path, cam->get_ray(u, v, lens_u, lens_v, time_u));
+    tr[path] = tg[path] = tb[path] = 1;
+    radiance[path] = color(0, 0, 0);
+    generators[path] = thread_rng();
+    path_pixel[path] = pixel;
+    RT_STAT(paths, 1);
+    depth[path] = 0;
+    scatter_pdf[path] = 0;
+    active.push_back(path);
+}
+
+// Finds the hit of ray r, from lane of packet p if there is one
+bool wavefront_engine::trace(const ray& r, const ray_packet* p, int lane,
+                             hit_record& rec) {
+    if (!p) return world->hit(r, 0.001, infinity, rec);
+    if (p->hit[lane] < 0) return false;
+    // packets find the closest sphere in single precision, the hit itself
+    // is computed in double precision like the world does
+    if (packets->refine(static_cast<int>(p->hit[lane]), r, 0.001, infinity,
+                        rec))
+        return true;
+    // grazing ray rejected by the refinement
+    return world->hit(r, 0.001, infinity, rec);
+}
+
+// Stage 2: traces the next ray of every active path. Paths that escape
+// end with the background, the others move on to shading. The light of
+// the lights they hit or escape to is weighted like in hit_color.
+void wavefront_engine::extend() {
+    RT_STAGE_TIMER(timer_trace);
+    const bool use_packets = packets && level != simd_level::scalar;
+    const int width = use_packets ? packet_width(level) : 1;
+    ray_packet p;
+    next.clear();
+    for (size_t base = 0; base < active.size(); base += width) {
+        int size = std::min<int>(width, active.size() - base);
+        if (use_packets) {
+            p.size = size;
+            for (int lane = 0; lane < size; lane++)
+                p.set(lane, current_ray(active[base + lane]), 0.001);
+            packets->intersect(p, level);
+        }
+        for (int lane = 0; lane < size; lane++) {
+            int path = active[base + lane];
+            auto r = current_ray(path);
+            depth[path]++;
+            rays++;
+            RT_STAT(rays, 1);
+            bool hit =
+                trace(r, use_packets ? &p : nullptr, lane, hits[path]);
+            if (aovs) {
+                const hit_record* rec = hit ? &hits[path] : nullptr;
+                if (depth[path] == 1) {
+                    first[path] = first_hit_aovs(r, rec, *lights);
+                    following[path] = rec && is_specular(*rec->mat_ptr);
+                } else if (following[path]) {
+                    following[path] =
+                        follow_specular_aovs(first[path], r, rec, *lights);
+                }
+            }
+            color throughput(tr[path], tg[path], tb[path]);
+            auto weight = [&]() -> real {
+                if (scatter_pdf[path] <= 0) return 1;
+                return power_heuristic(
+                    scatter_pdf[path],
+                    lights->pdf(r.origin(), unit_vector(r.direction())));
+            };
+            if (hit) {
+                const hit_record& rec = hits[path];
+                if (rec.mat_ptr->kind == material_kind::light)
+                    radiance[path] +=
+                        throughput * emitted(*rec.mat_ptr, rec) * weight();
+                next.push_back(path);
+            } else {
+                RT_STAT(escaped, 1);
+                // the sky gradient is not sampled as a light
+                if (!lights->environment_light()) scatter_pdf[path] = 0;
+                radiance[path] +=
+                    throughput * background(r, *lights) * weight();
+            }
+        }
+    }
+    active.swap(next);
+}
+
+template <typename M>
+void wavefront_engine::shade_kind(const int* begin, const int* end) {
+    for (const int* p = begin; p != end; p++) {
+        int path = *p;
+        const hit_record& rec = hits[path];
+        thread_rng() = generators[path];
+        ray out;
+        color attenuation;
+        // a qualified call is not virtual
+        bool s = static_cast<const M*>(rec.mat_ptr)
+                     ->M::scatter(current_ray(path), rec, attenuation, out);
+        generators[path] = thread_rng();
+        scattered[path] = s;
+        ar[path] = attenuation.x();
+        ag[path] = attenuation.y();
+        ab[path] = attenuation.z();
+        set_ray(path, out);
+    }
+}
+
+template <>
+void wavefront_engine::shade_kind<material>(const int* begin,
+                                            const int* end) {
+    // materials of unknown kind keep their virtual call
+    for (const int* p = begin; p != end; p++) {
+        int path = *p;
+        const hit_record& rec = hits[path];
+        thread_rng() = generators[path];
+        ray out;
+        color attenuation;
+        bool s = rec.mat_ptr->scatter(current_ray(path), rec, attenuation,
+                                      out);
+        generators[path] = thread_rng();
+        scattered[path] = s;
+        ar[path] = attenuation.x();
+        ag[path] = attenuation.y();
+        ab[path] = attenuation.z();
+        set_ray(path, out);
+    }
+}
+
+// Stage 3: scatters every hit, after a counting sort of the paths by the
+// kind of material they hit
+void wavefront_engine::shade() {
+    RT_STAGE_TIMER(timer_scatter);
+    int counts[material_kind_count + 1] = {};
+    for (int path : active)
+        counts[static_cast<int>(hits[path].mat_ptr->kind) + 1]++;
+    for (int k = 0; k < material_kind_count; k++) counts[k + 1] += counts[k];
+    int starts[material_kind_count + 1];
+    std::copy(counts, counts + material_kind_count + 1, starts);
+    for (int k = 0; k < material_kind_count; k++)
+        RT_STAT(scatters[k], starts[k + 1] - starts[k]);
+    for (int path : active)
+        sorted[counts[static_cast<int>(hits[path].mat_ptr->kind)]++] = path;
+
+    auto bin = [&](material_kind kind) {
+        return sorted.data() + starts[static_cast<int>(kind)];
+    };
+    auto bin_end = [&](material_kind kind) {
+        return sorted.data() + starts[static_cast<int>(kind) + 1];
+    };
+    for (int path : active) scatter_pdf[path] = 0;
+    shade_kind<lambertian>(bin(material_kind::lambertian),
+                           bin_end(material_kind::lambertian));
+    if (!lights->empty())
+        sample_lights(bin(material_kind::lambertian),
+                      bin_end(material_kind::lambertian));
+    shade_kind<metal>(bin(material_kind::metal),
+                      bin_end(material_kind::metal));
+    shade_kind<dielectric>(bin(material_kind::dielectric),
+                           bin_end(material_kind::dielectric));
+    shade_kind<diffuse_light>(bin(material_kind::light),
+                              bin_end(material_kind::light));
+    shade_kind<material>(bin(material_kind::other),
+                         bin_end(material_kind::other));
+}
+
+// Draws a light for every diffuse hit that scattered and may go on,
+// after its scatter like hit_color, and queues the shadow ray towards it
+void wavefront_engine::sample_lights(const int* begin, const int* end) {
+    shadow_paths.clear();
+    for (const int* p = begin; p != end; p++) {
+        int path = *p;
+        if (!scattered[path] || depth[path] >= limits.max_depth) continue;
+        const hit_record& rec = hits[path];
+        const auto& m = static_cast<const lambertian&>(*rec.mat_ptr);
+        // set_ray replaced the ray in by the scattered one, which has the
+        // same time
+        const ray out = current_ray(path);
+        int k = shadow_paths.size();
+        thread_rng() = generators[path];
+        if (sample_light(*lights, out, rec, m, shadow_rays[k],
+                         shadow_factor[k])) {
+            shadow_paths.push_back(path);
+            shadow_albedo[k] = m.albedo;
+        }
+        generators[path] = thread_rng();
+        scatter_pdf[path] = m.cosine_over_pi(rec, unit_vector(out.direction()));
+    }
+}
+
+// Stage 4: traces the shadow rays queued by sample_lights and adds the
+// light they find to their paths, see direct_light
+void wavefront_engine::connect() {
+    RT_STAGE_TIMER(timer_trace);
+    const bool use_packets = packets && level != simd_level::scalar;
+    const int width = use_packets ? packet_width(level) : 1;
+    ray_packet p;
+    hit_record rec;
+    for (size_t base = 0; base < shadow_paths.size(); base += width) {
+        int size = std::min<int>(width, shadow_paths.size() - base);
+        if (use_packets) {
+            p.size = size;
+            for (int lane = 0; lane < size; lane++)
+                p.set(lane, shadow_rays[base + lane], 0.001);
+            packets->intersect(p, level);
+        }
+        for (int lane = 0; lane < size; lane++) {
+            int k = base + lane;
+            int path = shadow_paths[k];
+            const ray& r = shadow_rays[k];
+            rays++;
+            RT_STAT(shadow_rays, 1);
+            bool found = trace(r, use_packets ? &p : nullptr, lane, rec);
+            radiance[path] +=
+                color(tr[path], tg[path], tb[path]) *
+                (shadow_albedo[k] *
+                 shadow_light(r, found ? &rec : nullptr, *lights) *
+                 shadow_factor[k]);
+        }
+    }
+    shadow_paths.clear();
+}
+
+// Stage 5: ends the paths that were absorbed, reached the depth limit or
+// lost at Russian roulette, see hit_color
+void wavefront_engine::continue_paths() {
+    next.clear();
+    for (int path : active) {
+        if (!scattered[path]) {
+            RT_STAT(absorbed, 1);
+            continue;
+        }
+        if (depth[path] >= limits.max_depth) {
+            RT_STAT(max_depth, 1);
+            continue;
+        }
+        color throughput = color(tr[path], tg[path], tb[path]) *
+                           color(ar[path], ag[path], ab[path]);
+        if (depth[path] >= limits.roulette_depth) {
+            auto survival = std::min<real>(
+                0.95, std::max({throughput.x(), throughput.y(),
+                                throughput.z()}));
+            if (generators[path].next_double() >= survival) {
+                RT_STAT(roulette, 1);
+                continue;
+            }
+            throughput /= survival;
+        }
+        tr[path] = throughput.x();
+        tg[path] = throughput.y();
+        tb[path] = throughput.z();
+        next.push_back(path);
+    }
+    active.swap(next);
+}
+
+void wavefront_engine::render_tile(const tile& t,
+                                   int target,
+                                   std::vector<pixel_estimator>& estimators,
+                                   framebuffer& result, aov_buffer* aovs) {
+    RT_STAGE_TIMER(timer_integrate);
+    current = t;
+    this->aovs = aovs;
+    int tw = t.x1 - t.x0, pixels = t.pixel_count();
+    samplers.resize(pixels);
+    next_sample.resize(pixels);
+    sums.resize(pixels);
+    for (int k = 0; k < pixels; k++) {
+        int i = t.x0 + k % tw, j = t.y0 + k / tw;
+        samplers[k] = pixel_sampler(sampler, i, j, w, seed);
+        next_sample[k] = result.samples(i, j);
+        sums[k] = result.sum(i, j);
+    }
+    pixel_estimator unused;
+    auto estimator = [&](int k) -> pixel_estimator& {
+        if (estimators.empty()) return unused;
+        return estimators[(t.y0 + k / tw) * w + t.x0 + k % tw];
+    };
+
+    // a batch takes a sample of every pixel per round, adaptive sampling
+    // needs the samples of a round before it can start the next one
+    int rounds = adaptive.enabled() ? 1 : std::max(1, batch_size / pixels);
+    resize(rounds * pixels, aovs != nullptr);
+    for (;;) {
+        int batch = 0;
+        active.clear();
+        for (int round = 0; round < rounds; round++) {
+            for (int k = 0; k < pixels; k++) {
+                if (next_sample[k] >= target ||
+                    adaptive.converged(estimator(k)))
+                    continue;
+                generate(batch++, k, next_sample[k]++);
+            }
+        }
+        if (batch == 0) break;
+        if (limits.max_depth <= 0) {
+            active.clear();
+            if (aovs)
+                for (int path = 0; path < batch; path++)
+                    first[path] =
+                        first_hit_aovs(current_ray(path), nullptr, *lights);
+        }
+        while (!active.empty()) {
+            extend();
+            if (active.empty()) break;
+            shade();
+            connect();
+            continue_paths();
+        }
+        // samples are added in generation order, which is sample order
+        // within each pixel
+        for (int path = 0; path < batch; path++) {
+            int k = path_pixel[path];
+            sums[k] += color_sum(radiance[path]);
+            if (adaptive.enabled()) estimator(k).add(radiance[path]);
+            if (aovs)
+                aovs->add(t.x0 + k % tw, t.y0 + k / tw, first[path],
+                          radiance[path]);
+        }
+    }
+    // every path generated has ended
+    for (int k = 0; k < pixels; k++)
+        result.set(t.x0 + k % tw, t.y0 + k / tw, sums[k], next_sample[k]);
+}
+
+#endif